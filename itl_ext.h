@@ -0,0 +1,60 @@
+/*
+ * itl_ext.h - native extension modules for ITL
+ *
+ * An extension is a DLL that exports
+ *
+ *     __declspec(dllexport) int itl_ext_init(const ItlExtApi *api);
+ *
+ * ITL calls it once when the DLL is loaded with ':load' or --ext. It
+ * checks api->abi and registers its functions with api->define(), then
+ * returns 1, or 0 to refuse to load. Functions take and return numbers,
+ * like sin() or atan2(), and are called by name from ITL code:
+ *
+ *     static double discount(const double *args, int nargs) {
+ *         return args[0] * pow(1.0 + args[1], -args[2]);
+ *     }
+ *
+ *     __declspec(dllexport) int itl_ext_init(const ItlExtApi *api) {
+ *         if (api->abi != ITL_EXT_ABI) return 0;
+ *         return api->define("discount", 3, ITL_EXT_PURE, discount);
+ *     }
+ *
+ * Build (MinGW/MSYS2), then load with ':load pricing.dll':
+ *   gcc -O2 -shared -I. -o pricing.dll pricing.c
+ *
+ * A bare file name is looked for in the directories of ITL_EXT_PATH
+ * (separated by ';') before the usual DLL search.
+ *
+ * ITL_EXT_ABI changes only when this interface changes incompatibly.
+ */
+#ifndef ITL_EXT_H
+#define ITL_EXT_H
+
+#define ITL_EXT_ABI   1
+#define ITL_EXT_ENTRY "itl_ext_init"
+
+/* Flags of define() */
+#define ITL_EXT_PURE  1   /* result depends only on the arguments: no
+                             output, no state, no warnings. The optimizer
+                             may cache or precompute such calls. */
+
+/* args[0..nargs-1]; nargs is at least the count given to define() and
+   at most 8. A call with fewer arguments is an unknown function. */
+typedef double (*ItlExtFn)(const double *args, int nargs);
+
+typedef struct ItlExtApi {
+    int abi;   /* ITL_EXT_ABI of the interpreter */
+
+    /* Register name(args) with at least nargs arguments. The name must be
+       lowercase letters and digits, starting with a letter, and must not
+       be a builtin or an already loaded function. Returns 1, or 0 after
+       ITL printed why not. */
+    int (*define)(const char *name, int nargs, int flags, ItlExtFn fn);
+
+    /* Print a warning line on the ITL screen */
+    void (*warn)(const char *msg);
+} ItlExtApi;
+
+typedef int (*ItlExtInit)(const ItlExtApi *api);
+
+#endif
@@ -20,10 +20,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
 #include <time.h>
+#include <malloc.h>
 #include <curses.h>
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include "itl_ext.h"
 
 #define MAX_LINE_LENGTH 4096
 #define MAX_LINES 100000
@@ -60,17 +65,33 @@ typedef struct {
     } data;
 } Value;
 
+/* Array selected by '@[h]' */
+#define ARRAY_MAX 256
+typedef struct Array {
+    double *data;
+    char **str;                /* String elements, NULL where numeric; allocated on first use */
+    int size, cap;             /* Elements in use and allocated; a view's length */
+    int reserved;              /* data is an ARRAY_RESERVE region committed up to cap */
+    struct Array *base;        /* View: the array it aliases, NULL for an ordinary array */
+    int off, stride;           /* View: element i is base element off + i*stride */
+} Array;
+
 /* Global variables */
 Value variables[NUM_VARS];     /* A-Z plus '_' (index 26) */
 char **source_lines;           /* Source code lines */
 int line_count;                /* Total number of lines */
 int current_line;              /* Current executing line (1-based) */
-double *array_data;            /* Dynamic array */
-int array_size;                /* Current array size */
+unsigned long long lines_executed = 0; /* Lines run by execute_from_line() */
+Array arrays[ARRAY_MAX];       /* Numbered arrays; '@' alone is array 0 */
+int adim_rank = 0;             /* Dimensions declared by adim(), 0 if none */
+double adim_shape[3];          /* rows, cols, depth (1 for 2-D) */
+int check_bounds = 0;          /* --check-bounds: report @(...) outside the shape */
+int pin_cpu = -1;              /* --cpu N: processor the interpreter runs on */
 int in_forward_ref = 0;        /* Flag to prevent infinite recursion */
 int repl_mode = 0;             /* Flag for REPL mode */
 int show_assignments = 0;      /* Flag to show assignment results */
 int need_newline = 0;          /* Track if output ended without '\n' */
+unsigned eval_side_effects = 0; /* Forward references run, math and @ errors */
 
 /* REPL command history */
 #define REPL_HISTORY_MAX 500
@@ -105,6 +126,12 @@ static volatile int g_tmouse_drag  = 0;  /* bit mask: 1=left, 2=right, 4=middle
 static LARGE_INTEGER g_timer_freq    = {0};
 static LARGE_INTEGER g_timer_start   = {0};
 static LARGE_INTEGER g_timer_elapsed = {0};
+/* Virtual clock (--virtual-clock): milliseconds per line and per frame */
+static int    g_vclock      = 0;
+static double g_vclock_line  = 0.0;
+static double g_vclock_frame = 0.0;
+static double g_vclock_frames  = 0.0;   /* grefresh() calls */
+static double g_vclock_elapsed = 0.0;   /* virtual ms at the last elapsed() */
 
 BOOL WINAPI ctrl_handler(DWORD ctrl_type) {
     if (ctrl_type == CTRL_C_EVENT || ctrl_type == CTRL_BREAK_EVENT) {
@@ -133,17 +160,37 @@ typedef struct {
 /* Forward declarations */
 void init_interpreter(void);
 void cleanup_interpreter(void);
+void eval_free(void);
+Array *array_handle(double h);
+Array *array_arg(Value *args, int nargs, int i);
+void array_ensure(Array *a, int size);
+void array_store(Array *a, int index, Value val);
+Value array_load(const Array *a, int index);
+const char *array_peek(const Array *a, int index, double *num);
+int array_index(double x);
+double array_offset(const double *c, int n);
+void array_free(void);
+void regex_free(void);
+const char *intern_string(const char *s, size_t len, int insert);
+const char *intern_literal(const char *src, size_t len);
+int is_interned(const char *p);
+void intern_free(void);
+int ext_load(const char *file, int verbose);
+void ext_preload(void);
+void ext_free(void);
 int load_source(const char *filename);
 void execute_program(void);
 void execute_from_line(int start_line);
 Value evaluate_expression(ParseContext *ctx);
 Value parse_primary(ParseContext *ctx);
+Value parse_index(ParseContext *ctx);
 void execute_line(int line_num);
 int  execute_repl_command(const char *cmd);
 void set_variable(int var_index, Value val);
 Value get_variable(int var_index);
 void free_value(Value *val);
 Value copy_value(Value val);
+Value share_value(Value val);
 void error(int line_num, const char *line, const char *message);
 char *value_to_string(Value val);
 double value_to_number(Value val);
@@ -157,6 +204,23 @@ void print_repl_screen_help(void);
 void add_repl_line(const char *line);
 Value call_math_function(const char *name, double *args, int nargs);
 Value call_screen_function(const char *name, Value *args, int nargs);
+Value call_string_function(const char *name, Value *args, int nargs);
+Value call_regex_function(const char *name, Value *args, int nargs);
+Value call_table_function(const char *name, Value *args, int nargs);
+void table_free(void);
+Value call_heap_function(const char *name, Value *args, int nargs);
+void heap_free(void);
+Value call_deque_function(const char *name, Value *args, int nargs);
+void deque_free(void);
+Value call_bitset_function(const char *name, Value *args, int nargs);
+void bitset_free(void);
+int  analyze_program(int fresh);
+void analysis_free(void);
+void licm_build(void);
+void optimize_program(void);
+void optimizer_free(void);
+void repl_disasm(const char *arg, int explain);
+void hoist_free(void);
 static void gfx_open(int w, int h);
 static void gfx_refresh(void);
 
@@ -285,6 +349,166 @@ static void gfx_refresh(void) {
     if (g_hwnd) InvalidateRect(g_hwnd, NULL, FALSE);
 }
 
+/* ------------------------------------------------------------------ */
+/* Record and replay (--record file, --replay file)                     */
+/*                                                                      */
+/* Everything a program reads from outside is an event: the RNG seed,  */
+/* each '?' line, each ':' key poll and each result of a screen        */
+/* function that reads the keyboard, mouse, window size or clock.      */
+/* --record appends the events to a text file, one per line:           */
+/*                                                                      */
+/*   <ms since start> <source> <value>                                  */
+/*                                                                      */
+/* A run of ':' polls that find no key is one line, "<ms> key -1 N",   */
+/* so a program busy-waiting for a key does not grow the file by a     */
+/* line per poll.                                                       */
+/*                                                                      */
+/* --replay reads them back in order instead of asking the user or the */
+/* system, so a run takes the same path as the recorded one and does   */
+/* not wait for input. The optimizer never caches or drops a line that */
+/* reads input, so a recording replays under any engine options. If    */
+/* the program asks for a different source than the next event, or the */
+/* file ends, replay stops with a warning and input is live again.     */
+/* ------------------------------------------------------------------ */
+#define REC_TAG "ITL-RECORDING 1"
+
+static FILE *rec_out = NULL;    /* --record */
+static FILE *rec_in  = NULL;    /* --replay */
+static long  rec_events = 0;    /* events read back so far */
+static double rec_idle_out = 0; /* empty key polls not yet written */
+static double rec_idle_ms;      /* time of the first of them */
+static double rec_idle_in = 0;  /* empty key polls left to replay */
+
+static double rec_ms(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - g_timer_start.QuadPart) * 1000.0
+           / (double)g_timer_freq.QuadPart;
+}
+
+/* Open the --record and --replay files; 0 after an error message */
+static int rec_open(const char *record, const char *replay) {
+    char tag[32];
+    if (replay) {
+        rec_in = fopen(replay, "r");
+        if (!rec_in || !fgets(tag, sizeof(tag), rec_in) || strncmp(tag, REC_TAG, strlen(REC_TAG)) != 0) {
+            fprintf(stderr, "Error: '%s' is not an ITL recording\n", replay);
+            return 0;
+        }
+    }
+    if (record) {
+        rec_out = fopen(record, "w");
+        if (!rec_out) {
+            fprintf(stderr, "Error: Cannot create file '%s'\n", record);
+            return 0;
+        }
+        fprintf(rec_out, "%s\n", REC_TAG);
+    }
+    return 1;
+}
+
+/* Write the pending run of empty key polls */
+static void rec_flush_idle(void) {
+    if (!rec_out || rec_idle_out == 0) return;
+    if (rec_idle_out == 1)
+        fprintf(rec_out, "%.3f key %d\n", rec_idle_ms, ERR);
+    else
+        fprintf(rec_out, "%.3f key %d %.15g\n", rec_idle_ms, ERR, rec_idle_out);
+    rec_idle_out = 0;
+}
+
+static void rec_close(void) {
+    rec_flush_idle();
+    if (rec_out) fclose(rec_out);
+    if (rec_in) fclose(rec_in);
+    rec_out = rec_in = NULL;
+}
+
+/* Next recorded event of the given source into buf (its value text);
+   0 when not replaying or after the warning that replay stopped */
+static int rec_next(const char *source, char *buf, size_t size) {
+    char line[MAX_LINE_LENGTH + 64], *p, *end;
+    if (!rec_in) return 0;
+    if (rec_idle_in > 0) {
+        printw("Warning: replay: event %ld repeats key, not %s; input is live from here\n",
+               rec_events, source);
+    } else if (fgets(line, sizeof(line), rec_in)) {
+        strtod(line, &p);
+        while (*p == ' ') p++;
+        size_t n = strlen(source);
+        if (strncmp(p, source, n) == 0 && (p[n] == ' ' || p[n] == '\n')) {
+            p += n + (p[n] == ' ');
+            if ((end = strchr(p, '\n')) != NULL) *end = '\0';
+            snprintf(buf, size, "%s", p);
+            rec_events++;
+            return 1;
+        }
+        printw("Warning: replay: event %ld is not %s; input is live from here\n",
+               rec_events + 1, source);
+    } else {
+        printw("Warning: replay: recording ends after %ld events; input is live from here\n",
+               rec_events);
+    }
+    refresh();
+    fclose(rec_in);
+    rec_in = NULL;
+    return 0;
+}
+
+/* Replay a number from source into *x; 0 if it must be read live */
+static int rec_replay_num(const char *source, double *x) {
+    char buf[64];
+    if (!rec_next(source, buf, sizeof(buf))) return 0;
+    *x = strtod(buf, NULL);
+    return 1;
+}
+
+static void rec_num(const char *source, double x) {
+    rec_flush_idle();
+    if (rec_out) fprintf(rec_out, "%.3f %s %.17g\n", rec_ms(), source, x);
+}
+
+static void rec_text(const char *source, const char *text) {
+    rec_flush_idle();
+    if (rec_out) fprintf(rec_out, "%.3f %s %s\n", rec_ms(), source, text);
+}
+
+/* Replay a ':' key poll into *key; 0 if it must be read live */
+static int rec_replay_key(int *key) {
+    char buf[64], *end;
+    if (rec_in && rec_idle_in > 0) {
+        rec_idle_in--;
+        *key = ERR;
+        return 1;
+    }
+    if (!rec_next("key", buf, sizeof(buf))) return 0;
+    *key = (int)strtod(buf, &end);
+    double n = strtod(end, NULL);
+    if (*key == ERR && n > 1) rec_idle_in = n - 1;
+    return 1;
+}
+
+static void rec_key(int key) {
+    if (!rec_out) return;
+    if (key != ERR) {
+        rec_num("key", key);
+    } else if (rec_idle_out++ == 0) {
+        rec_idle_ms = rec_ms();
+    }
+}
+
+/* Screen functions whose result comes from outside the program */
+static int rec_screen_input(const char *name) {
+    static const char *inputs[] = {
+        "getch", "getw", "geth", "tmx", "tmy", "tmclick", "tmdrag",
+        "gmx", "gmy", "gmb", "gmclick", "gmdrag", "time", "ticks", "elapsed",
+        NULL
+    };
+    for (int i = 0; inputs[i]; i++)
+        if (strcmp(name, inputs[i]) == 0) return 1;
+    return 0;
+}
+
 /* ------------------------------------------------------------------ */
 /* Initialize interpreter state                                         */
 /* ------------------------------------------------------------------ */
@@ -294,19 +518,21 @@ void init_interpreter(void) {
     for (i = 0; i < NUM_VARS; i++)
         variables[i].type = TYPE_UNDEFINED;
 
-    array_size = 0;
-    array_data = NULL;
+    memset(arrays, 0, sizeof(arrays));
+
+    QueryPerformanceFrequency(&g_timer_freq);
+    QueryPerformanceCounter(&g_timer_start);
+    g_timer_elapsed = g_timer_start;
 
     /* Seed RNG from current time so each run produces a new sequence */
-    srand((unsigned int)time(NULL));
+    double seed;
+    if (!rec_replay_num("seed", &seed)) seed = (double)(unsigned int)time(NULL);
+    rec_num("seed", seed);
+    srand((unsigned int)seed);
 
     source_lines = NULL;
     line_count = 0;
     current_line = 0;
-
-    QueryPerformanceFrequency(&g_timer_freq);
-    QueryPerformanceCounter(&g_timer_start);
-    g_timer_elapsed = g_timer_start;
 }
 
 /* ------------------------------------------------------------------ */
@@ -315,10 +541,8 @@ void init_interpreter(void) {
 void cleanup_interpreter(void) {
     int i;
 
-    for (i = 0; i < NUM_VARS; i++) {
-        if (variables[i].type == TYPE_STRING && variables[i].data.str)
-            free(variables[i].data.str);
-    }
+    for (i = 0; i < NUM_VARS; i++)
+        free_value(&variables[i]);
 
     if (source_lines) {
         for (i = 0; i < line_count; i++)
@@ -326,8 +550,16 @@ void cleanup_interpreter(void) {
         free(source_lines);
     }
 
-    if (array_data)
-        free(array_data);
+    array_free();
+
+    eval_free();
+    regex_free();
+    table_free();
+    heap_free();
+    deque_free();
+    bitset_free();
+    intern_free();
+    ext_free();
 
     if (g_hwnd) SendMessage(g_hwnd, WM_DESTROY, 0, 0);
     if (g_gfx_thread) { WaitForSingleObject(g_gfx_thread, 1000); CloseHandle(g_gfx_thread); }
@@ -337,6 +569,415 @@ void cleanup_interpreter(void) {
     if (g_brush)   DeleteObject(g_brush);
     if (g_hwnd)    DeleteCriticalSection(&g_gfx_cs);
 
+    optimizer_free();
+}
+
+/* ------------------------------------------------------------------ */
+/* Arrays                                                               */
+/*                                                                      */
+/* '@[h]' selects array h, 0 to ARRAY_MAX-1; '@' alone is array 0,     */
+/* which the builtins that fill or read an array use unless given a    */
+/* handle. Each array keeps its own capacity and doubles it when an    */
+/* index passes the end, so filling one element at a time does not     */
+/* reallocate every store.                                             */
+/*                                                                      */
+/* aview() turns an array into a view: a fixed number of elements that */
+/* alias another array at an offset and stride, such as one column of  */
+/* a matrix. A view owns no storage. Its base is always resolved to an */
+/* ordinary array when it is made, so an access follows one link      */
+/* unless the base is itself turned into a view later.                 */
+/*                                                                      */
+/* Once an array needs ARRAY_BIG elements its numbers move to a region */
+/* of address space reserved for the largest possible array, and later */
+/* growth only commits more of it. Nothing is copied again, the pages  */
+/* Windows commits are already zero, and the data is page-aligned.     */
+/* ------------------------------------------------------------------ */
+
+#define ARRAY_BIG     (1 << 17)                        /* 1 MB of numbers */
+#define ARRAY_RESERVE ((size_t)INT_MAX * sizeof(double))
+
+/* Make room for cap numbers in a reserved region, moving the data into
+   one first. 0 if there is no address space to reserve (32-bit). */
+static int array_commit(Array *a, int cap) {
+    if (!a->reserved) {
+        if (sizeof(void *) < 8) return 0;
+        double *d = (double *)VirtualAlloc(NULL, ARRAY_RESERVE, MEM_RESERVE, PAGE_READWRITE);
+        if (!d) return 0;
+        if (!VirtualAlloc(d, (size_t)cap * sizeof(double), MEM_COMMIT, PAGE_READWRITE)) {
+            VirtualFree(d, 0, MEM_RELEASE);
+            return 0;
+        }
+        if (a->size) memcpy(d, a->data, (size_t)a->size * sizeof(double));
+        free(a->data);
+        a->data = d;
+        a->reserved = 1;
+    } else if (!VirtualAlloc(a->data, (size_t)cap * sizeof(double), MEM_COMMIT, PAGE_READWRITE)) {
+        endwin();
+        fprintf(stderr, "Error: out of memory for %d array elements\n", cap);
+        exit(1);
+    }
+    return 1;
+}
+
+/* Array numbered h, or NULL after a warning. Like a division by zero,
+   the warning keeps loop-invariant caching from reusing the result. */
+Array *array_handle(double h) {
+    if (h >= 0.0 && h < ARRAY_MAX && h == (int)h) return &arrays[(int)h];
+    printw("Warning: @: no array %.15g (0-%d)\n", h, ARRAY_MAX - 1);
+    refresh();
+    eval_side_effects++;
+    return NULL;
+}
+
+/* Array given by the optional handle argument i of a builtin, array 0
+   without one; NULL after a warning */
+Array *array_arg(Value *args, int nargs, int i) {
+    return i < nargs ? array_handle(value_to_number(args[i])) : &arrays[0];
+}
+
+/* Grow the array to at least 'size' elements; new elements are 0.
+   A view keeps its length. */
+void array_ensure(Array *a, int size) {
+    if (size <= a->size || a->base) return;
+    if (size > a->cap) {
+        int cap = a->cap ? a->cap : 16;
+        while (cap < size) cap = cap > INT_MAX / 2 ? size : cap * 2;
+        if (cap < ARRAY_BIG || !array_commit(a, cap))
+            a->data = (double *)realloc(a->data, cap * sizeof(double));
+        if (a->str) a->str = (char **)realloc(a->str, cap * sizeof(char *));
+        a->cap = cap;
+    }
+    if (!a->reserved)
+        for (int i = a->size; i < size; i++) a->data[i] = 0.0;
+    if (a->str)
+        for (int i = a->size; i < size; i++) a->str[i] = NULL;
+    a->size = size;
+}
+
+/* Empty the array; a view becomes an ordinary array again */
+static void array_clear(Array *a) {
+    if (a->str) {
+        for (int i = 0; i < a->size; i++)
+            if (a->str[i] && !is_interned(a->str[i])) free(a->str[i]);
+        free(a->str);
+    }
+    if (a->reserved)
+        VirtualFree(a->data, 0, MEM_RELEASE);
+    else
+        free(a->data);
+    a->data = NULL;
+    a->str = NULL;
+    a->size = a->cap = 0;
+    a->reserved = 0;
+    a->base = NULL;
+}
+
+void array_free(void) {
+    for (int h = 0; h < ARRAY_MAX; h++)
+        array_clear(&arrays[h]);
+    adim_rank = 0;
+}
+
+/* Ordinary array holding element *index of a, which is updated; NULL
+   past the end of a view */
+static Array *array_elem(const Array *a, int *index) {
+    while (a->base) {
+        if ((unsigned)*index >= (unsigned)a->size) return NULL;
+        *index = a->off + *index * a->stride;
+        a = a->base;
+    }
+    return (Array *)a;
+}
+
+/* aview(v, src, off, len[, stride]) makes array v a view of src;
+   aview(v) makes it an ordinary, empty array again. Gives the length. */
+static double array_view(const double *args, int nargs) {
+    Array *v = array_handle(args[0]);
+    if (!v) return 0.0;
+    if (nargs == 1) {
+        if (v->base) array_clear(v);
+        return 0.0;
+    }
+    Array *src = nargs >= 4 ? array_handle(args[1]) : NULL;
+    if (!src) {
+        if (nargs < 4) printw("Warning: aview: needs (v, src, off, len[, stride])\n");
+        refresh();
+        return 0.0;
+    }
+    double off = args[2], len = args[3], stride = nargs > 4 ? args[4] : 1.0;
+    if (!(off >= 0.0 && off < INT_MAX && len >= 1.0 && len < INT_MAX &&
+          fabs(stride) < INT_MAX && off == (int)off && len == (int)len && stride == (int)stride)) {
+        printw("Warning: aview: bad offset %.15g, length %.15g or stride %.15g\n", off, len, stride);
+        refresh();
+        return 0.0;
+    }
+    /* Follow src down to an ordinary array, checking the range on the way */
+    double last = off + (len - 1.0) * stride;
+    Array *root = src;
+    while (root->base) {
+        if (!(off >= 0.0 && off < root->size && last >= 0.0 && last < root->size)) {
+            printw("Warning: aview: range outside view of length %d\n", root->size);
+            refresh();
+            return 0.0;
+        }
+        off = root->off + off * root->stride;
+        last = root->off + last * root->stride;
+        stride *= root->stride;
+        root = root->base;
+    }
+    if (root == v || !(last >= 0.0 && last < INT_MAX - 1)) {
+        printw(root == v ? "Warning: aview: array cannot view itself\n"
+                         : "Warning: aview: range outside the array\n");
+        refresh();
+        return 0.0;
+    }
+    array_clear(v);
+    v->base = root;
+    v->off = (int)off;
+    v->stride = (int)stride;
+    v->size = (int)len;
+    return len;
+}
+
+/* ------------------------------------------------------------------ */
+/* Array elements as values                                             */
+/*                                                                      */
+/* Strings live in str beside data, which keeps the number each       */
+/* string converts to, so numeric users such as join() and the heaps   */
+/* read data alone. str is only allocated once a string is stored, and */
+/* strings equal to a literal share its copy.                          */
+/* ------------------------------------------------------------------ */
+
+/* Store val at index, which must be below a->size. Through a view the
+   aliased array grows as needed, and stores past the view's end are
+   dropped. */
+void array_store(Array *a, int index, Value val) {
+    if (a->base) {
+        if (!(a = array_elem(a, &index))) return;
+        array_ensure(a, index + 1);
+    }
+    char *old = a->str ? a->str[index] : NULL;
+    a->data[index] = value_to_number(val);
+    if (val.type == TYPE_STRING) {
+        if (!a->str) a->str = (char **)calloc(a->cap, sizeof(char *));
+        a->str[index] = share_value(val).data.str;
+    } else if (old) {
+        a->str[index] = NULL;
+    }
+    if (old && !is_interned(old)) free(old);
+}
+
+/* Element index without copying: its string, or NULL with only *num
+   set. 0 past the end or for a rejected index of -1. */
+const char *array_peek(const Array *a, int index, double *num) {
+    if (a->base) a = array_elem(a, &index);
+    if (!a || (unsigned)index >= (unsigned)a->size) {
+        *num = 0.0;
+        return NULL;
+    }
+    *num = a->data[index];
+    return a->str ? a->str[index] : NULL;
+}
+
+/* Element index as a value */
+Value array_load(const Array *a, int index) {
+    Value v;
+    double num;
+    const char *str = array_peek(a, index, &num);
+    if (str) {
+        v.type = TYPE_STRING;
+        v.data.str = (char *)str;
+        return copy_value(v);
+    }
+    v.type = TYPE_NUMBER;
+    v.data.num = num;
+    return v;
+}
+
+/* Index for the number x: negative is 0, NaN (a rejected @(...)) is -1 */
+int array_index(double x) {
+    if (x != x) return -1;
+    if (x <= 0.0) return 0;
+    return x < (double)(INT_MAX - 1) ? (int)x : INT_MAX - 1;   /* index + 1 fits */
+}
+
+/* ------------------------------------------------------------------ */
+/* Multi-dimensional indexing                                           */
+/*                                                                      */
+/* adim(rows, cols[, depth]) declares the shape that @(i,j) and         */
+/* @(i,j,k) use for every array. Elements are stored row-major, so      */
+/* @(i,j) is element i*cols+j and @(i,j,k) is (i*cols+j)*depth+k. The   */
+/* address is worked out here rather than by interpreted arithmetic.    */
+/* With --check-bounds a coordinate outside the shape is reported and   */
+/* the access skipped; without it only the final index is clamped.     */
+/* ------------------------------------------------------------------ */
+
+/* adim(): element count of the new shape, 0 if a size is below 1 */
+static double array_dim(const double *args, int nargs) {
+    int n = nargs < 3 ? nargs : 3;
+    for (int i = 0; i < n; i++) {
+        if (!(args[i] >= 1.0 && args[i] <= (double)INT_MAX)) {
+            printw("Warning: adim: size %.15g must be at least 1\n", args[i]);
+            refresh();
+            return 0.0;
+        }
+    }
+    for (int i = 0; i < 3; i++) adim_shape[i] = i < n ? floor(args[i]) : 1.0;
+    adim_rank = n;
+    return adim_shape[0] * adim_shape[1] * adim_shape[2];
+}
+
+/* Element index of the coordinates c[0..n-1], NaN after a warning
+   (which, as in array_handle(), counts as a side effect) */
+double array_offset(const double *c, int n) {
+    double x[3] = { 0.0, 0.0, 0.0 };
+    int bad = 0;
+    if (!adim_rank) {
+        printw("Warning: @(): no shape, call adim() first\n");
+        refresh();
+        eval_side_effects++;
+        return NAN;
+    }
+    for (int i = 0; i < n && i < 3; i++) x[i] = trunc(c[i]);
+    if (check_bounds) {
+        bad = n != adim_rank;
+        for (int i = 0; i < 3; i++)
+            if (!(x[i] >= 0.0 && x[i] < adim_shape[i])) bad = 1;
+    }
+    if (bad) {
+        printw("Warning: @(");
+        for (int i = 0; i < n; i++) printw(i ? ",%.15g" : "%.15g", c[i]);
+        printw("): outside adim(%.15g,%.15g", adim_shape[0], adim_shape[1]);
+        if (adim_rank > 2) printw(",%.15g", adim_shape[2]);
+        printw(")\n");
+        refresh();
+        eval_side_effects++;
+        return NAN;
+    }
+    return (x[0] * adim_shape[1] + x[1]) * adim_shape[2] + x[2];
+}
+
+/* ------------------------------------------------------------------ */
+/* String interning                                                     */
+/*                                                                      */
+/* String literals evaluate to one shared copy per distinct text, kept  */
+/* until exit. Interned strings are never freed or duplicated by the    */
+/* value helpers, and two of them are equal exactly when their pointers */
+/* are. set_variable() reuses the interned copy when a runtime string   */
+/* has the same text as a literal, so (C="quit") is a pointer compare   */
+/* for input read into C as well. Runtime strings are only looked up,   */
+/* never added, so the table is bounded by the program's literals.      */
+/* ------------------------------------------------------------------ */
+#define INTERN_CHUNK 65536
+
+typedef struct InternChunk {
+    struct InternChunk *next;
+    size_t used, size;
+    char data[];
+} InternChunk;
+
+typedef struct {
+    unsigned hash;
+    size_t len;
+    const char *str;
+} InternSlot;
+
+static InternChunk *intern_chunks;  /* newest first */
+static InternSlot *intern_table;    /* open addressing, at most half full */
+static int intern_cap, intern_count;
+
+static unsigned intern_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/* Copy of s[0..len) in chunk storage */
+static const char *intern_store(const char *s, size_t len) {
+    InternChunk *c = intern_chunks;
+    if (!c || c->size - c->used < len + 1) {
+        size_t size = len + 1 > INTERN_CHUNK ? len + 1 : INTERN_CHUNK;
+        c = (InternChunk *)malloc(sizeof(InternChunk) + size);
+        c->used = 0;
+        c->size = size;
+        c->next = intern_chunks;
+        intern_chunks = c;
+    }
+    char *p = c->data + c->used;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    c->used += len + 1;
+    return p;
+}
+
+/* Interned copy of s[0..len); if absent, adds it when 'insert' is set,
+ * else returns NULL */
+const char *intern_string(const char *s, size_t len, int insert) {
+    unsigned h = intern_hash(s, len);
+    if (intern_cap) {
+        for (int i = h & (intern_cap - 1);; i = (i + 1) & (intern_cap - 1)) {
+            InternSlot *e = &intern_table[i];
+            if (!e->str) break;
+            if (e->hash == h && e->len == len && memcmp(e->str, s, len) == 0)
+                return e->str;
+        }
+    }
+    if (!insert) return NULL;
+
+    if (2 * (intern_count + 1) > intern_cap) {
+        int cap = intern_cap ? 2 * intern_cap : 256;
+        InternSlot *t = (InternSlot *)calloc(cap, sizeof(InternSlot));
+        for (int j = 0; j < intern_cap; j++) {
+            if (!intern_table[j].str) continue;
+            int i = intern_table[j].hash & (cap - 1);
+            while (t[i].str) i = (i + 1) & (cap - 1);
+            t[i] = intern_table[j];
+        }
+        free(intern_table);
+        intern_table = t;
+        intern_cap = cap;
+    }
+    int i = h & (intern_cap - 1);
+    while (intern_table[i].str) i = (i + 1) & (intern_cap - 1);
+    intern_table[i].hash = h;
+    intern_table[i].len = len;
+    intern_table[i].str = intern_store(s, len);
+    intern_count++;
+    return intern_table[i].str;
+}
+
+/* Interned copy of the literal text at src[0..len). A small cache keyed
+ * by source position skips hashing when the same literal runs again;
+ * the text is still compared since REPL lines reuse memory. */
+const char *intern_literal(const char *src, size_t len) {
+    static struct { const char *src, *str; size_t len; } cache[256];
+    unsigned i = (unsigned)(((uintptr_t)src >> 2) ^ len) & 255;
+    if (cache[i].src == src && cache[i].len == len && memcmp(cache[i].str, src, len) == 0)
+        return cache[i].str;
+    cache[i].src = src;
+    cache[i].len = len;
+    cache[i].str = intern_string(src, len, 1);
+    return cache[i].str;
+}
+
+/* True if p points into interned storage. Literal text rarely fills
+ * more than one chunk, so this is usually a single range check. */
+int is_interned(const char *p) {
+    uintptr_t a = (uintptr_t)p;
+    for (InternChunk *c = intern_chunks; c; c = c->next)
+        if (a - (uintptr_t)c->data < c->used) return 1;
+    return 0;
+}
+
+void intern_free(void) {
+    while (intern_chunks) {
+        InternChunk *next = intern_chunks->next;
+        free(intern_chunks);
+        intern_chunks = next;
+    }
+    free(intern_table);
+    intern_table = NULL;
+    intern_cap = intern_count = 0;
 }
 
 /* ------------------------------------------------------------------ */
@@ -344,7 +985,8 @@ void cleanup_interpreter(void) {
 /* ------------------------------------------------------------------ */
 void free_value(Value *val) {
     if (val->type == TYPE_STRING && val->data.str) {
-        free(val->data.str);
+        if (!is_interned(val->data.str))
+            free(val->data.str);
         val->data.str = NULL;
     }
     val->type = TYPE_UNDEFINED;
@@ -353,13 +995,23 @@ void free_value(Value *val) {
 Value copy_value(Value val) {
     Value result;
     result.type = val.type;
-    if (val.type == TYPE_STRING)
+    if (val.type == TYPE_STRING && !is_interned(val.data.str))
         result.data.str = _strdup(val.data.str);
     else
         result.data = val.data;
     return result;
 }
 
+/* Copy of val for long-term storage: a string with the text of a
+ * literal shares the literal's copy, see intern_string() */
+Value share_value(Value val) {
+    if (val.type == TYPE_STRING && !is_interned(val.data.str)) {
+        const char *p = intern_string(val.data.str, strlen(val.data.str), 0);
+        if (p) val.data.str = (char *)p;
+    }
+    return copy_value(val);
+}
+
 char *value_to_string(Value val) {
     char *result = (char *)malloc(MAX_STRING_LENGTH);
     if (val.type == TYPE_NUMBER) {
@@ -501,13 +1153,15 @@ static void split_and_store(const char *input, char ***lines, int *count, int *c
 /* ------------------------------------------------------------------ */
 /* Load source file (splits on top-level semicolons only)             */
 /* ------------------------------------------------------------------ */
+static int source_capacity = 0;   /* Allocated entries of source_lines */
+
 int load_source(const char *filename) {
     FILE *fp = fopen(filename, "r");
     if (!fp) return 0;
 
     char buffer[MAX_LINE_LENGTH];
-    int capacity = 1000;
-    source_lines = (char **)malloc(capacity * sizeof(char *));
+    source_capacity = 1000;
+    source_lines = (char **)malloc(source_capacity * sizeof(char *));
     line_count = 0;
 
     while (fgets(buffer, sizeof(buffer), fp)) {
@@ -515,7 +1169,7 @@ int load_source(const char *filename) {
         while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r'))
             buffer[--len] = '\0';
 
-        split_and_store(buffer, &source_lines, &line_count, &capacity);
+        split_and_store(buffer, &source_lines, &line_count, &source_capacity);
     }
 
     fclose(fp);
@@ -526,15 +1180,13 @@ int load_source(const char *filename) {
 /* Add a line to the REPL program (splitting on top-level semicolons) */
 /* ------------------------------------------------------------------ */
 void add_repl_line(const char *line) {
-    static int capacity = 0;
-
     if (source_lines == NULL) {
-        capacity = 1000;
-        source_lines = (char **)malloc(capacity * sizeof(char *));
+        source_capacity = 1000;
+        source_lines = (char **)malloc(source_capacity * sizeof(char *));
         line_count = 0;
     }
 
-    split_and_store(line, &source_lines, &line_count, &capacity);
+    split_and_store(line, &source_lines, &line_count, &source_capacity);
 }
 
 /* ------------------------------------------------------------------ */
@@ -557,10 +1209,8 @@ int is_operator_char(char c) {
 void set_variable(int var_index, Value val) {
     if (var_index < 0 || var_index >= NUM_VARS) return;
 
-    if (variables[var_index].type == TYPE_STRING && variables[var_index].data.str)
-        free(variables[var_index].data.str);
-
-    variables[var_index] = copy_value(val);
+    free_value(&variables[var_index]);
+    variables[var_index] = share_value(val);
 
     if (repl_mode && show_assignments) {
         printw("< %c = ", (char)VARCHAR(var_index));
@@ -583,6 +1233,7 @@ Value get_variable(int var_index) {
         char var_name = (char)VARCHAR(var_index);
         int saved_line = current_line;
         in_forward_ref = 1;
+        eval_side_effects++;
 
         for (int i = current_line; i < line_count; i++) {
             const char *line = source_lines[i];
@@ -601,17 +1252,186 @@ Value get_variable(int var_index) {
     return copy_value(variables[var_index]);
 }
 
+/* ------------------------------------------------------------------ */
+/* Fast approximate math (--fast-math)                                  */
+/*                                                                      */
+/* Straight-line polynomial kernels used by call_math_function() in     */
+/* place of libm. Measured bounds against libm over the normal range:   */
+/*   sin, cos    |x| <= 1e6: absolute error < 3e-16                     */
+/*   exp         relative error < 1e-15                                 */
+/*   log         relative error < 1e-15                                 */
+/*   pow         x > 0: relative error < 1e-15 * (1 + |y*log(x)|)       */
+/*   atan2       absolute error < 1e-15                                 */
+/*   hypot       relative error < 5e-16                                 */
+/* Arguments outside a kernel's range (huge angles, non-positive or     */
+/* subnormal log/pow bases, pow base 1, overflow, NaN, infinities) go   */
+/* to libm.                                                             */
+/* ------------------------------------------------------------------ */
+int fast_math = 0;
+
+#define FM_PIO2_HI 1.57079632673412561417e+00   /* pi/2, first 33 bits */
+#define FM_PIO2_LO 6.07710050650619224932e-11   /* pi/2 - FM_PIO2_HI */
+#define FM_LN2_HI  6.93147180369123816490e-01   /* ln 2, first 32 bits */
+#define FM_LN2_LO  1.90821492927058770002e-10   /* ln 2 - FM_LN2_HI */
+
+/* Round to nearest integer, for |x| < 2^51, without a library call */
+static double fm_round(double x) {
+    const double shifter = 6755399441055744.0;   /* 1.5 * 2^52 */
+    return (x + shifter) - shifter;
+}
+
+static double fm_bits_to_double(unsigned long long u) {
+    double d;
+    memcpy(&d, &u, sizeof d);
+    return d;
+}
+
+static unsigned long long fm_double_to_bits(double d) {
+    unsigned long long u;
+    memcpy(&u, &d, sizeof u);
+    return u;
+}
+
+/* sin(r) and cos(r) for |r| <= pi/4: Taylor terms to r^15 and r^16 */
+static double fm_sin_kernel(double r) {
+    double z = r * r;
+    return r + r * z * (-1.0 / 6 + z * (1.0 / 120 + z * (-1.0 / 5040 + z * (1.0 / 362880 +
+           z * (-1.0 / 39916800 + z * (1.0 / 6227020800.0 + z * (-1.0 / 1307674368000.0)))))));
+}
+
+static double fm_cos_kernel(double r) {
+    double z = r * r;
+    return 1.0 + z * (-0.5 + z * (1.0 / 24 + z * (-1.0 / 720 + z * (1.0 / 40320 +
+           z * (-1.0 / 3628800 + z * (1.0 / 479001600.0 + z * (-1.0 / 87178291200.0 +
+           z * (1.0 / 20922789888000.0))))))));
+}
+
+/* Reduce x to r in [-pi/4, pi/4] with x = r + q*pi/2; 0 if x is out of range */
+static int fm_reduce(double x, double *r, int *q) {
+    if (!(fabs(x) <= 1e6)) return 0;
+    double k = fm_round(x * (2.0 / M_PI));
+    *r = (x - k * FM_PIO2_HI) - k * FM_PIO2_LO;
+    *q = (int)k & 3;
+    return 1;
+}
+
+static double fm_sin(double x) {
+    double r;
+    int q;
+    if (!fm_reduce(x, &r, &q)) return sin(x);
+    switch (q) {
+        case 0:  return fm_sin_kernel(r);
+        case 1:  return fm_cos_kernel(r);
+        case 2:  return -fm_sin_kernel(r);
+        default: return -fm_cos_kernel(r);
+    }
+}
+
+static double fm_cos(double x) {
+    double r;
+    int q;
+    if (!fm_reduce(x, &r, &q)) return cos(x);
+    switch (q) {
+        case 0:  return fm_cos_kernel(r);
+        case 1:  return -fm_sin_kernel(r);
+        case 2:  return -fm_cos_kernel(r);
+        default: return fm_sin_kernel(r);
+    }
+}
+
+/* exp(x) = 2^k * exp(r), |r| <= ln(2)/2, Taylor terms to r^12 */
+static double fm_exp(double x) {
+    if (!(fabs(x) <= 708.0)) return exp(x);
+    double k = fm_round(x * M_LOG2E);
+    double r = (x - k * FM_LN2_HI) - k * FM_LN2_LO;
+    double p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 +
+               r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880 +
+               r * (1.0 / 3628800 + r * (1.0 / 39916800 + r * (1.0 / 479001600.0))))))))))));
+    return p * fm_bits_to_double((unsigned long long)((long long)k + 1023) << 52);
+}
+
+/* log(x) = e*ln(2) + 2*atanh(f), f = (m-1)/(m+1), m in [sqrt(1/2), sqrt(2)) */
+static double fm_log(double x) {
+    if (!(x >= 2.2250738585072014e-308 && x <= 1.7976931348623157e308)) return log(x);
+    unsigned long long u = fm_double_to_bits(x);
+    int e = (int)(u >> 52) - 1023;
+    double m = fm_bits_to_double((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    if (m > M_SQRT2) { m *= 0.5; e++; }
+    double f = (m - 1.0) / (m + 1.0);
+    double z = f * f;
+    double s = z * (2.0 / 3 + z * (2.0 / 5 + z * (2.0 / 7 + z * (2.0 / 9 + z * (2.0 / 11 +
+               z * (2.0 / 13 + z * (2.0 / 15 + z * (2.0 / 17 + z * (2.0 / 19)))))))));
+    return e * FM_LN2_HI + (2.0 * f + (f * s + e * FM_LN2_LO));
+}
+
+/* pow(1,y) is 1 even for an infinite or NaN y, where y*log(x) is NaN */
+static double fm_pow(double x, double y) {
+    if (!(x >= 2.2250738585072014e-308 && x <= 1.7976931348623157e308) || x == 1.0 ||
+        !(fabs(y) <= 1.7976931348623157e308))
+        return pow(x, y);
+    return fm_exp(y * fm_log(x));
+}
+
+/* atan(t) for 0 <= t <= 1: two half-angle steps leave |v| <= tan(pi/16),
+   then Taylor terms to v^21 */
+static double fm_atan01(double t) {
+    double v = t / (1.0 + sqrt(1.0 + t * t));
+    v = v / (1.0 + sqrt(1.0 + v * v));
+    double z = v * v;
+    double p = v + v * z * (-1.0 / 3 + z * (1.0 / 5 + z * (-1.0 / 7 + z * (1.0 / 9 +
+               z * (-1.0 / 11 + z * (1.0 / 13 + z * (-1.0 / 15 + z * (1.0 / 17 +
+               z * (-1.0 / 19 + z * (1.0 / 21))))))))));
+    return 4.0 * p;
+}
+
+static double fm_atan2(double y, double x) {
+    double ax = fabs(x), ay = fabs(y);
+    if (!(ax <= 1.7976931348623157e308 && ay <= 1.7976931348623157e308) || (ax == 0.0 && ay == 0.0))
+        return atan2(y, x);
+    double a = ay <= ax ? fm_atan01(ay / ax) : M_PI_2 - fm_atan01(ax / ay);
+    if (x < 0.0) a = M_PI - a;
+    return y < 0.0 || (y == 0.0 && signbit(y)) ? -a : a;
+}
+
+static double fm_hypot(double x, double y) {
+    double ax = fabs(x), ay = fabs(y);
+    double big = ax > ay ? ax : ay, small = ax > ay ? ay : ax;
+    if (!(big <= 1e150) || (small < 1e-150 && small != 0.0)) return hypot(x, y);
+    return sqrt(ax * ax + ay * ay);
+}
+
+/* Functions registered by extension modules, see Native extensions */
+#define EXT_MAX 256
+typedef struct {
+    char name[64];
+    int nargs, flags;
+    ItlExtFn fn;
+} ExtFn;
+
+static ExtFn ext_fns[EXT_MAX];
+static int ext_count = 0;
+
+static const ExtFn *ext_find(const char *name) {
+    for (int i = 0; i < ext_count; i++)
+        if (strcmp(ext_fns[i].name, name) == 0) return &ext_fns[i];
+    return NULL;
+}
+
 /* ------------------------------------------------------------------ */
 /* Math function dispatcher                                            */
+/*                                                                      */
+/* A name that is not a builtin may be a function of a loaded          */
+/* extension, which takes numbers the same way.                        */
 /* ------------------------------------------------------------------ */
 Value call_math_function(const char *name, double *args, int nargs) {
     Value result;
+    const ExtFn *x;
     result.type = TYPE_NUMBER;
     result.data.num = 0.0;
 
     /* 1-argument functions */
-    if      (strcmp(name, "sin")   == 0 && nargs >= 1) { result.data.num = sin(args[0]); }
-    else if (strcmp(name, "cos")   == 0 && nargs >= 1) { result.data.num = cos(args[0]); }
+    if      (strcmp(name, "sin")   == 0 && nargs >= 1) { result.data.num = fast_math ? fm_sin(args[0]) : sin(args[0]); }
+    else if (strcmp(name, "cos")   == 0 && nargs >= 1) { result.data.num = fast_math ? fm_cos(args[0]) : cos(args[0]); }
     else if (strcmp(name, "tan")   == 0 && nargs >= 1) { result.data.num = tan(args[0]); }
     else if (strcmp(name, "asin")  == 0 && nargs >= 1) { result.data.num = asin(args[0]); }
     else if (strcmp(name, "acos")  == 0 && nargs >= 1) { result.data.num = acos(args[0]); }
@@ -619,8 +1439,8 @@ Value call_math_function(const char *name, double *args, int nargs) {
     else if (strcmp(name, "sinh")  == 0 && nargs >= 1) { result.data.num = sinh(args[0]); }
     else if (strcmp(name, "cosh")  == 0 && nargs >= 1) { result.data.num = cosh(args[0]); }
     else if (strcmp(name, "tanh")  == 0 && nargs >= 1) { result.data.num = tanh(args[0]); }
-    else if (strcmp(name, "exp")   == 0 && nargs >= 1) { result.data.num = exp(args[0]); }
-    else if (strcmp(name, "log")   == 0 && nargs >= 1) { result.data.num = log(args[0]); }
+    else if (strcmp(name, "exp")   == 0 && nargs >= 1) { result.data.num = fast_math ? fm_exp(args[0]) : exp(args[0]); }
+    else if (strcmp(name, "log")   == 0 && nargs >= 1) { result.data.num = fast_math ? fm_log(args[0]) : log(args[0]); }
     else if (strcmp(name, "log2")  == 0 && nargs >= 1) { result.data.num = log2(args[0]); }
     else if (strcmp(name, "log10") == 0 && nargs >= 1) { result.data.num = log10(args[0]); }
     else if (strcmp(name, "sqrt")  == 0 && nargs >= 1) { result.data.num = sqrt(args[0]); }
@@ -635,17 +1455,22 @@ Value call_math_function(const char *name, double *args, int nargs) {
         result.data.num = (args[0] > 0) ? 1.0 : (args[0] < 0) ? -1.0 : 0.0;
     }
     /* 2-argument functions */
-    else if (strcmp(name, "atan2") == 0 && nargs >= 2) { result.data.num = atan2(args[0], args[1]); }
-    else if (strcmp(name, "pow")   == 0 && nargs >= 2) { result.data.num = pow(args[0], args[1]); }
+    else if (strcmp(name, "atan2") == 0 && nargs >= 2) { result.data.num = fast_math ? fm_atan2(args[0], args[1]) : atan2(args[0], args[1]); }
+    else if (strcmp(name, "pow")   == 0 && nargs >= 2) { result.data.num = fast_math ? fm_pow(args[0], args[1]) : pow(args[0], args[1]); }
     else if (strcmp(name, "fmod")  == 0 && nargs >= 2) { result.data.num = fmod(args[0], args[1]); }
-    else if (strcmp(name, "hypot") == 0 && nargs >= 2) { result.data.num = hypot(args[0], args[1]); }
+    else if (strcmp(name, "hypot") == 0 && nargs >= 2) { result.data.num = fast_math ? fm_hypot(args[0], args[1]) : hypot(args[0], args[1]); }
     else if (strcmp(name, "fmax")  == 0 && nargs >= 2) { result.data.num = fmax(args[0], args[1]); }
     else if (strcmp(name, "fmin")  == 0 && nargs >= 2) { result.data.num = fmin(args[0], args[1]); }
     else if (strcmp(name, "max")   == 0 && nargs >= 2) { result.data.num = fmax(args[0], args[1]); }
     else if (strcmp(name, "min")   == 0 && nargs >= 2) { result.data.num = fmin(args[0], args[1]); }
+    /* Shape of @(i,j) and @(i,j,k), and array views */
+    else if (strcmp(name, "adim")  == 0 && nargs >= 2) { result.data.num = array_dim(args, nargs); }
+    else if (strcmp(name, "aview") == 0 && nargs >= 1) { result.data.num = array_view(args, nargs); }
     /* Constants as zero-arg "functions" */
     else if (strcmp(name, "pi")    == 0) { result.data.num = M_PI; }
     else if (strcmp(name, "e")     == 0) { result.data.num = M_E; }
+    /* Extension functions */
+    else if ((x = ext_find(name)) != NULL && nargs >= x->nargs) { result.data.num = x->fn(args, nargs); }
     else {
         printw("Warning: unknown function '%s'\n", name);
         refresh();
@@ -656,1298 +1481,6361 @@ Value call_math_function(const char *name, double *args, int nargs) {
 }
 
 /* ------------------------------------------------------------------ */
-/* Screen function dispatcher (uses PDCurses API)                      */
+/* Minimum argument count of a math function, -1 if the name is unknown */
+/* ------------------------------------------------------------------ */
+static int math_function_arity(const char *name) {
+    static const struct { const char *name; int nargs; } math_funcs[] = {
+        {"sin", 1}, {"cos", 1}, {"tan", 1}, {"asin", 1}, {"acos", 1},
+        {"atan", 1}, {"sinh", 1}, {"cosh", 1}, {"tanh", 1}, {"exp", 1},
+        {"log", 1}, {"log2", 1}, {"log10", 1}, {"sqrt", 1}, {"cbrt", 1},
+        {"ceil", 1}, {"floor", 1}, {"round", 1}, {"trunc", 1}, {"fabs", 1},
+        {"abs", 1}, {"sign", 1},
+        {"atan2", 2}, {"pow", 2}, {"fmod", 2}, {"hypot", 2}, {"fmax", 2},
+        {"fmin", 2}, {"max", 2}, {"min", 2},
+        {"pi", 0}, {"e", 0},
+        {NULL, 0}
+    };
+    for (int i = 0; math_funcs[i].name; i++)
+        if (strcmp(name, math_funcs[i].name) == 0) return math_funcs[i].nargs;
+    return -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* String function dispatcher                                          */
+/*                                                                      */
+/* Positions are zero-based, like array indices. A number argument is  */
+/* used as its printed form. Escapes such as \n in a string literal    */
+/* are kept as written until printed, so they count as two characters. */
 /*                                                                      */
 /* Functions:                                                           */
-/*   gotoxy(x,y)       - move cursor; returns 1 on success, 0 on fail  */
-/*   putch(c)          - write char/string at cursor; returns old ASCII */
-/*   getch()           - read char code at cursor; returns ASCII or -1  */
-/*   setfore(color)    - set foreground color 0-7; returns 1/0          */
-/*   setback(color)    - set background color 0-7; returns 1/0          */
-/*   setattr(attr)     - set attribute 0=normal,1=bold,2=reverse        */
-/*   getw()            - return number of visible columns               */
-/*   geth()            - return number of visible rows                  */
-/*   clear()           - clear screen with current background color     */
+/*   len(s)            - number of characters                          */
+/*   mid(s,i[,n])      - n characters from position i (default: rest)  */
+/*   left(s,n)         - first n characters                            */
+/*   right(s,n)        - last n characters                             */
+/*   find(s,t[,i])     - position of t in s from i on, -1 if absent    */
+/*   ord(s)            - code of the first character, 0 if empty       */
+/*   chr(n)            - one-character string with code n (1-255)      */
+/*   upper(s)/lower(s) - ASCII case conversion                         */
+/*   trim(s)           - s without leading/trailing blanks             */
+/*   split(s,sep,i[,a]) - fields of s into @i, @i+1, ..., as numbers   */
+/*                       where they are numbers; returns the field     */
+/*                       count. sep "" splits on runs of blanks        */
+/*   join(i,n,sep[,a]) - @i .. @i+n-1 as one string, sep in between    */
+/* The optional a selects the array @[a], which may be a view.         */
+/*   rematch, refind, rereplace - see Regular expressions below        */
 /* ------------------------------------------------------------------ */
-Value call_screen_function(const char *name, Value *args, int nargs) {
+
+/* Text of argument i; numbers are formatted into 'buf' */
+static const char *string_arg(const Value *args, int nargs, int i, char *buf, size_t *len) {
+    const char *s;
+    if (i >= nargs)
+        s = "";
+    else if (args[i].type == TYPE_STRING)
+        s = args[i].data.str;
+    else if (args[i].type == TYPE_NUMBER) {
+        snprintf(buf, 32, "%.15g", args[i].data.num);
+        s = buf;
+    } else
+        s = "0";
+    *len = strlen(s);
+    return s;
+}
+
+/* Argument i as a position or count, clamped to [0, limit] */
+static size_t string_index(const Value *args, int nargs, int i, size_t dflt, size_t limit) {
+    if (i >= nargs) return dflt < limit ? dflt : limit;
+    double d = value_to_number(args[i]);
+    if (!(d > 0.0)) return 0;
+    return d < (double)limit ? (size_t)d : limit;
+}
+
+static Value string_result(const char *p, size_t n) {
+    Value v;
+    v.type = TYPE_STRING;
+    v.data.str = (char *)malloc(n + 1);
+    memcpy(v.data.str, p, n);
+    v.data.str[n] = '\0';
+    return v;
+}
+
+static int is_string_function(const char *name) {
+    static const char *string_funcs[] = {
+        "len", "mid", "left", "right", "find", "ord", "chr",
+        "upper", "lower", "trim",
+        "rematch", "refind", "rereplace", "split", "join",
+        NULL
+    };
+    for (int i = 0; string_funcs[i]; i++)
+        if (strcmp(name, string_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+Value call_string_function(const char *name, Value *args, int nargs) {
     Value result;
-    result.type  = TYPE_NUMBER;
+    char buf0[32], buf1[32];
+    size_t n0, n1;
+
+    if (name[0] == 'r' && name[1] == 'e')
+        return call_regex_function(name, args, nargs);
+
+    const char *s = string_arg(args, nargs, 0, buf0, &n0);
+    result.type = TYPE_NUMBER;
     result.data.num = 0.0;
 
-    /* gotoxy(x, y) -------------------------------------------------- */
-    if (strcmp(name, "gotoxy") == 0) {
-        if (nargs >= 2) {
-            int x    = (int)value_to_number(args[0]);
-            int y    = (int)value_to_number(args[1]);
-            int rows = 0, cols = 0;
-            getmaxyx(stdscr, rows, cols);
-            if (x >= 0 && x < cols && y >= 0 && y < rows) {
-                move(y, x);
-                refresh();
-                result.data.num = 1.0;
+    if (strcmp(name, "len") == 0) {
+        result.data.num = (double)n0;
+    } else if (strcmp(name, "mid") == 0) {
+        size_t i = string_index(args, nargs, 1, 0, n0);
+        result = string_result(s + i, string_index(args, nargs, 2, n0, n0 - i));
+    } else if (strcmp(name, "left") == 0) {
+        result = string_result(s, string_index(args, nargs, 1, 0, n0));
+    } else if (strcmp(name, "right") == 0) {
+        size_t n = string_index(args, nargs, 1, 0, n0);
+        result = string_result(s + n0 - n, n);
+    } else if (strcmp(name, "find") == 0) {
+        const char *t = string_arg(args, nargs, 1, buf1, &n1);
+        size_t i = string_index(args, nargs, 2, 0, n0);
+        const char *hit = n1 == 1 ? strchr(s + i, t[0]) : strstr(s + i, t);
+        result.data.num = hit ? (double)(hit - s) : -1.0;
+    } else if (strcmp(name, "ord") == 0) {
+        result.data.num = (double)(unsigned char)s[0];
+    } else if (strcmp(name, "chr") == 0) {
+        double c = nargs > 0 ? value_to_number(args[0]) : 0.0;
+        buf1[0] = (c >= 1.0 && c < 256.0) ? (char)(int)c : '\0';
+        result = string_result(buf1, buf1[0] ? 1 : 0);
+    } else if (strcmp(name, "upper") == 0 || strcmp(name, "lower") == 0) {
+        /* Branch-free per byte so the compiler can vectorise the loop */
+        unsigned char lo = name[0] == 'u' ? 'a' : 'A';
+        result = string_result(s, n0);
+        unsigned char *d = (unsigned char *)result.data.str;
+        for (size_t i = 0; i < n0; i++)
+            d[i] ^= (unsigned char)(((unsigned char)(d[i] - lo) < 26u) << 5);
+    } else if (strcmp(name, "split") == 0) {
+        const char *sep = string_arg(args, nargs, 1, buf1, &n1);
+        double d = nargs > 2 ? value_to_number(args[2]) : 0.0;
+        int at = d > 0.0 ? (d < (double)INT_MAX ? (int)d : INT_MAX) : 0;
+        Array *arr = array_arg(args, nargs, 3);
+        if (!arr) return result;
+        size_t *span = (size_t *)malloc((n0 + 1) * 2 * sizeof(size_t));
+        char *field = (char *)malloc(n0 + 1);
+        size_t i = 0;
+        int count = 0;
+        /* Find the fields first so the array grows only once */
+        while (i < n0) {
+            size_t a = i, b;
+            if (n1 == 0) {
+                while (a < n0 && (s[a] == ' ' || s[a] == '\t')) a++;
+                if (a == n0) break;
+                for (b = a; b < n0 && s[b] != ' ' && s[b] != '\t'; b++) ;
+                i = b;
+            } else {
+                const char *hit = strstr(s + a, sep);
+                b = hit ? (size_t)(hit - s) : n0;
+                i = hit ? b + n1 : n0;   /* a trailing sep adds no empty field */
             }
-            /* else result stays 0 (failure) */
+            span[2 * count] = a;
+            span[2 * count + 1] = b;
+            count++;
         }
-        return result;
-    }
-
-    /* putch(c) ------------------------------------------------------- */
-    if (strcmp(name, "putch") == 0) {
-        if (nargs >= 1) {
-            /* Capture the character currently at the cursor position */
-            chtype old_ch = inch();
-            result.data.num = (double)(old_ch & 0xFF);
-
-            apply_attrs();
-            if (args[0].type == TYPE_STRING) {
-                /* String argument: print the whole string */
-                const char *p = args[0].data.str;
-                while (*p) addch((unsigned char)*p++);
+        if (count > INT_MAX - at) count = INT_MAX - at;
+        array_ensure(arr, at + count);
+        for (int k = 0; k < count; k++) {
+            size_t a = span[2 * k], b = span[2 * k + 1];
+            Value v;
+            char *end;
+            memcpy(field, s + a, b - a);
+            field[b - a] = '\0';
+            v.type = TYPE_NUMBER;
+            v.data.num = strtod(field, &end);
+            while (*end == ' ' || *end == '\t') end++;
+            if (end == field || *end) {   /* not entirely a number: keep the text */
+                v.type = TYPE_STRING;
+                v.data.str = field;
+            }
+            array_store(arr, at + k, v);
+        }
+        free(field);
+        free(span);
+        result.data.num = (double)count;
+    } else if (strcmp(name, "join") == 0) {
+        double d = nargs > 0 ? value_to_number(args[0]) : 0.0;
+        double c = nargs > 1 ? value_to_number(args[1]) : 0.0;
+        const char *sep = string_arg(args, nargs, 2, buf1, &n1);
+        const Array *arr = array_arg(args, nargs, 3);
+        int at = d > 0.0 ? (d < (double)INT_MAX ? (int)d : INT_MAX) : 0;
+        int count = arr && at < arr->size ? arr->size - at : 0;   /* stop at the array end */
+        if (c < (double)count) count = c > 0.0 ? (int)c : 0;
+        /* "%.15g" needs at most 24 characters, so one allocation suffices */
+        size_t size = (size_t)count * (24 + n1) + 1;
+        double num;
+        for (int k = 0; k < count; k++) {
+            const char *str = array_peek(arr, at + k, &num);
+            if (str) size += strlen(str);
+        }
+        char *out = (char *)malloc(size);
+        size_t len = 0;
+        for (int k = 0; k < count; k++) {
+            const char *str = array_peek(arr, at + k, &num);
+            if (k > 0) { memcpy(out + len, sep, n1); len += n1; }
+            if (str) {
+                size_t n = strlen(str);
+                memcpy(out + len, str, n);
+                len += n;
             } else {
-                /* Numeric argument: treat as ASCII code */
-                int ch = (int)value_to_number(args[0]);
-                if (ch >= 0 && ch <= 255) {
-                    addch((unsigned char)ch);
-                } else {
-                    result.data.num = -1.0;
-                }
+                len += (size_t)snprintf(out + len, 25, "%.15g", num);
             }
-            refresh();
+        }
+        out[len] = '\0';
+        result.type = TYPE_STRING;
+        result.data.str = out;
+    } else if (strcmp(name, "trim") == 0) {
+        size_t a = 0, b = n0;
+        while (a < b && (s[a] == ' ' || s[a] == '\t' || s[a] == '\r' || s[a] == '\n')) a++;
+        while (b > a && (s[b - 1] == ' ' || s[b - 1] == '\t' || s[b - 1] == '\r' || s[b - 1] == '\n')) b--;
+        result = string_result(s + a, b - a);
+    }
+
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Regular expressions                                                  */
+/*                                                                      */
+/* A pattern is parsed into a small syntax tree and compiled to a      */
+/* Thompson NFA. The NFA is turned into a DFA lazily while matching:   */
+/* each distinct set of NFA states met becomes one DFA state with a    */
+/* 256-entry transition table, so scanning costs one table lookup per  */
+/* character. Compiled patterns are cached by their text.              */
+/*                                                                      */
+/* Syntax: literal characters, '.', [set], [^set], ranges a-z,          */
+/* \d \w \s \D \W \S, \n \t \r, '\' before any other character,         */
+/* groups ( ), alternation |, quantifiers * + ?, anchors ^ $.          */
+/* There are no captures or back-references. Matches are               */
+/* leftmost-longest.                                                    */
+/*                                                                      */
+/* Functions:                                                           */
+/*   rematch(s,p)       - 1 if p matches somewhere in s, else 0         */
+/*   refind(s,p[,i])    - position of the first match at or after i,    */
+/*                        -1 if none                                    */
+/*   rereplace(s,p,r)   - s with every match of p replaced by r         */
+/* ------------------------------------------------------------------ */
+#define RE_MAX_DEPTH   64     /* nested groups and stacked quantifiers */
+#define RE_MAX_DFA     1024   /* DFA states per pattern; flushed when full */
+#define RE_CACHE_SIZE  32
+
+/* Syntax tree */
+enum { RA_SET, RA_CAT, RA_ALT, RA_STAR, RA_PLUS, RA_QUEST, RA_BOL, RA_EOL, RA_EMPTY };
+
+typedef struct {
+    unsigned char kind;
+    int kid;                  /* first child (CAT, ALT) or operand */
+    int sib;                  /* next child of the parent CAT/ALT  */
+    unsigned char set[32];    /* RA_SET: byte bitmap               */
+} ReAst;
+
+/* NFA */
+enum { RN_SET, RN_SPLIT, RN_BOL, RN_EOL, RN_MATCH };
+
+typedef struct {
+    unsigned char kind;
+    int out, out1;
+    unsigned char set[32];
+} ReNode;
+
+typedef struct {
+    int *nfa;                 /* sorted NFA states                      */
+    int n;
+    unsigned char floating;   /* search: the start state is re-added    */
+    unsigned char accept;     /* a match ends here                      */
+    unsigned char accept_eol; /* a match ends here at the end of input  */
+    int next[256];            /* -1 until built                         */
+} ReDState;
+
+typedef struct {
+    char *pattern;
+    unsigned hash;
+    unsigned long long used;
+    const char *err;          /* set if the pattern does not compile */
+    ReNode *node;
+    int nnode, start;
+    ReDState *dfa;
+    int ndfa;
+    int *table;               /* open hash of DFA states, 2*RE_MAX_DFA */
+    int init[2][2];           /* [floating][at start of input]        */
+    int *mark, *stack, *tmp;  /* scratch, one slot per NFA state      */
+    int gen, flushes;
+} Regex;
+
+static Regex *re_cache[RE_CACHE_SIZE];
+static unsigned long long re_clock = 0;
+
+/* ---- parser ------------------------------------------------------- */
+typedef struct {
+    const char *p;
+    ReAst *ast;
+    int n, depth;
+    const char *err;
+} ReParser;
+
+static int re_ast(ReParser *rp, int kind) {
+    ReAst *a = &rp->ast[rp->n];
+    memset(a, 0, sizeof *a);
+    a->kind = (unsigned char)kind;
+    a->kid = a->sib = -1;
+    return rp->n++;
+}
+
+static void re_set_add(unsigned char *set, int c) { set[c >> 3] |= (unsigned char)(1 << (c & 7)); }
+
+/* \d \w \s and their negations; 0 if 'c' is not a class letter */
+static int re_class_escape(unsigned char *set, char c) {
+    unsigned char tmp[32];
+    memset(tmp, 0, sizeof tmp);
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            for (int i = '0'; i <= '9'; i++) re_set_add(tmp, i);
+            break;
+        case 'w':
+            for (int i = 0; i < 256; i++)
+                if (isalnum(i) || i == '_') re_set_add(tmp, i);
+            break;
+        case 's':
+            re_set_add(tmp, ' '); re_set_add(tmp, '\t'); re_set_add(tmp, '\n');
+            re_set_add(tmp, '\r'); re_set_add(tmp, '\f'); re_set_add(tmp, '\v');
+            break;
+        default:
+            return 0;
+    }
+    for (int i = 0; i < 32; i++)
+        set[i] |= isupper((unsigned char)c) ? (unsigned char)~tmp[i] : tmp[i];
+    return 1;
+}
+
+static int re_escape_char(char c) {
+    return c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : (unsigned char)c;
+}
+
+static int re_parse_alt(ReParser *rp);
+
+static int re_parse_class(ReParser *rp) {
+    int id = re_ast(rp, RA_SET);
+    unsigned char *set = rp->ast[id].set;
+    int negate = 0, first = 1;
+    rp->p++;  /* '[' */
+    if (*rp->p == '^') { negate = 1; rp->p++; }
+    while (*rp->p && (*rp->p != ']' || first)) {
+        int lo;
+        first = 0;
+        if (*rp->p == '\\' && rp->p[1]) {
+            if (re_class_escape(set, rp->p[1])) { rp->p += 2; continue; }
+            lo = re_escape_char(rp->p[1]);
+            rp->p += 2;
         } else {
-            result.data.num = -1.0;
+            lo = (unsigned char)*rp->p++;
         }
-        return result;
+        int hi = lo;
+        if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+            rp->p++;
+            if (*rp->p == '\\' && rp->p[1]) { hi = re_escape_char(rp->p[1]); rp->p += 2; }
+            else hi = (unsigned char)*rp->p++;
+            if (hi < lo) { rp->err = "bad range in [ ]"; return id; }
+        }
+        for (int c = lo; c <= hi; c++) re_set_add(set, c);
     }
+    if (*rp->p != ']') { rp->err = "missing ]"; return id; }
+    rp->p++;
+    if (negate)
+        for (int i = 0; i < 32; i++) set[i] = (unsigned char)~set[i];
+    return id;
+}
 
-    /* getch() -------------------------------------------------------- */
-    /* Reads the character at the current cursor position (screen read) */
-    if (strcmp(name, "getch") == 0) {
-        chtype ch = inch();
-        result.data.num = (ch == (chtype)ERR) ? -1.0 : (double)(ch & 0xFF);
+static int re_parse_atom(ReParser *rp) {
+    char c = *rp->p;
+    int id;
+    switch (c) {
+        case '(':
+            if (++rp->depth > RE_MAX_DEPTH) { rp->err = "nested too deeply"; return re_ast(rp, RA_EMPTY); }
+            rp->p++;
+            id = re_parse_alt(rp);
+            if (*rp->p != ')') { if (!rp->err) rp->err = "missing )"; return id; }
+            rp->p++;
+            rp->depth--;
+            return id;
+        case '[':
+            return re_parse_class(rp);
+        case '^':
+            rp->p++;
+            return re_ast(rp, RA_BOL);
+        case '$':
+            rp->p++;
+            return re_ast(rp, RA_EOL);
+        case '*': case '+': case '?':
+            rp->err = "nothing to repeat";
+            return re_ast(rp, RA_EMPTY);
+    }
+    id = re_ast(rp, RA_SET);
+    unsigned char *set = rp->ast[id].set;
+    if (c == '.') {
+        memset(set, 0xff, 32);
+        set['\n' >> 3] &= (unsigned char)~(1 << ('\n' & 7));
+        rp->p++;
+    } else if (c == '\\' && rp->p[1]) {
+        if (!re_class_escape(set, rp->p[1])) re_set_add(set, re_escape_char(rp->p[1]));
+        rp->p += 2;
+    } else {
+        re_set_add(set, (unsigned char)c);
+        rp->p++;
+    }
+    return id;
+}
+
+static int re_parse_repeat(ReParser *rp) {
+    int id = re_parse_atom(rp);
+    int q = -1;
+    /* Stacked quantifiers fold into one: a++ is a+, a?? is a?, the rest a* */
+    while (!rp->err && (*rp->p == '*' || *rp->p == '+' || *rp->p == '?')) {
+        int kind = *rp->p == '*' ? RA_STAR : *rp->p == '+' ? RA_PLUS : RA_QUEST;
+        if (q < 0) {
+            q = re_ast(rp, kind);
+            rp->ast[q].kid = id;
+        } else if (rp->ast[q].kind != kind) {
+            rp->ast[q].kind = RA_STAR;
+        }
+        rp->p++;
+    }
+    return q < 0 ? id : q;
+}
+
+/* Children of a CAT are kept last first, the order re_compile() needs */
+static int re_parse_cat(ReParser *rp) {
+    int cat = re_ast(rp, RA_CAT);
+    while (!rp->err && *rp->p && *rp->p != '|' && *rp->p != ')') {
+        int id = re_parse_repeat(rp);
+        rp->ast[id].sib = rp->ast[cat].kid;
+        rp->ast[cat].kid = id;
+    }
+    return cat;
+}
+
+static int re_parse_alt(ReParser *rp) {
+    int alt = re_ast(rp, RA_ALT);
+    int last = re_parse_cat(rp);
+    rp->ast[alt].kid = last;
+    while (!rp->err && *rp->p == '|') {
+        rp->p++;
+        int id = re_parse_cat(rp);
+        rp->ast[last].sib = id;
+        last = id;
+    }
+    return alt;
+}
+
+/* ---- NFA construction --------------------------------------------- */
+static int re_node(Regex *re, int kind, int out, int out1) {
+    ReNode *n = &re->node[re->nnode];
+    n->kind = (unsigned char)kind;
+    n->out = out;
+    n->out1 = out1;
+    return re->nnode++;
+}
+
+/* Entry state of 'id' when matching continues at 'next' afterwards */
+static int re_compile(Regex *re, const ReAst *ast, int id, int next) {
+    const ReAst *a = &ast[id];
+    int s, k;
+    switch (a->kind) {
+        case RA_SET:
+            s = re_node(re, RN_SET, next, -1);
+            memcpy(re->node[s].set, a->set, 32);
+            return s;
+        case RA_CAT:
+            for (k = a->kid; k >= 0; k = ast[k].sib)
+                next = re_compile(re, ast, k, next);
+            return next;
+        case RA_ALT:
+            if (ast[a->kid].sib < 0) return re_compile(re, ast, a->kid, next);
+            s = -1;
+            for (k = a->kid; k >= 0; k = ast[k].sib) {
+                int e = re_compile(re, ast, k, next);
+                s = s < 0 ? e : re_node(re, RN_SPLIT, s, e);
+            }
+            return s;
+        case RA_STAR:
+            s = re_node(re, RN_SPLIT, -1, next);
+            re->node[s].out = re_compile(re, ast, a->kid, s);
+            return s;
+        case RA_PLUS:
+            s = re_node(re, RN_SPLIT, -1, next);
+            re->node[s].out = re_compile(re, ast, a->kid, s);
+            return re->node[s].out;
+        case RA_QUEST:
+            return re_node(re, RN_SPLIT, re_compile(re, ast, a->kid, next), next);
+        case RA_BOL:
+            return re_node(re, RN_BOL, next, -1);
+        case RA_EOL:
+            return re_node(re, RN_EOL, next, -1);
+    }
+    return next;  /* RA_EMPTY */
+}
+
+static void re_free(Regex *re) {
+    if (!re) return;
+    for (int i = 0; i < re->ndfa; i++) free(re->dfa[i].nfa);
+    free(re->dfa);
+    free(re->table);
+    free(re->node);
+    free(re->mark);
+    free(re->stack);
+    free(re->tmp);
+    free(re->pattern);
+    free(re);
+}
+
+static unsigned re_hash_string(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static Regex *re_build(const char *pattern) {
+    Regex *re = (Regex *)calloc(1, sizeof(Regex));
+    size_t len = strlen(pattern);
+    re->pattern = (char *)malloc(len + 1);
+    memcpy(re->pattern, pattern, len + 1);
+    re->hash = re_hash_string(pattern);
+    if (len >= MAX_LINE_LENGTH) { re->err = "pattern too long"; return re; }
+
+    ReParser rp;
+    rp.p = pattern;
+    rp.ast = (ReAst *)malloc((2 * len + 4) * sizeof(ReAst));
+    rp.n = 0;
+    rp.depth = 0;
+    rp.err = NULL;
+    int root = re_parse_alt(&rp);
+    if (!rp.err && *rp.p == ')') rp.err = "unmatched )";
+    if (rp.err) { re->err = rp.err; free(rp.ast); return re; }
+
+    /* Each tree node makes at most one NFA node, each ALT child one SPLIT */
+    re->node = (ReNode *)malloc((2 * rp.n + 2) * sizeof(ReNode));
+    int match = re_node(re, RN_MATCH, -1, -1);
+    re->start = re_compile(re, rp.ast, root, match);
+    free(rp.ast);
+
+    re->mark = (int *)calloc(re->nnode, sizeof(int));
+    re->stack = (int *)malloc(re->nnode * sizeof(int));
+    re->tmp = (int *)malloc(re->nnode * sizeof(int));
+    re->dfa = (ReDState *)malloc(RE_MAX_DFA * sizeof(ReDState));
+    re->table = (int *)malloc(2 * RE_MAX_DFA * sizeof(int));
+    for (int i = 0; i < 2 * RE_MAX_DFA; i++) re->table[i] = -1;
+    memset(re->init, -1, sizeof re->init);
+    return re;
+}
+
+/* Compiled pattern from the cache; compiles and caches it if absent */
+static Regex *re_get(const char *pattern) {
+    unsigned h = re_hash_string(pattern);
+    int victim = 0;
+    for (int i = 0; i < RE_CACHE_SIZE; i++) {
+        Regex *re = re_cache[i];
+        if (re && re->hash == h && strcmp(re->pattern, pattern) == 0) {
+            re->used = ++re_clock;
+            return re;
+        }
+        /* Evict an empty slot, else the least recently used pattern */
+        if (re_cache[victim] && (!re || re->used < re_cache[victim]->used)) victim = i;
+    }
+    re_free(re_cache[victim]);
+    re_cache[victim] = re_build(pattern);
+    re_cache[victim]->used = ++re_clock;
+    return re_cache[victim];
+}
+
+void regex_free(void) {
+    for (int i = 0; i < RE_CACHE_SIZE; i++) {
+        re_free(re_cache[i]);
+        re_cache[i] = NULL;
+    }
+}
+
+/* ---- lazy DFA ------------------------------------------------------ */
+
+/* Add 'id' and the states reachable from it without input to re->tmp */
+static void re_closure(Regex *re, int id, int at_start, int *n) {
+    int sp = 0;
+    re->stack[sp++] = id;
+    while (sp > 0) {
+        int s = re->stack[--sp];
+        if (s < 0 || re->mark[s] == re->gen) continue;
+        re->mark[s] = re->gen;
+        const ReNode *nd = &re->node[s];
+        if (nd->kind == RN_SPLIT) {
+            re->stack[sp++] = nd->out1;
+            re->stack[sp++] = nd->out;
+        } else if (nd->kind == RN_BOL) {
+            if (at_start) re->stack[sp++] = nd->out;
+        } else {
+            re->tmp[(*n)++] = s;
+        }
+    }
+}
+
+static int re_int_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Does a match end here if the input ends here? Follows '$' states */
+static int re_accepts_at_eol(Regex *re, const int *set, int n) {
+    int sp = 0;
+    re->gen++;
+    for (int i = 0; i < n; i++) re->stack[sp++] = set[i];
+    while (sp > 0) {
+        int s = re->stack[--sp];
+        if (s < 0 || re->mark[s] == re->gen) continue;
+        re->mark[s] = re->gen;
+        const ReNode *nd = &re->node[s];
+        if (nd->kind == RN_MATCH) return 1;
+        if (nd->kind == RN_SPLIT) {
+            re->stack[sp++] = nd->out1;
+            re->stack[sp++] = nd->out;
+        } else if (nd->kind == RN_EOL) {
+            re->stack[sp++] = nd->out;
+        }
+    }
+    return 0;
+}
+
+static void re_flush(Regex *re) {
+    re->flushes++;
+    for (int i = 0; i < re->ndfa; i++) free(re->dfa[i].nfa);
+    re->ndfa = 0;
+    for (int i = 0; i < 2 * RE_MAX_DFA; i++) re->table[i] = -1;
+    memset(re->init, -1, sizeof re->init);
+}
+
+/* DFA state for the NFA set in re->tmp[0..n-1] */
+static int re_dstate(Regex *re, int n, int floating) {
+    qsort(re->tmp, n, sizeof(int), re_int_cmp);
+    unsigned h = 2166136261u ^ (unsigned)floating;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned)re->tmp[i]) * 16777619u;
+    unsigned mask = 2 * RE_MAX_DFA - 1;
+    for (unsigned slot = h & mask;; slot = (slot + 1) & mask) {
+        int d = re->table[slot];
+        if (d < 0) break;
+        ReDState *ds = &re->dfa[d];
+        if (ds->n == n && ds->floating == floating &&
+            memcmp(ds->nfa, re->tmp, n * sizeof(int)) == 0)
+            return d;
+    }
+    if (re->ndfa == RE_MAX_DFA) re_flush(re);
+
+    int d = re->ndfa++;
+    ReDState *ds = &re->dfa[d];
+    ds->nfa = (int *)malloc((n ? n : 1) * sizeof(int));
+    memcpy(ds->nfa, re->tmp, n * sizeof(int));
+    ds->n = n;
+    ds->floating = (unsigned char)floating;
+    ds->accept = 0;
+    for (int i = 0; i < n; i++)
+        if (re->node[ds->nfa[i]].kind == RN_MATCH) ds->accept = 1;
+    ds->accept_eol = ds->accept || re_accepts_at_eol(re, ds->nfa, n);
+    for (int i = 0; i < 256; i++) ds->next[i] = -1;
+    for (unsigned slot = h & mask;; slot = (slot + 1) & mask)
+        if (re->table[slot] < 0) { re->table[slot] = d; break; }
+    return d;
+}
+
+static int re_initial(Regex *re, int floating, int at_start) {
+    if (re->init[floating][at_start] < 0) {
+        int n = 0;
+        re->gen++;
+        re_closure(re, re->start, at_start, &n);
+        re->init[floating][at_start] = re_dstate(re, n, floating);
+    }
+    return re->init[floating][at_start];
+}
+
+static int re_step(Regex *re, int d, unsigned char c) {
+    int next = re->dfa[d].next[c];
+    if (next >= 0) return next;
+
+    int n = 0, floating = re->dfa[d].floating;
+    const ReDState *ds = &re->dfa[d];
+    re->gen++;
+    for (int i = 0; i < ds->n; i++) {
+        const ReNode *nd = &re->node[ds->nfa[i]];
+        if (nd->kind == RN_SET && (nd->set[c >> 3] & (1 << (c & 7))))
+            re_closure(re, nd->out, 0, &n);
+    }
+    if (floating) re_closure(re, re->start, 0, &n);
+    int flushes = re->flushes;
+    next = re_dstate(re, n, floating);
+    if (re->flushes == flushes) re->dfa[d].next[c] = next;   /* else 'd' is gone */
+    return next;
+}
+
+/* End of the first match to finish in s[from..n), -1 if none */
+static int re_search_end(Regex *re, const char *s, int n, int from) {
+    int d = re_initial(re, 1, from == 0);
+    for (int i = from; ; i++) {
+        if (re->dfa[d].accept) return i;
+        if (i == n) return re->dfa[d].accept_eol ? i : -1;
+        if (re->dfa[d].n == 0) return -1;   /* e.g. '^' past the start */
+        d = re_step(re, d, (unsigned char)s[i]);
+    }
+}
+
+/* End of the longest match starting at s[i], -1 if none */
+static int re_match_at(Regex *re, const char *s, int n, int i) {
+    int d = re_initial(re, 0, i == 0), end = -1;
+    for (;; i++) {
+        if (re->dfa[d].accept) end = i;
+        if (i == n) return re->dfa[d].accept_eol ? i : end;
+        if (re->dfa[d].n == 0) return end;
+        d = re_step(re, d, (unsigned char)s[i]);
+    }
+}
+
+/* Leftmost-longest match in s[from..n): start in *ms, end returned; -1 if none */
+static int re_find(Regex *re, const char *s, int n, int from, int *ms) {
+    int e = re_search_end(re, s, n, from);
+    if (e < 0) return -1;
+    for (int i = from; i <= e; i++) {
+        int m = re_match_at(re, s, n, i);
+        if (m >= 0) { *ms = i; return m; }
+    }
+    return -1;
+}
+
+Value call_regex_function(const char *name, Value *args, int nargs) {
+    Value result;
+    char buf0[32], buf1[32], buf2[32];
+    size_t n0, n1, n2;
+    const char *s = string_arg(args, nargs, 0, buf0, &n0);
+    const char *pat = string_arg(args, nargs, 1, buf1, &n1);
+    Regex *re = re_get(pat);
+    int n = (int)n0, ms = 0, me;
+
+    result.type = TYPE_NUMBER;
+    result.data.num = 0.0;
+    if (re->err) {
+        printw("Warning: bad pattern '%s': %s\n", pat, re->err);
+        refresh();
+        if (strcmp(name, "refind") == 0) result.data.num = -1.0;
+        else if (strcmp(name, "rereplace") == 0) result = string_result(s, n0);
         return result;
     }
 
-    /* setfore(color) ------------------------------------------------- */
-    if (strcmp(name, "setfore") == 0) {
-        if (nargs >= 1) {
-            int color = (int)value_to_number(args[0]);
-            if (color >= 0 && color <= 7) {
-                itl_fg = color;
-                apply_attrs();
-                result.data.num = 1.0;
+    if (strcmp(name, "rematch") == 0) {
+        result.data.num = re_search_end(re, s, n, 0) >= 0 ? 1.0 : 0.0;
+    } else if (strcmp(name, "refind") == 0) {
+        int from = (int)string_index(args, nargs, 2, 0, n0);
+        result.data.num = re_find(re, s, n, from, &ms) >= 0 ? (double)ms : -1.0;
+    } else if (strcmp(name, "rereplace") == 0) {
+        const char *rep = string_arg(args, nargs, 2, buf2, &n2);
+        size_t cap = n0 + 16, len = 0;
+        char *out = (char *)malloc(cap);
+        int pos = 0;
+        while (pos <= n) {
+            me = re_find(re, s, n, pos, &ms);
+            if (me < 0) ms = n;
+            size_t need = len + (size_t)(ms - pos) + n2 + 2;
+            if (need > cap) {
+                while (cap < need) cap *= 2;
+                out = (char *)realloc(out, cap);
+            }
+            memcpy(out + len, s + pos, ms - pos);
+            len += ms - pos;
+            if (me < 0) break;
+            memcpy(out + len, rep, n2);
+            len += n2;
+            if (me > ms) {
+                pos = me;
+            } else {
+                /* Empty match: keep the next character and move past it */
+                if (ms < n) out[len++] = s[ms];
+                pos = ms + 1;
             }
         }
+        out[len] = '\0';
+        result.type = TYPE_STRING;
+        result.data.str = out;
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Hash tables                                                          */
+/*                                                                      */
+/* Functions:                                                           */
+/*   hset(t,k,v)       - store v under key k in table t; returns v     */
+/*   hget(t,k,d)       - value under k, else d (default 0)             */
+/*   hhas(t,k)         - 1 if k is present, else 0                     */
+/*   hdel(t,k)         - remove k; returns 1 if it was present         */
+/*   hcount(t)         - number of keys in t                           */
+/*   hkey(t,n)         - key of entry n, 0 <= n < hcount(t)            */
+/*   hval(t,n)         - value of entry n                              */
+/*   hkeys(t,i)        - all keys into @i, @i+1, ...;                  */
+/*                       returns the count                             */
+/*   hvals(t,i)        - all values likewise; both take an optional    */
+/*                       array handle after i, as split() does         */
+/*   hclear(t)         - remove all keys                               */
+/*                                                                      */
+/* Tables are numbered 0 to HT_MAX-1 and exist once written. Keys are   */
+/* numbers or strings, and 1 and "1" are different keys.                */
+/*                                                                      */
+/* Entries are stored densely in insertion order; hdel moves the last   */
+/* entry into the gap, so entry n is an O(1) lookup. They are found     */
+/* through a Swiss-table style index: each slot has a control byte      */
+/* holding 7 bits of the key's hash, or EMPTY/DELETED, and a probe      */
+/* tests a group of 8 control bytes at once with 64-bit word            */
+/* arithmetic. Only slots whose byte matches compare keys.              */
+/* ------------------------------------------------------------------ */
+#define HT_MAX     256
+#define HT_GROUP   8
+#define HT_EMPTY   0x80
+#define HT_DELETED 0xFE
+#define HT_LSB     0x0101010101010101ull
+#define HT_MSB     0x8080808080808080ull
+
+typedef struct {
+    Value key, val;
+    uint64_t hash;
+} HtEntry;
+
+typedef struct {
+    unsigned char *ctrl;   /* cap + HT_GROUP - 1 bytes; the tail repeats the head */
+    int *slot;             /* entry index of each full slot */
+    HtEntry *ent;          /* count entries in insertion order */
+    int cap, count, tombs, entcap;
+} HashTable;
+
+static HashTable *hash_tables[HT_MAX];
+
+static int is_table_function(const char *name) {
+    static const char *table_funcs[] = {
+        "hset", "hget", "hhas", "hdel", "hcount", "hkey", "hval",
+        "hkeys", "hvals", "hclear",
+        NULL
+    };
+    for (int i = 0; table_funcs[i]; i++)
+        if (strcmp(name, table_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+/* Keys are strings or numbers; anything else is the number it converts to */
+static Value ht_key(const Value *args, int nargs, int i) {
+    Value k;
+    if (i < nargs && args[i].type == TYPE_STRING) return args[i];
+    k.type = TYPE_NUMBER;
+    k.data.num = i < nargs ? value_to_number(args[i]) : 0.0;
+    if (k.data.num == 0.0) k.data.num = 0.0;   /* -0 and 0 are one key */
+    return k;
+}
+
+static uint64_t ht_hash(Value k) {
+    uint64_t h;
+    if (k.type == TYPE_STRING) {
+        h = 14695981039346656037ull;
+        for (const char *p = k.data.str; *p; p++)
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+    } else {
+        memcpy(&h, &k.data.num, sizeof h);
+    }
+    /* Spread the bits so both the slot and the 7-bit tag vary */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+static int ht_key_equal(Value a, Value b) {
+    if (a.type != b.type) return 0;
+    if (a.type == TYPE_STRING)
+        return a.data.str == b.data.str || strcmp(a.data.str, b.data.str) == 0;
+    return a.data.num == b.data.num || (a.data.num != a.data.num && b.data.num != b.data.num);
+}
+
+static void ht_set_ctrl(HashTable *t, int i, unsigned char c) {
+    t->ctrl[i] = c;
+    if (i < HT_GROUP - 1) t->ctrl[t->cap + i] = c;
+}
+
+/* Bit 8j+7 set for each byte j of the group that matches */
+static uint64_t ht_group(const HashTable *t, int pos) {
+    uint64_t g;
+    memcpy(&g, t->ctrl + pos, sizeof g);   /* byte j is ctrl[pos+j] on little-endian */
+    return g;
+}
+#define HT_MATCH(g, tag)     ((((g) ^ (HT_LSB * (tag))) - HT_LSB) & ~((g) ^ (HT_LSB * (tag))) & HT_MSB)
+#define HT_MATCH_EMPTY(g)    ((g) & ~((g) << 6) & HT_MSB)
+#define HT_MATCH_FREE(g)     ((g) & ~((g) << 7) & HT_MSB)   /* EMPTY or DELETED */
+
+/* Slot holding key k, or -1 */
+static int ht_find(const HashTable *t, Value k, uint64_t h) {
+    int mask = t->cap - 1, pos = (int)(h >> 7) & mask, step = 0;
+    for (;;) {
+        uint64_t g = ht_group(t, pos);
+        /* HT_MATCH can report a false byte next to a true one; the key test catches it */
+        for (uint64_t m = HT_MATCH(g, h & 0x7F); m; m &= m - 1) {
+            int i = (pos + (__builtin_ctzll(m) >> 3)) & mask;
+            if (ht_key_equal(t->ent[t->slot[i]].key, k)) return i;
+        }
+        if (HT_MATCH_EMPTY(g)) return -1;
+        step += HT_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+/* First free slot on the probe sequence of hash h */
+static int ht_free_slot(const HashTable *t, uint64_t h) {
+    int mask = t->cap - 1, pos = (int)(h >> 7) & mask, step = 0;
+    for (;;) {
+        uint64_t m = HT_MATCH_FREE(ht_group(t, pos));
+        if (m) return (pos + (__builtin_ctzll(m) >> 3)) & mask;
+        step += HT_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+/* Rebuild the index for at least 'need' entries at most half full */
+static void ht_rehash(HashTable *t, int need) {
+    int cap = 16;
+    while (cap < 2 * need) cap *= 2;
+    free(t->ctrl);
+    free(t->slot);
+    t->cap = cap;
+    t->tombs = 0;
+    t->ctrl = (unsigned char *)malloc(cap + HT_GROUP - 1);
+    t->slot = (int *)malloc(cap * sizeof(int));
+    memset(t->ctrl, HT_EMPTY, cap + HT_GROUP - 1);
+    for (int e = 0; e < t->count; e++) {
+        int i = ht_free_slot(t, t->ent[e].hash);
+        ht_set_ctrl(t, i, (unsigned char)(t->ent[e].hash & 0x7F));
+        t->slot[i] = e;
+    }
+}
+
+static void ht_insert(HashTable *t, Value k, uint64_t h, Value v) {
+    /* Keep at least one EMPTY byte in every probe: load <= 7/8 */
+    if (8 * (t->count + t->tombs + 1) > 7 * t->cap) ht_rehash(t, t->count + 1);
+    if (t->count == t->entcap) {
+        t->entcap = t->entcap ? 2 * t->entcap : 8;
+        t->ent = (HtEntry *)realloc(t->ent, t->entcap * sizeof(HtEntry));
+    }
+    int i = ht_free_slot(t, h);
+    if (t->ctrl[i] == HT_DELETED) t->tombs--;
+    ht_set_ctrl(t, i, (unsigned char)(h & 0x7F));
+    t->slot[i] = t->count;
+    t->ent[t->count].key = share_value(k);
+    t->ent[t->count].val = share_value(v);
+    t->ent[t->count].hash = h;
+    t->count++;
+}
+
+static void ht_remove(HashTable *t, int i) {
+    int e = t->slot[i], last = t->count - 1;
+    free_value(&t->ent[e].key);
+    free_value(&t->ent[e].val);
+    ht_set_ctrl(t, i, HT_DELETED);
+    t->tombs++;
+    if (e != last) {
+        t->slot[ht_find(t, t->ent[last].key, t->ent[last].hash)] = e;
+        t->ent[e] = t->ent[last];
+    }
+    t->count--;
+}
+
+static void ht_clear(HashTable *t) {
+    for (int e = 0; e < t->count; e++) {
+        free_value(&t->ent[e].key);
+        free_value(&t->ent[e].val);
+    }
+    free(t->ent);
+    free(t->ctrl);
+    free(t->slot);
+    free(t);
+}
+
+void table_free(void) {
+    for (int i = 0; i < HT_MAX; i++) {
+        if (hash_tables[i]) ht_clear(hash_tables[i]);
+        hash_tables[i] = NULL;
+    }
+}
+
+/* Table t of the arguments; created when 'create' is set, else NULL if absent */
+static HashTable *ht_table(const Value *args, int nargs, int create, int *bad) {
+    double d = nargs > 0 ? value_to_number(args[0]) : 0.0;
+    *bad = !(d >= 0.0 && d < HT_MAX && d == (int)d);
+    if (*bad) return NULL;
+    HashTable *t = hash_tables[(int)d];
+    if (!t && create) {
+        t = (HashTable *)calloc(1, sizeof(HashTable));
+        ht_rehash(t, 0);
+        hash_tables[(int)d] = t;
+    }
+    return t;
+}
+
+Value call_table_function(const char *name, Value *args, int nargs) {
+    Value result;
+    int bad;
+    int writes = strcmp(name, "hset") == 0;
+    HashTable *t = ht_table(args, nargs, writes, &bad);
+
+    result.type = TYPE_NUMBER;
+    result.data.num = 0.0;
+    if (bad) {
+        printw("Warning: %s: no table %.15g (0-%d)\n", name,
+               nargs > 0 ? value_to_number(args[0]) : 0.0, HT_MAX - 1);
+        refresh();
+        if (strcmp(name, "hget") == 0 && nargs > 2) result = copy_value(args[2]);
         return result;
     }
 
-    /* setback(color) ------------------------------------------------- */
-    if (strcmp(name, "setback") == 0) {
-        if (nargs >= 1) {
-            int color = (int)value_to_number(args[0]);
-            if (color >= 0 && color <= 7) {
-                itl_bg = color;
-                apply_attrs();
-                result.data.num = 1.0;
+    if (writes) {
+        Value k = ht_key(args, nargs, 1);
+        uint64_t h = ht_hash(k);
+        int i = ht_find(t, k, h);
+        if (nargs > 2) result = args[2];
+        if (i >= 0) {
+            HtEntry *e = &t->ent[t->slot[i]];
+            free_value(&e->val);
+            e->val = share_value(result);
+        } else {
+            ht_insert(t, k, h, result);
+        }
+        result = copy_value(result);
+    } else if (strcmp(name, "hcount") == 0) {
+        result.data.num = t ? t->count : 0;
+    } else if (strcmp(name, "hclear") == 0) {
+        if (t) {
+            ht_clear(t);
+            hash_tables[(int)value_to_number(args[0])] = NULL;
+        }
+    } else if (strcmp(name, "hkey") == 0 || strcmp(name, "hval") == 0) {
+        double n = nargs > 1 ? value_to_number(args[1]) : 0.0;
+        if (t && n >= 0.0 && n < t->count) {
+            HtEntry *e = &t->ent[(int)n];
+            result = copy_value(name[1] == 'k' ? e->key : e->val);
+        }
+    } else if (strcmp(name, "hkeys") == 0 || strcmp(name, "hvals") == 0) {
+        double d = nargs > 1 ? value_to_number(args[1]) : 0.0;
+        int at = d > 0.0 ? (d < (double)INT_MAX ? (int)d : INT_MAX) : 0;
+        Array *arr = array_arg(args, nargs, 2);
+        int count = t && arr ? t->count : 0;
+        if (count > INT_MAX - at) count = INT_MAX - at;
+        if (arr) array_ensure(arr, at + count);
+        for (int e = 0; e < count; e++)
+            array_store(arr, at + e, name[1] == 'k' ? t->ent[e].key : t->ent[e].val);
+        result.data.num = count;
+    } else {
+        /* hget, hhas, hdel */
+        Value k = ht_key(args, nargs, 1);
+        int i = t ? ht_find(t, k, ht_hash(k)) : -1;
+        if (strcmp(name, "hget") == 0) {
+            if (i >= 0)
+                result = copy_value(t->ent[t->slot[i]].val);
+            else if (nargs > 2)
+                result = copy_value(args[2]);
+        } else {
+            result.data.num = i >= 0;
+            if (i >= 0 && name[1] == 'd') ht_remove(t, i);
+        }
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Priority queues                                                      */
+/*                                                                      */
+/* Functions:                                                           */
+/*   pqinit(h,dir)     - empty heap h; dir 0 = min-heap (default),     */
+/*                       non-zero = max-heap                           */
+/*   pqpush(h,p,v)     - add v with priority p (v defaults to p);      */
+/*                       returns the new size                          */
+/*   pqpop(h)          - remove the first item and return its value    */
+/*   pqpeek(h)         - value of the first item                       */
+/*   pqprio(h)         - priority of the first item                    */
+/*   pqsize(h)         - number of items                               */
+/*   pqheapify(h,i,n)  - add @i .. @i+n-1 as items with their own      */
+/*                       value as priority; returns the new size.      */
+/*                       A fourth argument selects the array @[a]      */
+/*                                                                      */
+/* The first item is the one with the lowest priority in a min-heap,   */
+/* the highest in a max-heap. pqpop, pqpeek and pqprio of an empty     */
+/* heap return 0. Heaps are numbered 0 to PQ_MAX-1 like hash tables.   */
+/*                                                                      */
+/* Binary heap in an array. A max-heap stores negated priorities, so   */
+/* both kinds share the min-heap code. Sifting moves a hole instead of */
+/* swapping, and pqheapify sifts down from the last parent, O(n).      */
+/* ------------------------------------------------------------------ */
+#define PQ_MAX 256
+
+typedef struct {
+    double prio;
+    Value val;
+} PqItem;
+
+typedef struct {
+    PqItem *item;
+    int count, cap, max;
+} PriorityQueue;
+
+static PriorityQueue heaps[PQ_MAX];
+
+static int is_heap_function(const char *name) {
+    static const char *heap_funcs[] = {
+        "pqinit", "pqpush", "pqpop", "pqpeek", "pqprio", "pqsize", "pqheapify",
+        NULL
+    };
+    for (int i = 0; heap_funcs[i]; i++)
+        if (strcmp(name, heap_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+static void pq_reserve(PriorityQueue *q, int n) {
+    if (n <= q->cap) return;
+    int cap = q->cap ? q->cap : 16;
+    while (cap < n) cap *= 2;
+    q->item = (PqItem *)realloc(q->item, cap * sizeof(PqItem));
+    q->cap = cap;
+}
+
+static void pq_sift_up(PriorityQueue *q, int i, PqItem x) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!(x.prio < q->item[parent].prio)) break;
+        q->item[i] = q->item[parent];
+        i = parent;
+    }
+    q->item[i] = x;
+}
+
+static void pq_sift_down(PriorityQueue *q, int i, PqItem x) {
+    int n = q->count;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n) break;
+        if (c + 1 < n && q->item[c + 1].prio < q->item[c].prio) c++;
+        if (!(q->item[c].prio < x.prio)) break;
+        q->item[i] = q->item[c];
+        i = c;
+    }
+    q->item[i] = x;
+}
+
+static void pq_clear(PriorityQueue *q) {
+    for (int i = 0; i < q->count; i++) free_value(&q->item[i].val);
+    q->count = 0;
+}
+
+void heap_free(void) {
+    for (int h = 0; h < PQ_MAX; h++) {
+        pq_clear(&heaps[h]);
+        free(heaps[h].item);
+        heaps[h].item = NULL;
+        heaps[h].cap = heaps[h].max = 0;
+    }
+}
+
+Value call_heap_function(const char *name, Value *args, int nargs) {
+    Value result;
+    double d = nargs > 0 ? value_to_number(args[0]) : 0.0;
+
+    result.type = TYPE_NUMBER;
+    result.data.num = 0.0;
+    if (!(d >= 0.0 && d < PQ_MAX && d == (int)d)) {
+        printw("Warning: %s: no heap %.15g (0-%d)\n", name, d, PQ_MAX - 1);
+        refresh();
+        return result;
+    }
+    PriorityQueue *q = &heaps[(int)d];
+    double sign = q->max ? -1.0 : 1.0;
+
+    if (strcmp(name, "pqinit") == 0) {
+        pq_clear(q);
+        q->max = nargs > 1 && value_to_number(args[1]) != 0.0;
+    } else if (strcmp(name, "pqpush") == 0) {
+        PqItem x;
+        x.prio = sign * (nargs > 1 ? value_to_number(args[1]) : 0.0);
+        if (nargs > 2) {
+            x.val = share_value(args[2]);
+        } else {
+            x.val.type = TYPE_NUMBER;
+            x.val.data.num = sign * x.prio;
+        }
+        pq_reserve(q, q->count + 1);
+        pq_sift_up(q, q->count++, x);
+        result.data.num = q->count;
+    } else if (strcmp(name, "pqheapify") == 0) {
+        double a = nargs > 1 ? value_to_number(args[1]) : 0.0;
+        double c = nargs > 2 ? value_to_number(args[2]) : 0.0;
+        int at = a > 0.0 ? (a < (double)INT_MAX ? (int)a : INT_MAX) : 0;
+        const Array *arr = array_arg(args, nargs, 3);
+        int n = arr && at < arr->size ? arr->size - at : 0;   /* stop at the array end */
+        if (c < (double)n) n = c > 0.0 ? (int)c : 0;
+        pq_reserve(q, q->count + n);
+        for (int i = 0; i < n; i++) {
+            PqItem *x = &q->item[q->count + i];
+            x->val = array_load(arr, at + i);
+            array_peek(arr, at + i, &x->prio);
+            x->prio *= sign;
+        }
+        q->count += n;
+        for (int i = q->count / 2 - 1; i >= 0; i--)
+            pq_sift_down(q, i, q->item[i]);
+        result.data.num = q->count;
+    } else if (strcmp(name, "pqsize") == 0) {
+        result.data.num = q->count;
+    } else if (q->count > 0) {
+        /* pqpop, pqpeek, pqprio */
+        if (strcmp(name, "pqprio") == 0) {
+            result.data.num = sign * q->item[0].prio;
+        } else if (strcmp(name, "pqpeek") == 0) {
+            result = copy_value(q->item[0].val);
+        } else {
+            result = q->item[0].val;   /* ownership passes to the caller */
+            q->count--;
+            if (q->count > 0) pq_sift_down(q, 0, q->item[q->count]);
+        }
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Deques                                                               */
+/*                                                                      */
+/* Functions:                                                           */
+/*   dqinit(d,n)       - empty deque d; with n > 0 it holds at most n  */
+/*                       numbers and a push onto a full deque drops    */
+/*                       one from the other end                        */
+/*   dqpush(d,x)       - add x at the back; returns the new size       */
+/*   dqpushf(d,x)      - add x at the front                            */
+/*   dqpop(d)          - remove and return the back number             */
+/*   dqpopf(d)         - remove and return the front number            */
+/*   dqget(d,i)        - number i from the front, or from the back     */
+/*                       for negative i (-1 is the last)               */
+/*   dqset(d,i,x)      - replace number i; returns x                   */
+/*   dqsize(d)         - count of numbers                              */
+/*   dqmin(d), dqmax(d), dqsum(d) - over the whole deque               */
+/*                                                                      */
+/* Deques are numbered 0 to DQ_MAX-1 and hold numbers. Popping or      */
+/* reading outside an empty deque or its range returns 0.              */
+/*                                                                      */
+/* A power-of-two ring buffer. The sum is kept as numbers come and go, */
+/* with a compensation term so long streams do not drift. For min and  */
+/* max, two more rings hold the sequence numbers of the candidates in  */
+/* monotonic order; pushing at the back and popping at the front keep  */
+/* them in O(1) amortized, which is the sliding-window pattern. Any    */
+/* other change marks them stale and the next dqmin/dqmax rebuilds     */
+/* them from the deque.                                                */
+/* ------------------------------------------------------------------ */
+#define DQ_MAX 256
+
+typedef struct {
+    double *v;
+    int64_t *lo, *hi;      /* candidate sequence numbers for min / max */
+    int mask;              /* ring size - 1 once v is allocated */
+    int head, count, limit;
+    int lo_head, lo_count, hi_head, hi_count, stale;
+    int64_t seq;           /* sequence number of the front */
+    double sum, comp;      /* sum = sum + comp, Neumaier summation */
+} Deque;
+
+static Deque deques[DQ_MAX];
+
+static int is_deque_function(const char *name) {
+    static const char *deque_funcs[] = {
+        "dqinit", "dqpush", "dqpushf", "dqpop", "dqpopf", "dqget", "dqset",
+        "dqsize", "dqmin", "dqmax", "dqsum",
+        NULL
+    };
+    for (int i = 0; deque_funcs[i]; i++)
+        if (strcmp(name, deque_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+static void dq_add_sum(Deque *q, double x) {
+    double s = q->sum + x;
+    if (fabs(q->sum) >= fabs(x)) q->comp += (q->sum - s) + x;
+    else q->comp += (x - s) + q->sum;
+    q->sum = s;
+}
+
+static double *dq_at(Deque *q, int i) {
+    return &q->v[(q->head + i) & q->mask];
+}
+
+/* Value at sequence number s */
+static double dq_seq_value(Deque *q, int64_t s) {
+    return *dq_at(q, (int)(s - q->seq));
+}
+
+/* Room for one more number; candidates go stale when the ring moves */
+static void dq_grow(Deque *q) {
+    if (q->v && q->count < q->mask + 1) return;
+    int size = q->v ? 2 * (q->mask + 1) : 16;
+    double *v = (double *)malloc(size * sizeof(double));
+    for (int i = 0; i < q->count; i++) v[i] = *dq_at(q, i);
+    free(q->v);
+    free(q->lo);
+    free(q->hi);
+    q->v = v;
+    q->lo = (int64_t *)malloc(size * sizeof(int64_t));
+    q->hi = (int64_t *)malloc(size * sizeof(int64_t));
+    q->mask = size - 1;
+    q->head = 0;
+    q->stale = 1;
+}
+
+/* Back push of sequence number s into the min (dir 1) or max (dir -1) candidates */
+static void dq_cand_push(Deque *q, int64_t *ring, int *head, int *count, int dir, int64_t s) {
+    double x = dq_seq_value(q, s);
+    while (*count > 0 && dir * dq_seq_value(q, ring[(*head + *count - 1) & q->mask]) >= dir * x)
+        (*count)--;
+    ring[(*head + (*count)++) & q->mask] = s;
+}
+
+static void dq_rebuild(Deque *q) {
+    q->lo_head = q->lo_count = q->hi_head = q->hi_count = 0;
+    for (int i = 0; i < q->count; i++) {
+        dq_cand_push(q, q->lo, &q->lo_head, &q->lo_count, 1, q->seq + i);
+        dq_cand_push(q, q->hi, &q->hi_head, &q->hi_count, -1, q->seq + i);
+    }
+    q->stale = 0;
+}
+
+static double dq_pop_front(Deque *q) {
+    double x = *dq_at(q, 0);
+    if (!q->stale) {
+        if (q->lo_count > 0 && q->lo[q->lo_head] == q->seq) {
+            q->lo_head = (q->lo_head + 1) & q->mask;
+            q->lo_count--;
+        }
+        if (q->hi_count > 0 && q->hi[q->hi_head] == q->seq) {
+            q->hi_head = (q->hi_head + 1) & q->mask;
+            q->hi_count--;
+        }
+    }
+    q->head = (q->head + 1) & q->mask;
+    q->seq++;
+    q->count--;
+    dq_add_sum(q, -x);
+    return x;
+}
+
+static double dq_pop_back(Deque *q) {
+    double x = *dq_at(q, q->count - 1);
+    q->count--;
+    q->stale = 1;
+    dq_add_sum(q, -x);
+    return x;
+}
+
+static void dq_push_back(Deque *q, double x) {
+    if (q->limit > 0 && q->count == q->limit) dq_pop_front(q);
+    dq_grow(q);
+    *dq_at(q, q->count++) = x;
+    dq_add_sum(q, x);
+    if (!q->stale) {
+        dq_cand_push(q, q->lo, &q->lo_head, &q->lo_count, 1, q->seq + q->count - 1);
+        dq_cand_push(q, q->hi, &q->hi_head, &q->hi_count, -1, q->seq + q->count - 1);
+    }
+}
+
+static void dq_push_front(Deque *q, double x) {
+    if (q->limit > 0 && q->count == q->limit) dq_pop_back(q);
+    dq_grow(q);
+    q->head = (q->head - 1) & q->mask;
+    q->seq--;
+    q->count++;
+    *dq_at(q, 0) = x;
+    dq_add_sum(q, x);
+    q->stale = 1;
+}
+
+static void dq_reset(Deque *q) {
+    free(q->v);
+    free(q->lo);
+    free(q->hi);
+    memset(q, 0, sizeof *q);
+}
+
+void deque_free(void) {
+    for (int d = 0; d < DQ_MAX; d++) dq_reset(&deques[d]);
+}
+
+Value call_deque_function(const char *name, Value *args, int nargs) {
+    Value result;
+    double d = nargs > 0 ? value_to_number(args[0]) : 0.0;
+    double x = nargs > 1 ? value_to_number(args[1]) : 0.0;
+
+    result.type = TYPE_NUMBER;
+    result.data.num = 0.0;
+    if (!(d >= 0.0 && d < DQ_MAX && d == (int)d)) {
+        printw("Warning: %s: no deque %.15g (0-%d)\n", name, d, DQ_MAX - 1);
+        refresh();
+        return result;
+    }
+    Deque *q = &deques[(int)d];
+
+    if (strcmp(name, "dqinit") == 0) {
+        dq_reset(q);
+        q->limit = x >= 1.0 ? (x < (double)INT_MAX ? (int)x : INT_MAX) : 0;
+    } else if (strcmp(name, "dqpush") == 0) {
+        dq_push_back(q, x);
+        result.data.num = q->count;
+    } else if (strcmp(name, "dqpushf") == 0) {
+        dq_push_front(q, x);
+        result.data.num = q->count;
+    } else if (strcmp(name, "dqsize") == 0) {
+        result.data.num = q->count;
+    } else if (strcmp(name, "dqsum") == 0) {
+        result.data.num = q->sum + q->comp;
+    } else if (strcmp(name, "dqget") == 0 || strcmp(name, "dqset") == 0) {
+        double k = x < 0.0 ? x + q->count : x;
+        double *p = k >= 0.0 && k < q->count ? dq_at(q, (int)k) : NULL;
+        if (name[2] == 's') {
+            double y = nargs > 2 ? value_to_number(args[2]) : 0.0;
+            if (p) {
+                dq_add_sum(q, y - *p);
+                *p = y;
+                q->stale = 1;
+            }
+            result.data.num = y;
+        } else if (p) {
+            result.data.num = *p;
+        }
+    } else if (q->count > 0) {
+        /* dqpop, dqpopf, dqmin, dqmax */
+        if (strcmp(name, "dqpop") == 0) {
+            result.data.num = dq_pop_back(q);
+        } else if (strcmp(name, "dqpopf") == 0) {
+            result.data.num = dq_pop_front(q);
+        } else {
+            if (q->stale) dq_rebuild(q);
+            int64_t s = name[3] == 'i' ? q->lo[q->lo_head] : q->hi[q->hi_head];
+            result.data.num = dq_seq_value(q, s);
+        }
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Bitsets                                                              */
+/*                                                                      */
+/* Functions:                                                           */
+/*   bsset(b,i)        - set bit i of bitset b; returns its old value  */
+/*   bsclear(b,i)      - clear bit i; returns its old value            */
+/*   bstest(b,i)       - bit i (0 or 1)                                */
+/*   bsfill(b,i,n)     - set bits i .. i+n-1                           */
+/*   bsinit(b)         - clear all bits                                */
+/*   bscount(b)        - number of set bits                            */
+/*   bsfirst(b,i)      - first set bit at or after i (default 0),      */
+/*                       -1 if none                                    */
+/*   bsand(d,a,b), bsor(d,a,b), bsxor(d,a,b), bsandnot(d,a,b)          */
+/*                     - bitset d = a AND / OR / XOR / AND NOT b;      */
+/*                       returns the number of set bits in d           */
+/*                                                                      */
+/* Bitsets are numbered 0 to BS_MAX-1 and grow to the highest bit set. */
+/* Bits are kept in 64-bit words. Counting uses the popcount builtin   */
+/* and searching skips zero words; the bulk operations are plain word  */
+/* loops the compiler vectorizes.                                      */
+/* ------------------------------------------------------------------ */
+#define BS_MAX 256
+#define BS_MAX_BIT (INT_MAX - 63)
+
+typedef struct {
+    uint64_t *w;
+    int n;                 /* words in use; bits past them are 0 */
+} Bitset;
+
+static Bitset bitsets[BS_MAX];
+
+static int is_bitset_function(const char *name) {
+    static const char *bitset_funcs[] = {
+        "bsset", "bsclear", "bstest", "bsfill", "bsinit", "bscount", "bsfirst",
+        "bsand", "bsor", "bsxor", "bsandnot",
+        NULL
+    };
+    for (int i = 0; bitset_funcs[i]; i++)
+        if (strcmp(name, bitset_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+static void bs_grow(Bitset *b, int words) {
+    if (words <= b->n) return;
+    b->w = (uint64_t *)realloc(b->w, words * sizeof(uint64_t));
+    memset(b->w + b->n, 0, (words - b->n) * sizeof(uint64_t));
+    b->n = words;
+}
+
+static int bs_count(const Bitset *b) {
+    int c = 0;
+    for (int i = 0; i < b->n; i++) c += __builtin_popcountll(b->w[i]);
+    return c;
+}
+
+/* Argument i as a bitset number, or NULL after a warning */
+static Bitset *bs_arg(const char *name, const Value *args, int nargs, int i) {
+    double d = i < nargs ? value_to_number(args[i]) : 0.0;
+    if (d >= 0.0 && d < BS_MAX && d == (int)d) return &bitsets[(int)d];
+    printw("Warning: %s: no bitset %.15g (0-%d)\n", name, d, BS_MAX - 1);
+    refresh();
+    return NULL;
+}
+
+/* Argument i as a bit number 0 .. BS_MAX_BIT-1 (default 0), or -1 after
+   a warning. A bit past the range is not rounded to the last one. */
+static int bs_bit(const char *name, const Value *args, int nargs, int i) {
+    double d = i < nargs ? value_to_number(args[i]) : 0.0;
+    if (d >= 0.0 && d < BS_MAX_BIT && d == (int)d) return (int)d;
+    printw("Warning: %s: no bit %.15g (0-%d)\n", name, d, BS_MAX_BIT - 1);
+    refresh();
+    return -1;
+}
+
+void bitset_free(void) {
+    for (int i = 0; i < BS_MAX; i++) {
+        free(bitsets[i].w);
+        bitsets[i].w = NULL;
+        bitsets[i].n = 0;
+    }
+}
+
+Value call_bitset_function(const char *name, Value *args, int nargs) {
+    Value result;
+    Bitset *b = bs_arg(name, args, nargs, 0);
+    int bit;
+
+    result.type = TYPE_NUMBER;
+    result.data.num = 0.0;
+    if (!b) return result;
+
+    if (strcmp(name, "bstest") == 0 || strcmp(name, "bsset") == 0 || strcmp(name, "bsclear") == 0) {
+        if ((bit = bs_bit(name, args, nargs, 1)) < 0) return result;
+        int k = bit >> 6;
+        uint64_t m = 1ull << (bit & 63);
+        if (name[2] == 's') bs_grow(b, k + 1);
+        if (k < b->n) {
+            result.data.num = (b->w[k] & m) != 0;
+            if (name[2] == 's') b->w[k] |= m;
+            else if (name[2] == 'c') b->w[k] &= ~m;
+        }
+    } else if (strcmp(name, "bsfill") == 0) {
+        double c = nargs > 2 ? value_to_number(args[2]) : 0.0;
+        if ((bit = bs_bit(name, args, nargs, 1)) < 0) return result;
+        if (!(c >= 0.0 && c <= (double)(BS_MAX_BIT - bit) && c == (int)c)) {
+            printw("Warning: bsfill: no bits %d to %.15g (0-%d)\n", bit, bit + c - 1, BS_MAX_BIT - 1);
+            refresh();
+            return result;
+        }
+        int end = bit + (int)c;
+        if (end > bit) {
+            bs_grow(b, ((end - 1) >> 6) + 1);
+            int k0 = bit >> 6, k1 = (end - 1) >> 6;
+            uint64_t lo = ~0ull << (bit & 63), hi = ~0ull >> (63 - ((end - 1) & 63));
+            if (k0 == k1) {
+                b->w[k0] |= lo & hi;
+            } else {
+                b->w[k0] |= lo;
+                for (int k = k0 + 1; k < k1; k++) b->w[k] = ~0ull;
+                b->w[k1] |= hi;
+            }
+        }
+    } else if (strcmp(name, "bsinit") == 0) {
+        free(b->w);
+        b->w = NULL;
+        b->n = 0;
+    } else if (strcmp(name, "bscount") == 0) {
+        result.data.num = bs_count(b);
+    } else if (strcmp(name, "bsfirst") == 0) {
+        result.data.num = -1.0;
+        if ((bit = bs_bit(name, args, nargs, 1)) < 0) return result;
+        int k = bit >> 6;
+        if (k < b->n) {
+            uint64_t w = b->w[k] & (~0ull << (bit & 63));
+            while (!w && ++k < b->n) w = b->w[k];
+            if (w) result.data.num = (double)k * 64 + __builtin_ctzll(w);
+        }
+    } else {
+        /* bsand, bsor, bsxor, bsandnot: d = a op b */
+        Bitset *x = bs_arg(name, args, nargs, 1);
+        Bitset *y = bs_arg(name, args, nargs, 2);
+        if (!x || !y) return result;
+        int op = name[2] == 'o' ? '|' : name[2] == 'x' ? '^' : name[5] ? '-' : '&';
+        int n = op == '&' ? (x->n < y->n ? x->n : y->n) : op == '-' ? x->n : (x->n > y->n ? x->n : y->n);
+        int common = x->n < y->n ? x->n : y->n;
+        if (common > n) common = n;
+        uint64_t *w = (uint64_t *)malloc((n ? n : 1) * sizeof(uint64_t));
+        const uint64_t *xw = x->w, *yw = y->w;
+        switch (op) {
+            case '&': for (int k = 0; k < common; k++) w[k] = xw[k] & yw[k]; break;
+            case '|': for (int k = 0; k < common; k++) w[k] = xw[k] | yw[k]; break;
+            case '^': for (int k = 0; k < common; k++) w[k] = xw[k] ^ yw[k]; break;
+            default:  for (int k = 0; k < common; k++) w[k] = xw[k] & ~yw[k]; break;
+        }
+        /* The longer operand's tail: a bit against 0 */
+        const Bitset *longer = x->n > y->n ? x : y;
+        for (int k = common; k < n; k++) w[k] = longer->w[k];
+        free(b->w);
+        b->w = w;
+        b->n = n;
+        result.data.num = bs_count(b);
+    }
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Virtual clock (--virtual-clock LINE[,FRAME])                         */
+/*                                                                      */
+/* ticks(), elapsed() and time() read a clock that advances LINE ms for */
+/* every program line executed and FRAME ms for every grefresh(), and  */
+/* time() starts at 0. A program paced by the clock then runs at full  */
+/* speed and gives the same values on every run: a wait such as        */
+/* '#=(ticks()<T)*#' ends after (T-ticks())/LINE lines.                 */
+/* ------------------------------------------------------------------ */
+static double vclock_now(void) {
+    return (double)lines_executed * g_vclock_line + g_vclock_frames * g_vclock_frame;
+}
+
+/* ------------------------------------------------------------------ */
+/* Screen function dispatcher (uses PDCurses API)                      */
+/*                                                                      */
+/* Functions:                                                           */
+/*   gotoxy(x,y)       - move cursor; returns 1 on success, 0 on fail  */
+/*   putch(c)          - write char/string at cursor; returns old ASCII */
+/*   getch()           - read char code at cursor; returns ASCII or -1  */
+/*   setfore(color)    - set foreground color 0-7; returns 1/0          */
+/*   setback(color)    - set background color 0-7; returns 1/0          */
+/*   setattr(attr)     - set attribute 0=normal,1=bold,2=reverse        */
+/*   getw()            - return number of visible columns               */
+/*   geth()            - return number of visible rows                  */
+/*   clear()           - clear screen with current background color     */
+/* ------------------------------------------------------------------ */
+Value call_screen_function(const char *name, Value *args, int nargs) {
+    Value result;
+    result.type  = TYPE_NUMBER;
+    result.data.num = 0.0;
+
+    /* gotoxy(x, y) -------------------------------------------------- */
+    if (strcmp(name, "gotoxy") == 0) {
+        if (nargs >= 2) {
+            int x    = (int)value_to_number(args[0]);
+            int y    = (int)value_to_number(args[1]);
+            int rows = 0, cols = 0;
+            getmaxyx(stdscr, rows, cols);
+            if (x >= 0 && x < cols && y >= 0 && y < rows) {
+                move(y, x);
+                refresh();
+                result.data.num = 1.0;
+            }
+            /* else result stays 0 (failure) */
+        }
+        return result;
+    }
+
+    /* putch(c) ------------------------------------------------------- */
+    if (strcmp(name, "putch") == 0) {
+        if (nargs >= 1) {
+            /* Capture the character currently at the cursor position */
+            chtype old_ch = inch();
+            result.data.num = (double)(old_ch & 0xFF);
+
+            apply_attrs();
+            if (args[0].type == TYPE_STRING) {
+                /* String argument: print the whole string */
+                const char *p = args[0].data.str;
+                while (*p) addch((unsigned char)*p++);
+            } else {
+                /* Numeric argument: treat as ASCII code */
+                int ch = (int)value_to_number(args[0]);
+                if (ch >= 0 && ch <= 255) {
+                    addch((unsigned char)ch);
+                } else {
+                    result.data.num = -1.0;
+                }
+            }
+            refresh();
+        } else {
+            result.data.num = -1.0;
+        }
+        return result;
+    }
+
+    /* getch() -------------------------------------------------------- */
+    /* Reads the character at the current cursor position (screen read) */
+    if (strcmp(name, "getch") == 0) {
+        chtype ch = inch();
+        result.data.num = (ch == (chtype)ERR) ? -1.0 : (double)(ch & 0xFF);
+        return result;
+    }
+
+    /* setfore(color) ------------------------------------------------- */
+    if (strcmp(name, "setfore") == 0) {
+        if (nargs >= 1) {
+            int color = (int)value_to_number(args[0]);
+            if (color >= 0 && color <= 7) {
+                itl_fg = color;
+                apply_attrs();
+                result.data.num = 1.0;
+            }
+        }
+        return result;
+    }
+
+    /* setback(color) ------------------------------------------------- */
+    if (strcmp(name, "setback") == 0) {
+        if (nargs >= 1) {
+            int color = (int)value_to_number(args[0]);
+            if (color >= 0 && color <= 7) {
+                itl_bg = color;
+                apply_attrs();
+                result.data.num = 1.0;
+            }
+        }
+        return result;
+    }
+
+    /* setattr(attr) -------------------------------------------------- */
+    /* 0=normal, 1=bold, 2=reverse                                       */
+    if (strcmp(name, "setattr") == 0) {
+        if (nargs >= 1) {
+            int attr = (int)value_to_number(args[0]);
+            switch (attr) {
+                case 1:  itl_attr = A_BOLD;    break;
+                case 2:  itl_attr = A_REVERSE; break;
+                default: itl_attr = A_NORMAL;  break;
+            }
+            apply_attrs();
+            result.data.num = (double)attr;
+        }
+        return result;
+    }
+
+    /* getw() --------------------------------------------------------- */
+    if (strcmp(name, "getw") == 0) {
+        int rows = 0, cols = 0;
+        getmaxyx(stdscr, rows, cols);
+        (void)rows;
+        result.data.num = (double)cols;
+        return result;
+    }
+
+    /* geth() --------------------------------------------------------- */
+    if (strcmp(name, "geth") == 0) {
+        int rows = 0, cols = 0;
+        getmaxyx(stdscr, rows, cols);
+        (void)cols;
+        result.data.num = (double)rows;
+        return result;
+    }
+
+    /* clear() -------------------------------------------------------- */
+    /* Fills screen with current background color and moves cursor to    */
+    /* the top-left corner.                                              */
+    if (strcmp(name, "clear") == 0) {
+        int pair = itl_bg * 8 + itl_fg + 1;
+        /* bkgd sets the default fill character + color for the window  */
+        bkgd((chtype)(COLOR_PAIR(pair) | ' '));
+        /* PDCurses clear() erases all cells and schedules full repaint  */
+        wclear(stdscr);
+        move(0, 0);
+        refresh();
+        result.data.num = 1.0;
+        return result;
+    }
+
+    /* tmx() ---------------------------------------------------------- */
+    if (strcmp(name, "tmx") == 0) {
+        result.data.num = (double)g_tmouse_x;
+        return result;
+    }
+
+    /* tmy() ---------------------------------------------------------- */
+    if (strcmp(name, "tmy") == 0) {
+        result.data.num = (double)g_tmouse_y;
+        return result;
+    }
+
+    /* tmclick() ------------------------------------------------------ */
+    /* Ritorna il pulsante dell'ultimo click (1/2/3) e lo azzera       */
+    if (strcmp(name, "tmclick") == 0) {
+        result.data.num = (double)g_tmouse_click;
+        g_tmouse_click = 0;
+        return result;
+    }
+
+    /* tmdrag(b) ------------------------------------------------------ */
+    /* Ritorna 1 se il pulsante b (1/2/3) è tenuto premuto             */
+    /* mentre il mouse si muove, 0 altrimenti                          */
+    if (strcmp(name, "tmdrag") == 0) {
+        int btn = (nargs >= 1) ? (int)value_to_number(args[0]) : 1;
+        int bit = (btn == 1) ? 1 : (btn == 2) ? 2 : 4;
+        result.data.num = (g_tmouse_drag & bit) ? 1.0 : 0.0;
+        return result;
+    }
+
+    /* gopen(w,h) ---------------------------------------------------- */
+    if (strcmp(name, "gopen") == 0) {
+        int w = (nargs >= 1) ? (int)value_to_number(args[0]) : 640;
+        int h = (nargs >= 2) ? (int)value_to_number(args[1]) : 480;
+        gfx_open(w, h);
+        result.data.num = 1.0;
+        return result;
+    }
+
+    /* gclear() ------------------------------------------------------- */
+    if (strcmp(name, "gclear") == 0) {
+        if (g_hdc_buf) {
+            EnterCriticalSection(&g_gfx_cs);
+            RECT r = {0, 0, g_gfx_w, g_gfx_h};
+            HBRUSH b = CreateSolidBrush(g_brush_color);
+            FillRect(g_hdc_buf, &r, b);
+            DeleteObject(b);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gpen(r,g,b) ---------------------------------------------------- */
+    if (strcmp(name, "gpen") == 0) {
+        if (nargs >= 3) {
+            int r = (int)value_to_number(args[0]);
+            int g = (int)value_to_number(args[1]);
+            int b = (int)value_to_number(args[2]);
+            g_pen_color = RGB(r, g, b);
+            EnterCriticalSection(&g_gfx_cs);
+            HPEN new_pen = CreatePen(PS_SOLID, 1, g_pen_color);
+            SelectObject(g_hdc_buf, new_pen);
+            if (g_pen) DeleteObject(g_pen);
+            g_pen = new_pen;
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gbr(r,g,b) ----------------------------------------------------- */
+    if (strcmp(name, "gbr") == 0) {
+        if (nargs >= 3) {
+            int r = (int)value_to_number(args[0]);
+            int g = (int)value_to_number(args[1]);
+            int b = (int)value_to_number(args[2]);
+            g_brush_color = RGB(r, g, b);
+            EnterCriticalSection(&g_gfx_cs);
+            HBRUSH new_brush = CreateSolidBrush(g_brush_color);
+            SelectObject(g_hdc_buf, new_brush);
+            if (g_brush) DeleteObject(g_brush);
+            g_brush = new_brush;
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gpixel(x,y) ---------------------------------------------------- */
+    if (strcmp(name, "gpixel") == 0) {
+        if (nargs >= 2 && g_hdc_buf) {
+            int x = (int)value_to_number(args[0]);
+            int y = (int)value_to_number(args[1]);
+            EnterCriticalSection(&g_gfx_cs);
+            SetPixel(g_hdc_buf, x, y, g_pen_color);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gline(x1,y1,x2,y2) -------------------------------------------- */
+    if (strcmp(name, "gline") == 0) {
+        if (nargs >= 4 && g_hdc_buf) {
+            int x1 = (int)value_to_number(args[0]);
+            int y1 = (int)value_to_number(args[1]);
+            int x2 = (int)value_to_number(args[2]);
+            int y2 = (int)value_to_number(args[3]);
+            EnterCriticalSection(&g_gfx_cs);
+            MoveToEx(g_hdc_buf, x1, y1, NULL);
+            LineTo(g_hdc_buf, x2, y2);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* grect(x1,y1,x2,y2) -------------------------------------------- */
+    /* Disegna solo il bordo (usa penna corrente, pennello trasparente)  */
+    if (strcmp(name, "grect") == 0) {
+        if (nargs >= 4 && g_hdc_buf) {
+            int x1 = (int)value_to_number(args[0]);
+            int y1 = (int)value_to_number(args[1]);
+            int x2 = (int)value_to_number(args[2]);
+            int y2 = (int)value_to_number(args[3]);
+            EnterCriticalSection(&g_gfx_cs);
+            HBRUSH old_brush = (HBRUSH)SelectObject(g_hdc_buf,
+                                   GetStockObject(NULL_BRUSH));
+            Rectangle(g_hdc_buf, x1, y1, x2, y2);
+            SelectObject(g_hdc_buf, old_brush);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gfillrect(x1,y1,x2,y2) ---------------------------------------- */
+    /* Rettangolo pieno con pennello corrente                            */
+    if (strcmp(name, "gfillrect") == 0) {
+        if (nargs >= 4 && g_hdc_buf) {
+            int x1 = (int)value_to_number(args[0]);
+            int y1 = (int)value_to_number(args[1]);
+            int x2 = (int)value_to_number(args[2]);
+            int y2 = (int)value_to_number(args[3]);
+            EnterCriticalSection(&g_gfx_cs);
+            Rectangle(g_hdc_buf, x1, y1, x2, y2);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gcircle(x,y,r) ------------------------------------------------- */
+    /* Ellisse (solo bordo) centrata in (x,y) con raggio r              */
+    if (strcmp(name, "gcircle") == 0) {
+        if (nargs >= 3 && g_hdc_buf) {
+            int x = (int)value_to_number(args[0]);
+            int y = (int)value_to_number(args[1]);
+            int r = (int)value_to_number(args[2]);
+            EnterCriticalSection(&g_gfx_cs);
+            HBRUSH old_brush = (HBRUSH)SelectObject(g_hdc_buf,
+                                   GetStockObject(NULL_BRUSH));
+            Ellipse(g_hdc_buf, x - r, y - r, x + r, y + r);
+            SelectObject(g_hdc_buf, old_brush);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gfillcircle(x,y,r) -------------------------------------------- */
+    /* Ellisse piena con pennello corrente                               */
+    if (strcmp(name, "gfillcircle") == 0) {
+        if (nargs >= 3 && g_hdc_buf) {
+            int x = (int)value_to_number(args[0]);
+            int y = (int)value_to_number(args[1]);
+            int r = (int)value_to_number(args[2]);
+            EnterCriticalSection(&g_gfx_cs);
+            Ellipse(g_hdc_buf, x - r, y - r, x + r, y + r);
+            LeaveCriticalSection(&g_gfx_cs);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* gtext(x,y,str) ------------------------------------------------- */
+    /* Scrive testo in posizione pixel (x,y) con colore penna corrente  */
+    if (strcmp(name, "gtext") == 0) {
+        if (nargs >= 3 && g_hdc_buf) {
+            int x = (int)value_to_number(args[0]);
+            int y = (int)value_to_number(args[1]);
+            char *str = (args[2].type == TYPE_STRING)
+                        ? args[2].data.str
+                        : value_to_string(args[2]);
+            EnterCriticalSection(&g_gfx_cs);
+            SetTextColor(g_hdc_buf, g_pen_color);
+            SetBkMode(g_hdc_buf, TRANSPARENT);
+            TextOut(g_hdc_buf, x, y, str, (int)strlen(str));
+            LeaveCriticalSection(&g_gfx_cs);
+            if (args[2].type != TYPE_STRING) free(str);
+            result.data.num = 1.0;
+        }
+        return result;
+    }
+
+    /* grefresh() ----------------------------------------------------- */
+    if (strcmp(name, "grefresh") == 0) {
+        g_vclock_frames++;
+        gfx_refresh();
+        result.data.num = 1.0;
+        return result;
+    }
+
+    /* gmx() ---------------------------------------------------------- */
+    if (strcmp(name, "gmx") == 0) {
+        result.data.num = (double)g_mouse_x;
+        return result;
+    }
+
+    /* gmy() ---------------------------------------------------------- */
+    if (strcmp(name, "gmy") == 0) {
+        result.data.num = (double)g_mouse_y;
+        return result;
+    }
+
+    /* gmb() ---------------------------------------------------------- */
+    /* Ritorna la maschera dei pulsanti attualmente premuti            */
+    /* bit 0=sinistro, bit 1=destro, bit 2=centrale                   */
+    if (strcmp(name, "gmb") == 0) {
+        result.data.num = (double)g_mouse_btn;
+        return result;
+    }
+
+    /* gmclick() ------------------------------------------------------ */
+    /* Ritorna il pulsante dell'ultimo click (1/2/3) e lo azzera       */
+    if (strcmp(name, "gmclick") == 0) {
+        result.data.num = (double)g_mouse_click;
+        g_mouse_click = 0;
+        return result;
+    }
+
+    /* gmdrag(b) ------------------------------------------------------ */
+    /* Ritorna 1 se il pulsante b (1/2/3) è tenuto premuto             */
+    /* mentre il mouse si muove, 0 altrimenti                          */
+    if (strcmp(name, "gmdrag") == 0) {
+        int btn = (nargs >= 1) ? (int)value_to_number(args[0]) : 1;
+        int bit = (btn == 1) ? 1 : (btn == 2) ? 2 : 4;
+        result.data.num = (g_mouse_drag & bit) ? 1.0 : 0.0;
+        return result;
+    }
+
+    /* time() -------------------------------------------------------- */
+    /* Restituisce i secondi interi trascorsi dall'epoca Unix (1/1/1970) */
+    if (strcmp(name, "time") == 0) {
+        result.data.num = g_vclock ? floor(vclock_now() / 1000.0) : (double)time(NULL);
+        return result;
+    }
+
+    /* ticks() ------------------------------------------------------- */
+    /* Restituisce i millisecondi trascorsi dall'avvio dell'interprete   */
+    if (strcmp(name, "ticks") == 0) {
+        if (g_vclock) {
+            result.data.num = vclock_now();
+            return result;
+        }
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        result.data.num = (double)(now.QuadPart - g_timer_start.QuadPart)
+                          * 1000.0 / (double)g_timer_freq.QuadPart;
+        return result;
+    }
+
+    /* elapsed() ----------------------------------------------------- */
+    /* Restituisce i millisecondi trascorsi dall'ultima chiamata         */
+    /* a elapsed() (o dall'avvio se non era mai stata chiamata)         */
+    if (strcmp(name, "elapsed") == 0) {
+        if (g_vclock) {
+            double now = vclock_now();
+            result.data.num = now - g_vclock_elapsed;
+            g_vclock_elapsed = now;
+            return result;
+        }
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        result.data.num = (double)(now.QuadPart - g_timer_elapsed.QuadPart)
+                          * 1000.0 / (double)g_timer_freq.QuadPart;
+        g_timer_elapsed = now;
+        return result;
+    }
+
+    /* Unknown screen function */
+    result.type = TYPE_UNDEFINED;
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Returns 1 if 'name' is a known screen function, 0 otherwise        */
+/* ------------------------------------------------------------------ */
+static int is_screen_function(const char *name) {
+    static const char *screen_funcs[] = {
+        "gotoxy", "putch", "getch", "setfore", "setback",
+        "setattr", "getw", "geth", "clear",
+        "tmx", "tmy", "tmclick", "tmdrag",
+        "gopen","gclear","gpen","gbr","gpixel","gline",
+        "grect","gfillrect","gcircle","gfillcircle","gtext","grefresh",
+        "gmx", "gmy", "gmb", "gmclick", "gmdrag",
+        "time", "ticks", "elapsed",
+        NULL
+    };
+    for (int i = 0; screen_funcs[i]; i++)
+        if (strcmp(name, screen_funcs[i]) == 0) return 1;
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Builtin families: math functions take numbers, the others Values   */
+/* ------------------------------------------------------------------ */
+enum { FN_MATH, FN_SCREEN, FN_STRING, FN_TABLE, FN_HEAP, FN_DEQUE, FN_BITSET };
+
+static int builtin_family(const char *name) {
+    if (is_screen_function(name)) return FN_SCREEN;
+    if (is_string_function(name)) return FN_STRING;
+    if (is_table_function(name)) return FN_TABLE;
+    if (is_heap_function(name)) return FN_HEAP;
+    if (is_deque_function(name)) return FN_DEQUE;
+    if (is_bitset_function(name)) return FN_BITSET;
+    return FN_MATH;
+}
+
+/* ------------------------------------------------------------------ */
+/* Native extensions (:load file, --ext file)                           */
+/*                                                                      */
+/* An extension is a DLL exporting itl_ext_init() (see itl_ext.h),     */
+/* which registers functions that take and return numbers. They join   */
+/* the math family: parse_primary() resolves any lowercase name that   */
+/* is not another builtin to call_math_function(), which looks them up */
+/* after its own names. A function registered as ITL_EXT_PURE is pure  */
+/* to the optimizer, any other is treated like an I/O builtin.         */
+/*                                                                      */
+/* A bare file name is looked for in each directory of ITL_EXT_PATH    */
+/* (separated by ';') before the usual DLL search. In file mode the    */
+/* ':load' lines of the program are loaded before the optimizer runs,  */
+/* so it knows the functions they define. Extensions stay loaded until */
+/* the interpreter exits.                                              */
+/* ------------------------------------------------------------------ */
+#define EXT_LIBS_MAX 32
+
+static HMODULE ext_libs[EXT_LIBS_MAX];
+static char *ext_files[EXT_LIBS_MAX];   /* as given to ext_load() */
+static int ext_nlibs = 0;
+
+static void ext_warn(const char *msg) {
+    if (stdscr) {
+        printw("Warning: %s\n", msg);
+        refresh();
+    } else {
+        fprintf(stderr, "Warning: %s\n", msg);
+    }
+}
+
+static int ext_define(const char *name, int nargs, int flags, ItlExtFn fn) {
+    char msg[128];
+    size_t len = name ? strlen(name) : 0;
+    const char *why = NULL;
+    if (len == 0 || len > 63 || !islower((unsigned char)name[0]) ||
+        strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789") != len)
+        why = "is not lowercase letters and digits";
+    else if (builtin_family(name) != FN_MATH || math_function_arity(name) >= 0 ||
+             strcmp(name, "adim") == 0 || strcmp(name, "aview") == 0)
+        why = "is a builtin";
+    else if (ext_find(name))
+        why = "is already defined";
+    else if (!fn || nargs < 0 || nargs > MAX_FUNC_ARGS)
+        why = "has no function or a bad argument count";
+    else if (ext_count == EXT_MAX)
+        why = "does not fit: too many extension functions";
+    if (why) {
+        snprintf(msg, sizeof(msg), "extension function '%.63s' %s", name ? name : "", why);
+        ext_warn(msg);
+        return 0;
+    }
+    ExtFn *x = &ext_fns[ext_count++];
+    memcpy(x->name, name, len + 1);
+    x->nargs = nargs;
+    x->flags = flags;
+    x->fn = fn;
+    return 1;
+}
+
+static const ItlExtApi ext_api = { ITL_EXT_ABI, ext_define, ext_warn };
+
+/* Load an extension; 1 if it is loaded, now or before */
+int ext_load(const char *file, int verbose) {
+    char path[MAX_PATH], msg[MAX_PATH + 64];
+    HMODULE lib = NULL;
+
+    for (int i = 0; i < ext_nlibs; i++)
+        if (_stricmp(ext_files[i], file) == 0) return 1;
+    if (ext_nlibs == EXT_LIBS_MAX) {
+        ext_warn(":load: too many extensions");
+        return 0;
+    }
+    const char *dirs = getenv("ITL_EXT_PATH");
+    if (dirs && !strpbrk(file, "/\\:")) {
+        while (*dirs && !lib) {
+            size_t n = strcspn(dirs, ";");
+            if (n > 0 && snprintf(path, sizeof(path), "%.*s\\%s", (int)n, dirs, file) < (int)sizeof(path))
+                lib = LoadLibrary(path);
+            dirs += n + (dirs[n] == ';');
+        }
+    }
+    if (!lib) lib = LoadLibrary(file);
+    if (!lib) {
+        snprintf(msg, sizeof(msg), ":load: cannot load '%s' (error %lu)", file, (unsigned long)GetLastError());
+        ext_warn(msg);
+        return 0;
+    }
+
+    ItlExtInit init = (ItlExtInit)(void (*)(void))GetProcAddress(lib, ITL_EXT_ENTRY);
+    int before = ext_count;
+    if (!init || !init(&ext_api)) {
+        snprintf(msg, sizeof(msg), init ? ":load: '%s' refused to load (needs ABI %d?)"
+                                        : ":load: '%s' has no " ITL_EXT_ENTRY "()", file, ITL_EXT_ABI);
+        ext_warn(msg);
+        ext_count = before;   /* forget what it registered before refusing */
+        FreeLibrary(lib);
+        return 0;
+    }
+    ext_libs[ext_nlibs] = lib;
+    ext_files[ext_nlibs++] = _strdup(file);
+    if (verbose) {
+        printw("Loaded %s: %d function%s\n", file, ext_count - before, ext_count - before == 1 ? "" : "s");
+        refresh();
+    }
+    return 1;
+}
+
+/* File name of ':load FILE', without blanks or quotes; 0 if none fits */
+static int ext_file_arg(const char *arg, char *file, size_t size) {
+    const char *p = arg + strspn(arg, " \t");
+    size_t n = strlen(p);
+    while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) n--;
+    if (n >= 2 && p[0] == '"' && p[n - 1] == '"') { p++; n -= 2; }
+    if (n == 0 || n >= size) return 0;
+    memcpy(file, p, n);
+    file[n] = '\0';
+    return 1;
+}
+
+/* Load the extensions named by ':load' lines of the program */
+void ext_preload(void) {
+    char file[MAX_PATH];
+    for (int i = 0; i < line_count; i++) {
+        const char *line = source_lines[i] + strspn(source_lines[i], " \t");
+        if (strncmp(line, ":load ", 6) == 0 && ext_file_arg(line + 6, file, sizeof(file)))
+            ext_load(file, 0);
+    }
+}
+
+void ext_free(void) {
+    for (int i = 0; i < ext_nlibs; i++) {
+        FreeLibrary(ext_libs[i]);
+        free(ext_files[i]);
+    }
+    ext_nlibs = 0;
+    ext_count = 0;
+}
+
+static Value call_value_function(int fn, const char *name, Value *args, int nargs) {
+    if (fn == FN_STRING) return call_string_function(name, args, nargs);
+    if (fn == FN_TABLE) return call_table_function(name, args, nargs);
+    if (fn == FN_HEAP) return call_heap_function(name, args, nargs);
+    if (fn == FN_DEQUE) return call_deque_function(name, args, nargs);
+    if (fn == FN_BITSET) return call_bitset_function(name, args, nargs);
+    if ((rec_in || rec_out) && rec_screen_input(name)) {
+        Value v;
+        v.type = TYPE_NUMBER;
+        if (!rec_replay_num(name, &v.data.num))
+            v = call_screen_function(name, args, nargs);
+        rec_num(name, v.data.num);
+        return v;
+    }
+    return call_screen_function(name, args, nargs);
+}
+
+/* ------------------------------------------------------------------ */
+/* Loop-invariant expression cache                                     */
+/*                                                                      */
+/* licm_build() marks expressions whose inputs cannot change while     */
+/* execution stays inside a '#=' loop. The first evaluation after the  */
+/* loop is entered stores the value and later iterations skip the      */
+/* text. Entering a loop from outside starts a new epoch for it, which */
+/* invalidates all of its entries at once.                             */
+/* ------------------------------------------------------------------ */
+#define HOIST_PRIMARY 1   /* span parsed by parse_primary()            */
+#define HOIST_CHAIN   2   /* operator chain prefix of evaluate_expression() */
+
+typedef struct {
+    int start, end;       /* source span within the line                */
+    int kind;
+    int loop;
+    unsigned epoch;       /* loop epoch of 'value', 0 = never stored    */
+    double value;
+} HoistEntry;
+
+typedef struct {
+    int n;
+    HoistEntry *e;
+} HoistLine;
+
+static HoistLine *hoist_lines       = NULL;  /* per line (1-based), NULL = off */
+static int       *hoist_line_loop   = NULL;  /* innermost loop of each line   */
+static int       *hoist_loop_parent = NULL;
+static unsigned  *hoist_loop_epoch  = NULL;
+static int        hoist_nlines      = 0;
+int licm_enabled = 1;
+
+void hoist_free(void) {
+    if (hoist_lines) {
+        for (int i = 0; i <= hoist_nlines; i++) free(hoist_lines[i].e);
+        free(hoist_lines);
+    }
+    free(hoist_line_loop);
+    free(hoist_loop_parent);
+    free(hoist_loop_epoch);
+    hoist_lines = NULL;
+    hoist_line_loop = hoist_loop_parent = NULL;
+    hoist_loop_epoch = NULL;
+    hoist_nlines = 0;
+}
+
+/* Cache entries of the line being parsed, NULL if none apply */
+static HoistLine *hoist_line(const ParseContext *ctx) {
+    if (!hoist_lines || in_forward_ref) return NULL;
+    int l = ctx->line_num;
+    if (l < 1 || l > hoist_nlines || l > line_count || ctx->expr != source_lines[l - 1])
+        return NULL;
+    return hoist_lines[l].n ? &hoist_lines[l] : NULL;
+}
+
+static int hoist_valid(const HoistEntry *h) {
+    return h->epoch == hoist_loop_epoch[h->loop];
+}
+
+static int hoist_in_loop(int loop, int inner) {
+    for (; inner >= 0; inner = hoist_loop_parent[inner])
+        if (inner == loop) return 1;
+    return 0;
+}
+
+/* Called before each line runs: new epoch for every loop being entered */
+static void hoist_enter_line(int prev_line, int line) {
+    if (line < 1 || line > hoist_nlines) return;
+    int inner = hoist_line_loop[line];
+    int from = (prev_line >= 1 && prev_line <= hoist_nlines) ? hoist_line_loop[prev_line] : -1;
+    if (inner == from) return;
+    for (int l = inner; l >= 0 && !hoist_in_loop(l, from); l = hoist_loop_parent[l])
+        hoist_loop_epoch[l]++;
+}
+
+/* Store a freshly computed value if nothing irregular happened meanwhile */
+static void hoist_store(HoistEntry *h, const Value *v, unsigned side_effects) {
+    if (v->type == TYPE_NUMBER && side_effects == eval_side_effects) {
+        h->value = v->data.num;
+        h->epoch = hoist_loop_epoch[h->loop];
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Expression evaluator                                                */
+/*                                                                      */
+/* Primaries and operator chains are evaluated by a single loop that   */
+/* keeps its pending work on an explicit stack instead of the C stack. */
+/* A unary operator, '@' index, paren block or argument list pushes a  */
+/* frame and parsing goes on with its operand; a finished operand is   */
+/* handed to the frame on top, which either completes (and is popped)  */
+/* or asks for the next operand. Nesting depth is bounded by memory    */
+/* only. Forward references re-enter the loop through execute_line(), */
+/* which may move the stack, so frames are re-fetched after any call   */
+/* that can run a line.                                                */
+/* ------------------------------------------------------------------ */
+enum {
+    EV_CHAIN,     /* left op right op ...                       */
+    EV_CACHED,    /* primary with a loop-invariant cache entry  */
+    EV_NEG,       /* -primary                                   */
+    EV_NOT,       /* !primary                                   */
+    EV_SEED,      /* 'primary                                   */
+    EV_AREAD,     /* @primary  or  @[expr]primary               */
+    EV_BLOCK,     /* ( statement ; statement ... )              */
+    EV_CALL       /* name( expr , expr ... )                    */
+};
+
+/* Statement being evaluated by an EV_BLOCK frame */
+enum {
+    BS_EQ,        /* VAR = expr                                 */
+    BS_IMPLICIT,  /* VAR expr                                   */
+    BS_SELF,      /* VAR op expr: chain from the variable on    */
+    BS_EXPR       /* anything else                              */
+};
+
+/* What the loop does next */
+enum {
+    EVAL_PRIMARY, /* parse one primary                          */
+    EVAL_CHAIN,   /* parse an operator chain                    */
+    EVAL_STMT,    /* next statement of the block on top         */
+    EVAL_ARG,     /* next argument of the call on top           */
+    EVAL_INDEX,   /* '@' operand: (i,j[,k]) or a primary        */
+    EVAL_RETURN   /* hand the finished value to the top frame   */
+};
+
+typedef struct {
+    int kind, state;
+    ParseContext *ctx;      /* context the frame parses                */
+    Value v;                /* chain left operand / block result       */
+    Value cur;              /* BS_EQ: variable value before the '='    */
+    int var;
+    int start;              /* chain, statement or argument start      */
+    char op;                /* EV_CHAIN: operator awaiting its operand */
+    unsigned side_effects;  /* eval_side_effects when the frame began  */
+    HoistLine *hl;          /* EV_CHAIN: cache entries of the line     */
+    HoistEntry *h;          /* EV_CACHED: entry to fill                */
+    int fn, nargs;          /* EV_CALL: builtin family, argument count */
+    char name[64];
+    Value vargs[MAX_FUNC_ARGS];
+    double args[MAX_FUNC_ARGS];
+} EvalFrame;
+
+static EvalFrame *eval_stack = NULL;
+static int eval_depth = 0;
+static int eval_cap = 0;
+
+void eval_free(void) {
+    free(eval_stack);
+    eval_stack = NULL;
+    eval_depth = eval_cap = 0;
+}
+
+static EvalFrame *eval_push(int kind, ParseContext *ctx) {
+    if (eval_depth == eval_cap) {
+        eval_cap = eval_cap ? eval_cap * 2 : 64;
+        eval_stack = (EvalFrame *)realloc(eval_stack, eval_cap * sizeof(EvalFrame));
+    }
+    EvalFrame *f = &eval_stack[eval_depth++];
+    f->kind = kind;
+    f->state = 0;
+    f->ctx = ctx;
+    f->v.type = TYPE_UNDEFINED;
+    f->cur.type = TYPE_UNDEFINED;
+    return f;
+}
+
+static int is_chain_operator(char op) {
+    return op == '+' || op == '-' || op == '*' || op == '/' || op == '%' ||
+           op == '^' || op == '&' || op == '|' || op == '<' || op == '>' || op == '=';
+}
+
+/* Numeric literal or numeric variable: needs no frame */
+static int eval_leaf(ParseContext *ctx, Value *v) {
+    skip_whitespace(ctx);
+    const char *p = ctx->expr + ctx->pos;
+    if (isdigit((unsigned char)*p) || *p == '.') {
+        char *endptr;
+        v->type = TYPE_NUMBER;
+        v->data.num = strtod(p, &endptr);
+        ctx->pos += (int)(endptr - p);
+        return 1;
+    }
+    if (IS_VARNAME(*p) && variables[VARIDX(*p)].type == TYPE_NUMBER) {
+        *v = variables[VARIDX(*p)];
+        ctx->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Unary frame kind applied to its operand, consuming it */
+static Value eval_unary(int kind, Value operand) {
+    Value result;
+    double x = (operand.type == TYPE_NUMBER) ? operand.data.num : value_to_number(operand);
+    if (operand.type == TYPE_STRING) free_value(&operand);
+    result.type = TYPE_NUMBER;
+
+    switch (kind) {
+        case EV_NEG:
+            result.data.num = -x;
+            break;
+        case EV_NOT:
+            result.data.num = (x == 0.0) ? 1.0 : 0.0;
+            break;
+        case EV_SEED:
+            srand((unsigned int)(int)x);
+            result.data.num = 0.0;
+            break;
+        default:
+            result = array_load(&arrays[0], array_index(x));
+            break;
+    }
+    return result;
+}
+
+/* left op right, consuming both operands */
+static Value apply_operator(char op, Value left, Value right) {
+    Value result;
+
+    /* String concatenation with '+' */
+    if (op == '+' && (left.type == TYPE_STRING || right.type == TYPE_STRING)) {
+        char *ls = value_to_string(left);
+        char *rs = value_to_string(right);
+        result.type = TYPE_STRING;
+        result.data.str = (char *)malloc(strlen(ls) + strlen(rs) + 1);
+        strcpy(result.data.str, ls);
+        strcat(result.data.str, rs);
+        free(ls); free(rs);
+        free_value(&left);
+        free_value(&right);
+    } else {
+        double ln = (left.type == TYPE_NUMBER) ? left.data.num : value_to_number(left);
+        double rn = (right.type == TYPE_NUMBER) ? right.data.num : value_to_number(right);
+        if (left.type == TYPE_STRING) free_value(&left);
+        if (right.type == TYPE_STRING) free_value(&right);
+        result.type = TYPE_NUMBER;
+
+        switch (op) {
+            case '+': result.data.num = ln + rn; break;
+            case '-': result.data.num = ln - rn; break;
+            case '*': result.data.num = ln * rn; break;
+            case '/':
+                result.data.num = (rn == 0.0) ? 0.0 : ln / rn;
+                if (rn == 0.0) { printw("Error: Division by zero\n"); refresh(); eval_side_effects++; }
+                break;
+            case '%':
+                result.data.num = (rn == 0.0) ? 0.0 : fmod(ln, rn);
+                if (rn == 0.0) { printw("Error: Modulo by zero\n"); refresh(); eval_side_effects++; }
+                break;
+            case '^': result.data.num = pow(ln, rn); break;
+            case '&': result.data.num = (ln != 0.0 && rn != 0.0) ? 1.0 : 0.0; break;
+            case '|': result.data.num = (ln != 0.0 || rn != 0.0) ? 1.0 : 0.0; break;
+            case '<': result.data.num = (ln < rn) ? 1.0 : 0.0; break;
+            case '>': result.data.num = (ln > rn) ? 1.0 : 0.0; break;
+            case '=': result.data.num = (ln == rn) ? 1.0 : 0.0; break;
+            default:  result.data.num = 0.0; break;
+        }
+    }
+    return result;
+}
+
+/* '?' inside an expression: one line typed by the user */
+static Value read_input_value(void) {
+    Value result;
+    char input[MAX_LINE_LENGTH];
+    memset(input, 0, sizeof(input));
+    if (repl_mode) {
+        printw("> ");
+        refresh();
+    }
+    if (rec_next("input", input, sizeof(input))) {
+        printw("%s\n", input);
+        refresh();
+    } else {
+        echo();
+        wgetnstr(stdscr, input, sizeof(input) - 1);
+        noecho();
+    }
+    rec_text("input", input);
+    result.type = TYPE_STRING;
+    result.data.str = _strdup(input);
+    return result;
+}
+
+/* Closing ')' of a paren block; the block's value is its last result */
+static Value eval_block_end(ParseContext *ctx, EvalFrame *f) {
+    skip_whitespace(ctx);
+    if (ctx->expr[ctx->pos] == ')')
+        ctx->pos++;
+
+    /* @(i,j[,k]): the block gives the element index of its coordinates */
+    if (f->fn && f->nargs > 0) {
+        if (f->nargs < MAX_FUNC_ARGS) f->args[f->nargs++] = value_to_number(f->v);
+        free_value(&f->v);
+        f->v.type = TYPE_NUMBER;
+        f->v.data.num = array_offset(f->args, f->nargs);
+    }
+
+    if (f->v.type == TYPE_UNDEFINED) {
+        f->v.type = TYPE_NUMBER;
+        f->v.data.num = 0.0;
+    }
+    return f->v;
+}
+
+static Value eval_run(ParseContext *root, int what) {
+    int base = eval_depth;
+    ParseContext *ctx = root;
+    EvalFrame *f;
+    Value ret;
+    int act = what;
+
+    for (;;) {
+        const char *s = ctx->expr;
+
+        switch (act) {
+            /* ----------------------------------------------------------------
+             * Operator chain: resume after the longest cached prefix, if any
+             * ---------------------------------------------------------------- */
+            case EVAL_CHAIN: {
+                HoistLine *hl = hoist_line(ctx);
+                Value left, right;
+                if (!hl && eval_leaf(ctx, &left)) {
+                    /* Numbers and numeric variables only: no frame unless
+                       another kind of operand turns up */
+                    for (;;) {
+                        skip_whitespace(ctx);
+                        char op = s[ctx->pos];
+                        if (!is_chain_operator(op)) {
+                            ret = left;
+                            act = EVAL_RETURN;
+                            break;
+                        }
+                        ctx->pos++;
+                        if (!eval_leaf(ctx, &right)) {
+                            f = eval_push(EV_CHAIN, ctx);
+                            f->hl = NULL;
+                            f->start = -1;
+                            f->side_effects = eval_side_effects;
+                            f->v = left;
+                            f->state = 1;
+                            f->op = op;
+                            act = EVAL_PRIMARY;
+                            break;
+                        }
+                        left = apply_operator(op, left, right);
+                    }
+                    continue;
+                }
+                f = eval_push(EV_CHAIN, ctx);
+                f->hl = hl;
+                f->side_effects = eval_side_effects;
+                f->start = -1;
+                act = EVAL_PRIMARY;
+                if (hl) {
+                    HoistEntry *best = NULL;
+                    skip_whitespace(ctx);
+                    f->start = ctx->pos;
+                    for (int i = 0; i < hl->n; i++) {
+                        HoistEntry *h = &hl->e[i];
+                        if (h->kind == HOIST_CHAIN && h->start == f->start && hoist_valid(h) &&
+                            (!best || h->end > best->end))
+                            best = h;
+                    }
+                    if (best) {
+                        ctx->pos = best->end;
+                        ret.type = TYPE_NUMBER;
+                        ret.data.num = best->value;
+                        act = EVAL_RETURN;
+                    }
+                }
+                continue;
+            }
+
+            case EVAL_PRIMARY: {
+                HoistLine *hl = hoist_line(ctx);
+                act = EVAL_RETURN;
+                if (hl) {
+                    skip_whitespace(ctx);
+                    HoistEntry *h = NULL;
+                    for (int i = 0; i < hl->n && !h; i++)
+                        if (hl->e[i].kind == HOIST_PRIMARY && hl->e[i].start == ctx->pos)
+                            h = &hl->e[i];
+                    if (h && hoist_valid(h)) {
+                        ctx->pos = h->end;
+                        ret.type = TYPE_NUMBER;
+                        ret.data.num = h->value;
+                        continue;
+                    }
+                    if (h) {
+                        f = eval_push(EV_CACHED, ctx);
+                        f->h = h;
+                        f->side_effects = eval_side_effects;
+                    }
+                }
+
+                if (eval_leaf(ctx, &ret))
+                    continue;
+
+                char c = s[ctx->pos];
+                ret.type = TYPE_NUMBER;
+                ret.data.num = 0.0;
+
+                /* Unary minus */
+                if (c == '-' &&
+                    (isdigit((unsigned char)s[ctx->pos + 1]) ||
+                     IS_VARNAME(s[ctx->pos + 1]) ||
+                     s[ctx->pos + 1] == '(' ||
+                     s[ctx->pos + 1] == '@' ||
+                     s[ctx->pos + 1] == '?' ||
+                     s[ctx->pos + 1] == '\'' ||
+                     s[ctx->pos + 1] == '#' ||
+                     s[ctx->pos + 1] == '$')) {
+                    ctx->pos++;
+                    if (!hl && eval_leaf(ctx, &ret)) {
+                        ret = eval_unary(EV_NEG, ret);
+                        continue;
+                    }
+                    eval_push(EV_NEG, ctx);
+                    act = EVAL_PRIMARY;
+                    continue;
+                }
+
+                /* Unary logical NOT */
+                if (c == '!') {
+                    ctx->pos++;
+                    if (!hl && eval_leaf(ctx, &ret)) {
+                        ret = eval_unary(EV_NOT, ret);
+                        continue;
+                    }
+                    eval_push(EV_NOT, ctx);
+                    act = EVAL_PRIMARY;
+                    continue;
+                }
+
+                /* Type conversion ($VAR) */
+                if (c == '$') {
+                    ctx->pos++;
+                    skip_whitespace(ctx);
+
+                    if (IS_VARNAME(s[ctx->pos])) {
+                        int var_idx = VARIDX(s[ctx->pos]);
+                        ctx->pos++;
+                        Value var_val = get_variable(var_idx);
+
+                        if (var_val.type == TYPE_NUMBER) {
+                            ret.type = TYPE_STRING;
+                            ret.data.str = value_to_string(var_val);
+                        } else if (var_val.type == TYPE_STRING) {
+                            ret.data.num = value_to_number(var_val);
+                        }
+                        free_value(&var_val);
+                        continue;
+                    }
+                    /* Not followed by a variable: the rest is parsed as if '$' were absent */
+                    c = s[ctx->pos];
+                }
+
+                /* Parentheses block: statements run in order, see EVAL_STMT */
+                if (c == '(') {
+                    ctx->pos++;
+                    eval_push(EV_BLOCK, ctx)->fn = 0;
+                    act = EVAL_STMT;
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * String literal
+                 * ---------------------------------------------------------------- */
+                if (c == '"') {
+                    ctx->pos++;
+                    int start = ctx->pos;
+                    while (s[ctx->pos] && s[ctx->pos] != '"') {
+                        if (s[ctx->pos] == '\\' && s[ctx->pos + 1])
+                            ctx->pos += 2;
+                        else
+                            ctx->pos++;
+                    }
+                    ret.type = TYPE_STRING;
+                    ret.data.str = (char *)intern_literal(s + start, ctx->pos - start);
+                    if (s[ctx->pos] == '"') ctx->pos++;
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Random number (apostrophe)
+                 * '          -> random double in [0, 0.999999]
+                 * 'expr      -> set RNG seed to (int)expr, then return 0
+                 * ---------------------------------------------------------------- */
+                if (c == '\'') {
+                    ctx->pos++;
+
+                    skip_whitespace(ctx);
+                    if (isdigit((unsigned char)s[ctx->pos]) ||
+                        IS_VARNAME(s[ctx->pos]) ||
+                        s[ctx->pos] == '(') {
+                        /* Parse seed value */
+                        if (!hl && eval_leaf(ctx, &ret)) {
+                            ret = eval_unary(EV_SEED, ret);
+                            continue;
+                        }
+                        eval_push(EV_SEED, ctx);
+                        act = EVAL_PRIMARY;
+                    } else {
+                        /* Generate random in [0, 0.999999] */
+                        ret.data.num = (double)rand() / ((double)RAND_MAX + 1.0);
+                    }
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Keyboard buffer read (colon in expression context)
+                 * Returns ASCII code of key in buffer, or 0 if buffer is empty.
+                 * Non-blocking (uses PDCurses nodelay).
+                 * ---------------------------------------------------------------- */
+                if (c == ':') {
+                    ctx->pos++;
+                    int key, live = !rec_replay_key(&key);
+                    if (live) {
+                        nodelay(stdscr, TRUE);
+                        key = wgetch(stdscr);
+                        nodelay(stdscr, FALSE);
+                    }
+                    rec_key(key);
+                    if (key == KEY_MOUSE && !live) {
+                        /* tmx() and friends replay the mouse state */
+                    } else if (key == KEY_MOUSE) {
+                        mmask_t bstate = getmouse();
+                        request_mouse_pos();
+                        g_tmouse_x = Mouse_status.x;
+                        g_tmouse_y = Mouse_status.y;
+                        if (bstate & BUTTON1_PRESSED) { g_tmouse_click = 1; g_tmouse_drag |= 1; }
+                        if (bstate & BUTTON2_PRESSED) { g_tmouse_click = 2; g_tmouse_drag |= 2; }
+                        if (bstate & BUTTON3_PRESSED) { g_tmouse_click = 3; g_tmouse_drag |= 4; }
+                        if (bstate & BUTTON1_RELEASED) g_tmouse_drag &= ~1;
+                        if (bstate & BUTTON2_RELEASED) g_tmouse_drag &= ~2;
+                        if (bstate & BUTTON3_RELEASED) g_tmouse_drag &= ~4;
+                    } else {
+                        ret.data.num = (key == ERR) ? 0.0 : (double)key;
+                    }
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Input variable (question mark inside expression)
+                 * ---------------------------------------------------------------- */
+                if (c == '?') {
+                    ctx->pos++;
+                    ret = read_input_value();
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Line number variable (#)
+                 * ---------------------------------------------------------------- */
+                if (c == '#') {
+                    ctx->pos++;
+                    ret.data.num = (double)ctx->line_num;
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Array access (@index, or @[h]index for array h)
+                 * ---------------------------------------------------------------- */
+                if (c == '@') {
+                    ctx->pos++;
+                    if (s[ctx->pos] == '[') {
+                        /* The handle is evaluated first, see EV_AREAD */
+                        ctx->pos++;
+                        eval_push(EV_AREAD, ctx)->state = 1;
+                        act = EVAL_CHAIN;
+                        continue;
+                    }
+                    if (!hl && eval_leaf(ctx, &ret)) {
+                        ret = eval_unary(EV_AREAD, ret);
+                        continue;
+                    }
+                    eval_push(EV_AREAD, ctx);
+                    act = EVAL_INDEX;
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Lowercase letter sequence -> screen, string or math function call
+                 * Screen functions (gotoxy, putch, getch, setfore, setback, setattr,
+                 *   getw, geth, clear) and string functions (len, mid, find, ...)
+                 *   receive Value arguments to allow strings.
+                 * All other lowercase sequences are dispatched to call_math_function.
+                 * e.g.  sin(A)  sqrt(B)  atan2(Y,X)  gotoxy(10,5)  mid(S,2,3)
+                 * ---------------------------------------------------------------- */
+                if (islower((unsigned char)c)) {
+                    char func_name[64];
+                    int fi = 0;
+                    /* Consume lowercase letters AND digits so log10, log2, atan2 all work */
+                    while ((islower((unsigned char)s[ctx->pos]) ||
+                            isdigit((unsigned char)s[ctx->pos])) && fi < 63) {
+                        func_name[fi++] = s[ctx->pos++];
+                    }
+                    func_name[fi] = '\0';
+
+                    skip_whitespace(ctx);
+
+                    /* Followed by '(' -> function call with arguments */
+                    if (s[ctx->pos] == '(') {
+                        ctx->pos++;  /* skip '(' */
+                        f = eval_push(EV_CALL, ctx);
+                        memcpy(f->name, func_name, fi + 1);
+                        f->fn = builtin_family(func_name);
+                        f->nargs = 0;
+                        act = EVAL_ARG;
+                    } else if (builtin_family(func_name) != FN_MATH) {
+                        /* Zero-arg call (e.g. pi, e, getw, geth, getch, clear) */
+                        ret = call_value_function(builtin_family(func_name), func_name, NULL, 0);
+                    } else {
+                        double dummy_args[1];
+                        ret = call_math_function(func_name, dummy_args, 0);
+                    }
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Single-letter variable: A-Z or '_'
+                 * ---------------------------------------------------------------- */
+                if (IS_VARNAME(c)) {
+                    int var_idx = VARIDX(c);
+                    ctx->pos++;
+                    ret = get_variable(var_idx);
+                    continue;
+                }
+
+                /* ----------------------------------------------------------------
+                 * Numeric literal
+                 * ---------------------------------------------------------------- */
+                if (isdigit((unsigned char)c) || c == '.') {
+                    char *endptr;
+                    ret.data.num = strtod(s + ctx->pos, &endptr);
+                    ctx->pos = (int)(endptr - s);
+                    continue;
+                }
+
+                /* Unknown -> 0 */
+                continue;
+            }
+
+            /* ----------------------------------------------------------------
+             * Next statement of a parentheses block. We may have:
+             *   a) A block of ';'-separated statements (returns last assigned var)
+             *   b) A comma-separated list (collected by the function caller)
+             * Here we handle the block case; comma lists are handled by EVAL_ARG.
+             * Inside a paren block:
+             *   - Statements separated by ';' are executed in sequence
+             *   - The result is the value of the variable assigned on the last
+             *     statement (or the expression value if no assignment).
+             *
+             * Statement types:
+             *
+             * 1. VAR = expr   -> explicit assignment (always assigns)
+             * 2. VAR expr     -> implicit assignment (always assigns, e.g. B42)
+             * 3. VAR op expr  -> self-referential ONLY when followed by ';'
+             *                    (B+1; means B=B+1), plain value when last item
+             * 4. anything else -> plain expression, no assignment
+             *
+             * This logic applies to both uppercase A-Z and '_'.
+             * ---------------------------------------------------------------- */
+            case EVAL_STMT: {
+                f = &eval_stack[eval_depth - 1];
+                skip_whitespace(ctx);
+
+                /* End of block */
+                if (s[ctx->pos] == ')' || s[ctx->pos] == '\0') {
+                    ret = eval_block_end(ctx, f);
+                    eval_depth--;
+                    act = EVAL_RETURN;
+                    continue;
+                }
+
+                /* Free previous statement result */
+                free_value(&f->v);
+                f->state = BS_EXPR;
+                act = EVAL_CHAIN;
+
+                if (IS_VARNAME(s[ctx->pos])) {
+                    int var_idx = VARIDX(s[ctx->pos]);
+                    /* Peek at what follows the variable letter (skip spaces) */
+                    int peek = ctx->pos + 1;
+                    while (s[peek] == ' ' || s[peek] == '\t') peek++;
+                    char nc = s[peek];
+                    f->var = var_idx;
+
+                    /* Case 1: explicit '=' inside parens:
+                     *   (A=expr)   -> comparison: 1 if A==expr, 0 otherwise
+                     *   (A=expr;)  -> assignment: assigns expr to A            */
+                    if (nc == '=') {
+                        Value cur = get_variable(var_idx);
+                        f = &eval_stack[eval_depth - 1];
+                        f->cur = cur;
+                        f->state = BS_EQ;
+                        ctx->pos++;          /* consume VAR letter */
+                        skip_whitespace(ctx);
+                        ctx->pos++;          /* consume '=' */
+                    }
+                    /* Case 2: value-starter -> implicit assignment (e.g. A42) */
+                    else if (nc != '\0' && nc != ')' && nc != ';' && nc != ',' &&
+                         nc != '+' && nc != '*' && nc != '/' && nc != '%' &&
+                         nc != '^' && nc != '&' && nc != '|' && nc != '<' &&
+                         nc != '>' && nc != '!' &&
+                         (nc != '-' || isdigit((unsigned char)s[peek+1]) ||
+                          s[peek+1] == '(')) {
+                        f->state = BS_IMPLICIT;
+                        ctx->pos++;          /* consume VAR letter */
+                        skip_whitespace(ctx);
+                    }
+                    /* Case 3: binary operator follows -> self-referential */
+                    else if (nc == '+' || nc == '-' || nc == '*' || nc == '/' ||
+                         nc == '%' || nc == '^' || nc == '&' || nc == '|' ||
+                         nc == '<' || nc == '>') {
+                        f->state = BS_SELF;  /* chain starts at VAR */
+                    }
+                }
+                continue;
+            }
+
+            /* Operand of '@': a coordinate block or an index primary */
+            case EVAL_INDEX:
+                skip_whitespace(ctx);
+                act = EVAL_PRIMARY;
+                if (s[ctx->pos] == '(') {
+                    /* Coordinates that are all numbers or numeric variables,
+                       as in @(Y,X), need no block frame. No cache entry can
+                       start at such a leaf, so this holds in loops too. */
+                    int open = ctx->pos++;
+                    double c[3];
+                    int n = 0;
+                    while (n < 3 && eval_leaf(ctx, &ret)) {
+                        c[n++] = ret.data.num;
+                        skip_whitespace(ctx);
+                        if (s[ctx->pos] != ',') break;
+                        ctx->pos++;
+                    }
+                    if (n >= 2 && s[ctx->pos] == ')') {
+                        ctx->pos++;
+                        ret.type = TYPE_NUMBER;
+                        ret.data.num = array_offset(c, n);
+                        act = EVAL_RETURN;
+                        continue;
+                    }
+                    ctx->pos = open + 1;
+                    f = eval_push(EV_BLOCK, ctx);
+                    f->fn = 1;
+                    f->nargs = 0;
+                    act = EVAL_STMT;
+                }
+                continue;
+
+            /* Next argument of a function call, or the call itself */
+            case EVAL_ARG: {
+                f = &eval_stack[eval_depth - 1];
+                if (f->state == 0 && s[ctx->pos] != ')' && s[ctx->pos] != '\0') {
+                    skip_whitespace(ctx);
+                    if (s[ctx->pos] != ')' && s[ctx->pos] != '\0') {
+                        f->start = ctx->pos;
+                        act = EVAL_CHAIN;
+                        continue;
+                    }
+                }
+                if (s[ctx->pos] == ')') ctx->pos++;
+
+                if (f->fn != FN_MATH) {
+                    ret = call_value_function(f->fn, f->name, f->vargs, f->nargs);
+                    for (int i = 0; i < f->nargs; i++) free_value(&f->vargs[i]);
+                } else {
+                    ret = call_math_function(f->name, f->args, f->nargs);
+                }
+                eval_depth--;
+                act = EVAL_RETURN;
+                continue;
+            }
+            default:
+                break;
+        }
+
+        /* ----------------------------------------------------------------
+         * EVAL_RETURN: 'ret' is complete, give it to the frame on top
+         * ---------------------------------------------------------------- */
+        if (eval_depth == base)
+            return ret;
+
+        f = &eval_stack[eval_depth - 1];
+        ctx = f->ctx;
+        s = ctx->expr;
+
+        switch (f->kind) {
+            case EV_CACHED:
+                if (ctx->pos == f->h->end) hoist_store(f->h, &ret, f->side_effects);
+                eval_depth--;
+                break;
+
+            case EV_AREAD:
+                if (f->state == 1) {
+                    /* Handle read: f->var is the array, -1 if there is none */
+                    Array *a = array_handle(value_to_number(ret));
+                    free_value(&ret);
+                    f->var = a ? (int)(a - arrays) : -1;
+                    skip_whitespace(ctx);
+                    if (s[ctx->pos] == ']') ctx->pos++;
+                    f->state = 2;
+                    act = EVAL_INDEX;
+                    continue;
+                }
+                if (f->state == 2) {
+                    int index = array_index(value_to_number(ret));
+                    free_value(&ret);
+                    if (f->var >= 0) {
+                        ret = array_load(&arrays[f->var], index);
+                    } else {
+                        ret.type = TYPE_NUMBER;
+                        ret.data.num = 0.0;
+                    }
+                    eval_depth--;
+                    break;
+                }
+                /* fall through */
+            case EV_NEG:
+            case EV_NOT:
+            case EV_SEED:
+                ret = eval_unary(f->kind, ret);
+                eval_depth--;
+                break;
+
+            case EV_CHAIN:
+                if (f->state == 0) {
+                    f->v = ret;
+                    f->state = 1;
+                } else {
+                    f->v = apply_operator(f->op, f->v, ret);
+                    if (f->hl) {
+                        for (int i = 0; i < f->hl->n; i++) {
+                            HoistEntry *h = &f->hl->e[i];
+                            if (h->kind == HOIST_CHAIN && h->start == f->start &&
+                                h->end == ctx->pos && !hoist_valid(h))
+                                hoist_store(h, &f->v, f->side_effects);
+                        }
+                    }
+                }
+                /* Operands that need no frame are applied on the spot */
+                for (;;) {
+                    Value right;
+                    skip_whitespace(ctx);
+                    if (!is_chain_operator(s[ctx->pos])) break;
+                    f->op = s[ctx->pos++];
+                    if (!f->hl && eval_leaf(ctx, &right)) {
+                        f->v = apply_operator(f->op, f->v, right);
+                        continue;
+                    }
+                    act = EVAL_PRIMARY;
+                    break;
+                }
+                if (act == EVAL_PRIMARY) continue;
+                /* End of expression */
+                ret = f->v;
+                eval_depth--;
+                break;
+
+            case EV_BLOCK:
+                switch (f->state) {
+                    case BS_EQ:
+                        skip_whitespace(ctx);
+                        if (s[ctx->pos] == ';') {
+                            /* Semicolon present: treat as assignment */
+                            free_value(&f->cur);
+                            set_variable(f->var, ret);
+                            free_value(&ret);
+                            f->v = copy_value(variables[f->var]);
+                        } else {
+                            /* No semicolon: treat as equality comparison */
+                            double eq;
+                            if (f->cur.type == TYPE_STRING && ret.type == TYPE_STRING) {
+                                const char *a = f->cur.data.str, *b = ret.data.str;
+                                if (a == b)
+                                    eq = 1.0;
+                                else if (is_interned(a) && is_interned(b))
+                                    eq = 0.0;   /* distinct interned copies differ */
+                                else
+                                    eq = strcmp(a, b) == 0 ? 1.0 : 0.0;
+                            }
+                            else
+                                eq = value_to_number(f->cur) == value_to_number(ret) ? 1.0 : 0.0;
+                            free_value(&f->cur);
+                            free_value(&ret);
+                            f->v.type = TYPE_NUMBER;
+                            f->v.data.num = eq;
+                        }
+                        break;
+
+                    case BS_IMPLICIT:
+                        set_variable(f->var, ret);
+                        free_value(&ret);
+                        f->v = copy_value(variables[f->var]);
+                        break;
+
+                    case BS_SELF:
+                        skip_whitespace(ctx);
+                        /* Only assign if ';' follows (not last item) */
+                        if (s[ctx->pos] == ';') {
+                            set_variable(f->var, ret);
+                            free_value(&ret);
+                            f->v = copy_value(variables[f->var]);
+                        } else {
+                            f->v = ret;
+                        }
+                        break;
+
+                    default:
+                        f->v = ret;
+                        break;
+                }
+
+                skip_whitespace(ctx);
+
+                /* Consume statement separator: ';' or ',' both continue the block,
+                   but in @(i,j) a ',' also ends a coordinate */
+                if (s[ctx->pos] == ';' || s[ctx->pos] == ',') {
+                    if (f->fn && s[ctx->pos] == ',' && f->nargs < MAX_FUNC_ARGS - 1)
+                        f->args[f->nargs++] = value_to_number(f->v);
+                    ctx->pos++;
+                    act = EVAL_STMT;
+                    continue;
+                }
+                /* Any other character (including ')') ends the block */
+                ret = eval_block_end(ctx, f);
+                eval_depth--;
+                break;
+
+            case EV_CALL:
+                if (f->fn == FN_MATH) {
+                    /* Math functions: collect arguments as doubles */
+                    if (f->nargs < MAX_FUNC_ARGS)
+                        f->args[f->nargs++] = value_to_number(ret);
+                    free_value(&ret);
+                } else if (f->nargs < MAX_FUNC_ARGS) {
+                    /* Screen and string functions: collect arguments as Value */
+                    f->vargs[f->nargs++] = ret;
+                } else {
+                    free_value(&ret);
+                }
+                skip_whitespace(ctx);
+                if (s[ctx->pos] == ',') ctx->pos++;
+                else if (ctx->pos == f->start) f->state = 1;  /* stray character, e.g. ';' */
+                act = EVAL_ARG;
+                continue;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Parse primary expression                                            */
+/* ------------------------------------------------------------------ */
+Value parse_primary(ParseContext *ctx) {
+    return eval_run(ctx, EVAL_PRIMARY);
+}
+
+/* Operand of '@': (i,j[,k]) gives the element index of the coordinates */
+Value parse_index(ParseContext *ctx) {
+    return eval_run(ctx, EVAL_INDEX);
+}
+
+/* ------------------------------------------------------------------ */
+/* Evaluate expression (left-to-right with binary operators)          */
+/* ------------------------------------------------------------------ */
+Value evaluate_expression(ParseContext *ctx) {
+    return eval_run(ctx, EVAL_CHAIN);
+}
+
+/* ------------------------------------------------------------------ */
+/* :time and :bench                                                     */
+/*                                                                      */
+/* The target is a line range "N" or "N-M" of the program, or a         */
+/* statement that is appended as temporary lines and removed after the */
+/* runs. Either way only the target's lines run: a jump out of them    */
+/* ends the run. Assignments are not echoed while timing.              */
+/* ------------------------------------------------------------------ */
+#define BENCH_MAX 1000000
+
+/* First and last line of the target; 2 if it was appended */
+static int time_target(const char *arg, int *first, int *last) {
+    char *end;
+    while (*arg == ' ') arg++;
+    long a = strtol(arg, &end, 10), b = a;
+    if (end != arg && *end == '-') b = strtol(end + 1, &end, 10);
+    while (*end == ' ') end++;
+    if (end != arg && !*end) {
+        if (a < 1 || b < a || b > line_count) {
+            printw("No lines %ld-%ld (program has %d lines)\n", a, b, line_count);
+            refresh();
+            return 0;
+        }
+        *first = (int)a;
+        *last = (int)b;
+        return 1;
+    }
+    if (!*arg) {
+        printw("Usage: :time N[-M] | :time STATEMENT | :bench RUNS N[-M] | :bench RUNS STATEMENT\n");
+        refresh();
+        return 0;
+    }
+    *first = line_count + 1;
+    add_repl_line(arg);
+    *last = line_count;
+    return 2;
+}
+
+/* Remove lines appended by time_target() */
+static void time_target_drop(int first) {
+    while (line_count >= first)
+        free(source_lines[--line_count]);
+}
+
+/* Run lines first..last once; gives the milliseconds taken. Each run
+   enters its loops afresh, so values cached for them are recomputed. */
+static double time_lines(int first, int last) {
+    LARGE_INTEGER t0, t1;
+    int prev_line = 0;
+    QueryPerformanceCounter(&t0);
+    for (current_line = first; current_line >= first && current_line <= last; current_line++) {
+        if (g_interrupted) break;
+        if (hoist_lines) hoist_enter_line(prev_line, current_line);
+        prev_line = current_line;
+        lines_executed++;
+        execute_line(current_line);
+    }
+    QueryPerformanceCounter(&t1);
+    return (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)g_timer_freq.QuadPart;
+}
+
+/* Blocks and bytes in use on the C runtime heap */
+static void heap_usage(long *blocks, long long *bytes) {
+    _HEAPINFO h;
+    h._pentry = NULL;
+    *blocks = 0;
+    *bytes = 0;
+    while (_heapwalk(&h) == _HEAPOK) {
+        if (h._useflag == _USEDENTRY) {
+            (*blocks)++;
+            *bytes += (long long)h._size;
+        }
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* ":time target" runs it once, ":bench RUNS target" RUNS times */
+static void time_command(const char *arg, int runs) {
+    int first, last, echo = show_assignments, line = current_line;
+    int kind = time_target(arg, &first, &last);
+    if (!kind) return;
+    show_assignments = 0;
+    unsigned long long lines = lines_executed;
+    if (runs == 0) {
+        long blocks0, blocks1;
+        long long bytes0, bytes1;
+        heap_usage(&blocks0, &bytes0);
+        double ms = time_lines(first, last);
+        heap_usage(&blocks1, &bytes1);
+        if (need_newline) { addch('\n'); need_newline = 0; }
+        printw("Time: %.3f ms, %.15g lines, heap %+ld blocks (%+.15g bytes)\n",
+               ms, (double)(lines_executed - lines), blocks1 - blocks0, (double)(bytes1 - bytes0));
+    } else {
+        int warm = runs / 10 > 0 ? runs / 10 : 1, n = 0;
+        double *ms = (double *)malloc(runs * sizeof(double));
+        for (int i = 0; i < warm && !g_interrupted; i++)
+            time_lines(first, last);
+        lines = lines_executed;
+        while (n < runs && !g_interrupted)
+            ms[n++] = time_lines(first, last);
+        if (need_newline) { addch('\n'); need_newline = 0; }
+        if (g_interrupted) {
+            printw("[Interrupted after %d runs]\n", n);
+        } else {
+            qsort(ms, n, sizeof(double), cmp_double);
+            int p95 = (int)ceil(n * 0.95) - 1;
+            printw("Bench: %d runs after %d warm-up: median %.3f ms, min %.3f ms, p95 %.3f ms, %.15g lines per run\n",
+                   n, warm, n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2.0, ms[0], ms[p95],
+                   (double)(lines_executed - lines) / n);
+        }
+        free(ms);
+    }
+    if (g_interrupted && runs == 0) printw("[Interrupted]\n");
+    g_interrupted = 0;
+    show_assignments = echo;
+    current_line = line;
+    if (kind == 2) time_target_drop(first);
+    refresh();
+}
+
+/* ------------------------------------------------------------------ */
+/* Execute a REPL command (the part after ':')                        */
+/* Returns 1 if the command was handled, 0 if unknown.                */
+/* ------------------------------------------------------------------ */
+int execute_repl_command(const char *cmd) {
+    if (strcmp(cmd, "help") == 0) {
+        print_repl_help();
+        return 1;
+    }
+    if (strcmp(cmd, "syntax") == 0) {
+        print_repl_syntax_help();
+        return 1;
+    }
+    if (strcmp(cmd, "screen") == 0) {
+        print_repl_screen_help();
+        return 1;
+    }
+    if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
+        printw("Arrivederci!\n");
+        refresh();
+        endwin();
+        cleanup_interpreter();
+        exit(0);
+    }
+    if (strcmp(cmd, "vars") == 0) {
+        int found = 0;
+        for (int i = 0; i < NUM_VARS; i++) {
+            if (variables[i].type != TYPE_UNDEFINED) {
+                printw("%c = ", (char)VARCHAR(i));
+                if (variables[i].type == TYPE_NUMBER)
+                    printw("%.15g\n", variables[i].data.num);
+                else
+                    printw("\"%s\"\n", variables[i].data.str);
+                found = 1;
+            }
+        }
+        if (!found) printw("No variables defined.\n");
+        refresh();
+        return 1;
+    }
+    if (strcmp(cmd, "array") == 0 || strncmp(cmd, "array ", 6) == 0) {
+        /* ":array h" shows array h, written @[h] */
+        int h = cmd[5] ? atoi(cmd + 6) : 0;
+        const Array *a = array_handle(h);
+        char num[16] = "", tag[16] = "@";
+        if (h > 0) {
+            snprintf(num, sizeof(num), " %d", h);
+            snprintf(tag, sizeof(tag), "@[%d]", h);
+        }
+        if (!a) {
+            /* array_handle() has warned */
+        } else if (a->size == 0) {
+            printw("Array%s is empty.\n", num);
+        } else {
+            if (a->base)
+                printw("Array%s (view of @[%d] from %d step %d, size: %d):\n", num,
+                       (int)(a->base - arrays), a->off, a->stride, a->size);
+            else
+                printw("Array%s (size: %d):\n", num, a->size);
+            for (int i = 0; i < a->size && i < 20; i++) {
+                double x;
+                const char *str = array_peek(a, i, &x);
+                if (str)
+                    printw("  %s%d = \"%s\"\n", tag, i, str);
+                else
+                    printw("  %s%d = %.15g\n", tag, i, x);
+            }
+            if (a->size > 20)
+                printw("  ... (%d elements total)\n", a->size);
+        }
+        refresh();
+        return 1;
+    }
+    if (strcmp(cmd, "lines") == 0) {
+        if (line_count == 0) {
+            printw("No lines in program.\n");
+        } else {
+            printw("Program (%d lines):\n", line_count);
+            for (int i = 0; i < line_count && i < 50; i++)
+                printw("  %3d: %s\n", i + 1, source_lines[i]);
+            if (line_count > 50)
+                printw("  ... (%d lines total)\n", line_count);
+        }
+        refresh();
+        return 1;
+    }
+    if (strcmp(cmd, "clear") == 0) {
+        for (int i = 0; i < NUM_VARS; i++)
+            free_value(&variables[i]);
+        table_free();
+        heap_free();
+        deque_free();
+        bitset_free();
+        array_free();
+        printw("All variables and array cleared.\n");
+        refresh();
+        return 1;
+    }
+    if (strcmp(cmd, "reset") == 0) {
+        for (int i = 0; i < NUM_VARS; i++)
+            free_value(&variables[i]);
+        table_free();
+        heap_free();
+        deque_free();
+        bitset_free();
+        array_free();
+        if (source_lines) {
+            for (int i = 0; i < line_count; i++)
+                free(source_lines[i]);
+            free(source_lines);
+            source_lines = NULL;
+        }
+        line_count = 0;
+        hoist_free();
+        printw("REPL completely reset.\n");
+        refresh();
+        return 1;
+    }
+    if (strncmp(cmd, "load", 4) == 0 && (cmd[4] == ' ' || !cmd[4])) {
+        char file[MAX_PATH];
+        if (ext_file_arg(cmd + 4, file, sizeof(file))) {
+            ext_load(file, 1);
+        } else {
+            printw("Usage: :load FILE (an ITL extension DLL)\n");
+            refresh();
+        }
+        return 1;
+    }
+    if (strncmp(cmd, "disasm", 6) == 0 && (cmd[6] == ' ' || !cmd[6])) {
+        repl_disasm(cmd + 6, 0);
+        return 1;
+    }
+    if (strncmp(cmd, "explain", 7) == 0 && (cmd[7] == ' ' || !cmd[7])) {
+        repl_disasm(cmd + 7, 1);
+        return 1;
+    }
+    if (strcmp(cmd, "time") == 0 || strncmp(cmd, "time ", 5) == 0) {
+        time_command(cmd + 4, 0);
+        return 1;
+    }
+    if (strcmp(cmd, "bench") == 0 || strncmp(cmd, "bench ", 6) == 0) {
+        char *end;
+        long runs = strtol(cmd + 5, &end, 10);
+        if (end == cmd + 5 || *end != ' ' || runs < 1 || runs > BENCH_MAX) {
+            printw("Usage: :bench RUNS N[-M] | :bench RUNS STATEMENT (RUNS 1-%d)\n", BENCH_MAX);
+            refresh();
+        } else {
+            time_command(end, (int)runs);
+        }
+        return 1;
+    }
+    if (strncmp(cmd, "debug ", 6) == 0) {
+        char var_name = cmd[6];
+        if ((var_name >= 'A' && var_name <= 'Z') || var_name == '_') {
+            int idx = (var_name == '_') ? 26 : (var_name - 'A');
+            if (variables[idx].type == TYPE_STRING) {
+                printw("Variable %c (string):\n", var_name);
+                printw("  Content: \"");
+                for (int i = 0; variables[idx].data.str[i]; i++)
+                    printw("%c", variables[idx].data.str[i]);
+                printw("\"\n  Bytes (hex): ");
+                for (int i = 0; variables[idx].data.str[i]; i++)
+                    printw("%02X ", (unsigned char)variables[idx].data.str[i]);
+                printw("\n  Bytes (dec): ");
+                for (int i = 0; variables[idx].data.str[i]; i++)
+                    printw("%d ", (unsigned char)variables[idx].data.str[i]);
+                printw("\n");
+            } else if (variables[idx].type == TYPE_NUMBER) {
+                printw("Variable %c = %.15g (number)\n", var_name, variables[idx].data.num);
+            } else {
+                printw("Variable %c is undefined\n", var_name);
+            }
+            refresh();
+        } else {
+            printw("Usage: :debug VARIABLE (e.g. :debug A or :debug _)\n");
+            refresh();
+        }
+        return 1;
+    }
+
+    return 0;  /* unknown command */
+}
+
+/* Does the parenthesized group at s end just before an '@', as in (i,j)@=v? */
+static int coords_then_at(const char *s) {
+    int depth = 0;
+    for (; *s; s++) {
+        if (*s == '"') {
+            while (s[1] && s[1] != '"') s += (s[1] == '\\' && s[2]) ? 2 : 1;
+            if (s[1]) s++;
+        } else if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            do s++; while (*s == ' ' || *s == '\t');
+            return *s == '@';
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Execute a single program line                                       */
+/* ------------------------------------------------------------------ */
+void execute_line(int line_num) {
+    if (line_num < 1 || line_num > line_count) return;
+
+    current_line = line_num;
+    const char *line = source_lines[line_num - 1];
+
+    ParseContext ctx;
+    ctx.expr = line;
+    ctx.pos = 0;
+    ctx.line_num = line_num;
+
+    skip_whitespace(&ctx);
+
+    /* Empty line */
+    if (ctx.expr[ctx.pos] == '\0') return;
+
+    /* -----------------------------------------------------------
+     * REPL command (:command) - works both in REPL and in programs
+     * ----------------------------------------------------------- */
+    if (ctx.expr[ctx.pos] == ':') {
+        ctx.pos++;
+        char cmd_buf[256];
+        int ci = 0;
+        while (ctx.expr[ctx.pos] != '\0' && ci < 255)
+            cmd_buf[ci++] = ctx.expr[ctx.pos++];
+        cmd_buf[ci] = '\0';
+
+        if (!execute_repl_command(cmd_buf))
+            printw("Unknown command: :%s\n", cmd_buf);
+        refresh();
+        return;
+    }
+
+    /* -----------------------------------------------------------
+     * Print statement: starts with '?'
+     * ----------------------------------------------------------- */
+    if (ctx.expr[ctx.pos] == '?') {
+        ctx.pos++;
+        while (ctx.expr[ctx.pos] == ' ' || ctx.expr[ctx.pos] == '\t') ctx.pos++;
+        if (ctx.expr[ctx.pos] == '=') ctx.pos++;
+        Value result = evaluate_expression(&ctx);
+        apply_attrs();
+        if (result.type == TYPE_NUMBER) {
+            printw("%.15g", result.data.num);
+            refresh();
+            need_newline = 1;
+        } else if (result.type == TYPE_STRING) {
+            print_escaped_string(result.data.str);
+            const char *s = result.data.str;
+            int slen = strlen(s);
+            if (slen == 0)
+                ; /* no output, keep flag as-is */
+            else if (s[slen - 1] == '\n')
+                need_newline = 0;
+            else if (slen >= 2 && s[slen - 2] == '\\' && s[slen - 1] == 'n')
+                need_newline = 0;
+            else
+                need_newline = 1;
+        }
+
+        free_value(&result);
+        return;
+    }
+
+    /* -----------------------------------------------------------
+     * Array assignment: index@ = value  or  index@[h] = value,
+     * where index may be (i,j) or (i,j,k) coordinates
+     * ----------------------------------------------------------- */
+    if (isdigit((unsigned char)ctx.expr[ctx.pos]) || IS_VARNAME(ctx.expr[ctx.pos]) ||
+        (ctx.expr[ctx.pos] == '(' && coords_then_at(ctx.expr + ctx.pos))) {
+        int start_pos = ctx.pos;
+        Value index_val = parse_index(&ctx);
+
+        skip_whitespace(&ctx);
+
+        if (ctx.expr[ctx.pos] == '@') {
+            ctx.pos++;
+            int index = array_index(value_to_number(index_val));
+            free_value(&index_val);
+
+            int h = 0;
+            Array *a = &arrays[0];
+            if (ctx.expr[ctx.pos] == '[') {
+                ctx.pos++;
+                Value hv = evaluate_expression(&ctx);
+                double d = value_to_number(hv);
+                free_value(&hv);
+                skip_whitespace(&ctx);
+                if (ctx.expr[ctx.pos] == ']') ctx.pos++;
+                a = array_handle(d);
+                if (a) h = (int)d;
+            }
+
+            skip_whitespace(&ctx);
+            if (ctx.expr[ctx.pos] == '=') ctx.pos++;
+
+            Value val = evaluate_expression(&ctx);
+            if (!a || index < 0) {   /* bad handle or coordinates: the value is still evaluated */
+                free_value(&val);
+                return;
+            }
+            array_ensure(a, index + 1);
+            array_store(a, index, val);
+
+            if (repl_mode && show_assignments) {
+                char tag[16] = "@";
+                if (h > 0) snprintf(tag, sizeof(tag), "@[%d]", h);
+                if (val.type == TYPE_STRING)
+                    printw("< %s%d = \"%s\"\n", tag, index, val.data.str);
+                else
+                    printw("< %s%d = %.15g\n", tag, index, value_to_number(val));
+            }
+
+            free_value(&val);
+            return;
+        }
+
+        /* Not an array assignment - reset and fall through */
+        ctx.pos = start_pos;
+        free_value(&index_val);
+    }
+
+    /* -----------------------------------------------------------
+     * Variable assignment: VAR = expr  (VAR is A-Z or '_')
+     * ----------------------------------------------------------- */
+    if (IS_VARNAME(ctx.expr[ctx.pos])) {
+        int var_idx = VARIDX(ctx.expr[ctx.pos]);
+        int var_pos = ctx.pos;
+        ctx.pos++;
+
+        skip_whitespace(&ctx);
+
+        /* Bare variable name -> make it undefined */
+        if (ctx.expr[ctx.pos] == '\0') {
+            free_value(&variables[var_idx]);
+            if (repl_mode && show_assignments)
+                printw("< %c = undefined\n", (char)VARCHAR(var_idx));
+            refresh();
+            return;
+        }
+
+        /* Explicit '=' -> normal assignment */
+        if (ctx.expr[ctx.pos] == '=') {
+            ctx.pos++;
+            Value val = evaluate_expression(&ctx);
+            set_variable(var_idx, val);
+            free_value(&val);
+            return;
+        }
+
+        /* Self-referential shorthand: VAR op expr  means  VAR = VAR op expr
+         * Detected when the next character is a binary operator but NOT '='.
+         * The chain is evaluated in place from the variable on, so the
+         * variable is its first operand and the rest is parsed only once.
+         * Examples: A+1  ->  A=A+1
+         *           A*(2+B)  ->  A=A*(2+B)                               */
+        if (ctx.expr[ctx.pos] == '+' || ctx.expr[ctx.pos] == '-' ||
+            ctx.expr[ctx.pos] == '*' || ctx.expr[ctx.pos] == '/' ||
+            ctx.expr[ctx.pos] == '%' || ctx.expr[ctx.pos] == '^' ||
+            ctx.expr[ctx.pos] == '&' || ctx.expr[ctx.pos] == '|' ||
+            ctx.expr[ctx.pos] == '<' || ctx.expr[ctx.pos] == '>') {
+            ctx.pos = var_pos;
+            Value val = evaluate_expression(&ctx);
+            set_variable(var_idx, val);
+            free_value(&val);
+            return;
+        }
+
+        /* Implicit assignment: VAR expr  means  VAR = expr  (e.g. A42) */
+        Value val = evaluate_expression(&ctx);
+        set_variable(var_idx, val);
+        free_value(&val);
+        return;
+    }
+
+    /* -----------------------------------------------------------
+     * Line jump: #=expr
+     * ----------------------------------------------------------- */
+    if (ctx.expr[ctx.pos] == '#') {
+        ctx.pos++;
+        skip_whitespace(&ctx);
+        if (ctx.expr[ctx.pos] == '=') ctx.pos++;
+
+        Value val = evaluate_expression(&ctx);
+        int new_line = (int)value_to_number(val);
+        free_value(&val);
+
+        if (new_line > 0 && new_line <= line_count) {
+            current_line = new_line - 1; /* will be incremented by caller */
+        }
+        return;
+    }
+
+    /* -----------------------------------------------------------
+     * Bare expression (for side effects)
+     * ----------------------------------------------------------- */
+    Value val = evaluate_expression(&ctx);
+    free_value(&val);
+}
+
+/* ------------------------------------------------------------------ */
+/* Execute program from a given line                                   */
+/* ------------------------------------------------------------------ */
+void execute_from_line(int start_line) {
+    int prev_line = 0;
+    for (current_line = start_line; current_line <= line_count; current_line++) {
+        if (g_interrupted) {
+            g_interrupted = 0;
+            printw("\n[Interrupted]\n");
+            refresh();
+            break;
+        }
+        if (hoist_lines) hoist_enter_line(prev_line, current_line);
+        prev_line = current_line;
+        lines_executed++;
+        execute_line(current_line);
+    }
+}
+
+/* Execute the entire program */
+void execute_program(void) {
+    execute_from_line(1);
+}
+
+/* ================================================================== */
+/* Program analysis: control-flow graph recovery and SSA IR            */
+/*                                                                      */
+/* The middle-end parses every line into a small syntax tree that      */
+/* mirrors execute_line() and parse_primary() exactly, resolves '#='   */
+/* targets with a value-set abstract interpretation, groups lines into */
+/* basic blocks and natural loops, and lowers the program into SSA     */
+/* form over the 27 variables plus the '@' array (one memory variable).*/
+/* Jumps whose target cannot be bounded get conservative edges through */
+/* a single dispatch block that reaches every line.                    */
+/* ================================================================== */
+
+#define AN_MEM         NUM_VARS          /* pseudo-variable index of '@'   */
+#define AN_NVARS       (NUM_VARS + 1)
+#define AN_ALL_VARS    ((1u << AN_NVARS) - 1)
+#define AN_MAX_INS     4000000           /* IR size budget                 */
+#define AN_DYN_MAX     10000             /* max lines with dynamic jumps   */
+#define AN_MAX_DEPTH   512               /* max nesting of primaries; the
+                                            parser takes under 1 KB of C
+                                            stack per level               */
+
+/* Side-effect classes of builtin functions */
+#define FX_PURE        0
+#define FX_IO          1   /* output, input, hidden state or warning text  */
+#define FX_ARRAY_READ  2
+#define FX_ARRAY_WRITE 4
+
+static char an_var_char(int v) {
+    return (v == AN_MEM) ? '@' : (char)VARCHAR(v);
+}
+
+/* ------------------------------------------------------------------ */
+/* Arena and integer vectors                                            */
+/* ------------------------------------------------------------------ */
+typedef struct AnChunk {
+    struct AnChunk *next;
+    size_t used, size;
+    double align;
+} AnChunk;
+
+static AnChunk *an_chunks = NULL;
+
+static void *an_alloc(size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (!an_chunks || an_chunks->used + n > an_chunks->size) {
+        size_t size = n > 65536 ? n : 65536;
+        AnChunk *c = (AnChunk *)malloc(sizeof(AnChunk) + size);
+        c->next = an_chunks;
+        c->used = 0;
+        c->size = size;
+        an_chunks = c;
+    }
+    void *p = (char *)(an_chunks + 1) + an_chunks->used;
+    an_chunks->used += n;
+    memset(p, 0, n);
+    return p;
+}
+
+static void an_arena_free(void) {
+    while (an_chunks) {
+        AnChunk *next = an_chunks->next;
+        free(an_chunks);
+        an_chunks = next;
+    }
+}
+
+typedef struct {
+    int *v;
+    int n, cap;
+} IntVec;
+
+static void iv_push(IntVec *iv, int x) {
+    if (iv->n == iv->cap) {
+        iv->cap = iv->cap ? iv->cap * 2 : 4;
+        iv->v = (int *)realloc(iv->v, iv->cap * sizeof(int));
+    }
+    iv->v[iv->n++] = x;
+}
+
+static int iv_has(const IntVec *iv, int x) {
+    for (int i = 0; i < iv->n; i++)
+        if (iv->v[i] == x) return 1;
+    return 0;
+}
+
+static void iv_free(IntVec *iv) {
+    free(iv->v);
+    iv->v = NULL;
+    iv->n = iv->cap = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Syntax tree of one line                                              */
+/* ------------------------------------------------------------------ */
+typedef enum {
+    AN_EMPTY, AN_NUM, AN_STR, AN_VAR, AN_LINENO, AN_NEG, AN_NOT, AN_CONV,
+    AN_BLOCK, AN_RAND, AN_SEED, AN_KEY, AN_INPUT, AN_AREAD, AN_CALL,
+    AN_BINOP, AN_CMPEQ, AN_SET, AN_UNSET, AN_ASTORE, AN_PRINT, AN_JUMP,
+    AN_CMD, AN_EXPR
+} AnKind;
+
+#define AN_F_PROBE  1   /* statement reads its variable before assigning */
+#define AN_F_PARENS 2   /* function call written with an argument list  */
+#define AN_F_COORDS 4   /* '@' index is an (i,j[,k]) coordinate block    */
+
+typedef struct AnNode AnNode;
+struct AnNode {
+    unsigned char kind, flags;
+    char op;              /* binary operator or assignment form e/i/s  */
+    signed char var;      /* variable index, -1 if none                */
+    int start, end;       /* source span [start, end) within the line   */
+    double num;
+    const char *text;     /* function name, string literal or command   */
+    int nkids, capkids;
+    AnNode **kids;
+};
+
+typedef struct {
+    const char *s;
+    int pos;
+    int depth;            /* primaries being parsed                     */
+} AnParser;
+
+static int an_too_deep;   /* a line exceeded AN_MAX_DEPTH               */
+
+static AnNode *an_parse_primary(AnParser *p);
+static AnNode *an_parse_chain(AnParser *p);
+
+static void an_skip_ws(AnParser *p) {
+    while (p->s[p->pos] == ' ' || p->s[p->pos] == '\t') p->pos++;
+}
+
+static AnNode *an_node(int kind, int start) {
+    AnNode *n = (AnNode *)an_alloc(sizeof(AnNode));
+    n->kind = (unsigned char)kind;
+    n->var = -1;
+    n->start = n->end = start;
+    return n;
+}
+
+static void an_add_kid(AnNode *n, AnNode *kid) {
+    if (n->nkids == n->capkids) {
+        int cap = n->capkids ? n->capkids * 2 : 2;
+        AnNode **k = (AnNode **)an_alloc(cap * sizeof(AnNode *));
+        if (n->nkids) memcpy(k, n->kids, n->nkids * sizeof(AnNode *));
+        n->kids = k;
+        n->capkids = cap;
+    }
+    n->kids[n->nkids++] = kid;
+}
+
+static const char *an_strndup(const char *s, int len) {
+    char *d = (char *)an_alloc(len + 1);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
+}
+
+/* Binary operators accepted by evaluate_expression() */
+static int an_is_binop(char c) {
+    return c == '+' || c == '-' || c == '*' || c == '/' || c == '%' ||
+           c == '^' || c == '&' || c == '|' || c == '<' || c == '>' || c == '=';
+}
+
+/* Left-to-right operator chain continuing from an already parsed left operand */
+static AnNode *an_continue_chain(AnParser *p, AnNode *left) {
+    int start = left->start;
+    while (1) {
+        an_skip_ws(p);
+        char op = p->s[p->pos];
+        if (op == '\0' || op == ')' || op == ';' || op == ',' || !an_is_binop(op))
+            break;
+        p->pos++;
+        AnNode *right = an_parse_primary(p);
+        AnNode *n = an_node(AN_BINOP, start);
+        n->op = op;
+        an_add_kid(n, left);
+        an_add_kid(n, right);
+        n->end = p->pos;
+        left = n;
+    }
+    return left;
+}
+
+static AnNode *an_parse_chain(AnParser *p) {
+    return an_continue_chain(p, an_parse_primary(p));
+}
+
+/* Paren block: same statement cases as parse_primary() */
+static AnNode *an_parse_block(AnParser *p, int start) {
+    const char *s = p->s;
+    AnNode *blk = an_node(AN_BLOCK, start);
+    p->pos++;  /* skip '(' */
+
+    while (1) {
+        an_skip_ws(p);
+        if (s[p->pos] == ')' || s[p->pos] == '\0') break;
+
+        AnNode *item;
+        if (IS_VARNAME(s[p->pos])) {
+            int var = VARIDX(s[p->pos]);
+            int vpos = p->pos;
+            int peek = p->pos + 1;
+            while (s[peek] == ' ' || s[peek] == '\t') peek++;
+            char nc = s[peek];
+
+            if (nc == '=') {
+                /* Case 1: (A=expr;) assigns, (A=expr) compares */
+                p->pos++;
+                an_skip_ws(p);
+                p->pos++;
+                AnNode *rhs = an_parse_chain(p);
+                an_skip_ws(p);
+                item = an_node(s[p->pos] == ';' ? AN_SET : AN_CMPEQ, vpos);
+                item->var = (signed char)var;
+                item->op = 'e';
+                item->flags = AN_F_PROBE;
+                an_add_kid(item, rhs);
+                item->end = rhs->end;
+            } else if (nc != '\0' && nc != ')' && nc != ';' && nc != ',' &&
+                       nc != '+' && nc != '*' && nc != '/' && nc != '%' &&
+                       nc != '^' && nc != '&' && nc != '|' && nc != '<' &&
+                       nc != '>' && nc != '!' &&
+                       (nc != '-' || isdigit((unsigned char)s[peek + 1]) ||
+                        s[peek + 1] == '(')) {
+                /* Case 2: implicit assignment (A42) */
+                p->pos++;
+                an_skip_ws(p);
+                AnNode *rhs = an_parse_chain(p);
+                item = an_node(AN_SET, vpos);
+                item->var = (signed char)var;
+                item->op = 'i';
+                an_add_kid(item, rhs);
+                item->end = rhs->end;
+            } else if (nc == '+' || nc == '-' || nc == '*' || nc == '/' ||
+                       nc == '%' || nc == '^' || nc == '&' || nc == '|' ||
+                       nc == '<' || nc == '>') {
+                /* Case 3: self-referential, assigns only before ';' */
+                AnNode *left = an_node(AN_VAR, vpos);
+                left->var = (signed char)var;
+                p->pos++;
+                left->end = p->pos;
+                AnNode *chain = an_continue_chain(p, left);
+                an_skip_ws(p);
+                if (s[p->pos] == ';') {
+                    item = an_node(AN_SET, vpos);
+                    item->var = (signed char)var;
+                    item->op = 's';
+                    an_add_kid(item, chain);
+                    item->end = chain->end;
+                } else {
+                    item = chain;
+                }
+            } else {
+                item = an_parse_chain(p);
             }
+        } else {
+            item = an_parse_chain(p);
         }
-        return result;
-    }
+        an_add_kid(blk, item);
 
-    /* setattr(attr) -------------------------------------------------- */
-    /* 0=normal, 1=bold, 2=reverse                                       */
-    if (strcmp(name, "setattr") == 0) {
-        if (nargs >= 1) {
-            int attr = (int)value_to_number(args[0]);
-            switch (attr) {
-                case 1:  itl_attr = A_BOLD;    break;
-                case 2:  itl_attr = A_REVERSE; break;
-                default: itl_attr = A_NORMAL;  break;
-            }
-            apply_attrs();
-            result.data.num = (double)attr;
+        an_skip_ws(p);
+        if (s[p->pos] == ';' || s[p->pos] == ',') {
+            p->pos++;
+            continue;
         }
-        return result;
+        break;
     }
 
-    /* getw() --------------------------------------------------------- */
-    if (strcmp(name, "getw") == 0) {
-        int rows = 0, cols = 0;
-        getmaxyx(stdscr, rows, cols);
-        (void)rows;
-        result.data.num = (double)cols;
-        return result;
-    }
+    an_skip_ws(p);
+    if (s[p->pos] == ')') p->pos++;
+    blk->end = p->pos;
+    return blk;
+}
 
-    /* geth() --------------------------------------------------------- */
-    if (strcmp(name, "geth") == 0) {
-        int rows = 0, cols = 0;
-        getmaxyx(stdscr, rows, cols);
-        (void)cols;
-        result.data.num = (double)rows;
-        return result;
-    }
+/* Operand of '@', like parse_index(): a coordinate block or a primary */
+static AnNode *an_parse_index(AnParser *p, unsigned char *flags) {
+    an_skip_ws(p);
+    if (p->s[p->pos] != '(') return an_parse_primary(p);
+    *flags |= AN_F_COORDS;
+    return an_parse_block(p, p->pos);
+}
 
-    /* clear() -------------------------------------------------------- */
-    /* Fills screen with current background color and moves cursor to    */
-    /* the top-left corner.                                              */
-    if (strcmp(name, "clear") == 0) {
-        int pair = itl_bg * 8 + itl_fg + 1;
-        /* bkgd sets the default fill character + color for the window  */
-        bkgd((chtype)(COLOR_PAIR(pair) | ' '));
-        /* PDCurses clear() erases all cells and schedules full repaint  */
-        wclear(stdscr);
-        move(0, 0);
-        refresh();
-        result.data.num = 1.0;
-        return result;
+static AnNode *an_parse_primary_at(AnParser *p) {
+    const char *s = p->s;
+    AnNode *n;
+
+    an_skip_ws(p);
+    int start = p->pos;
+    char c = s[p->pos];
+    char d = c ? s[p->pos + 1] : '\0';
+
+    if (c == '-' && (isdigit((unsigned char)d) || IS_VARNAME(d) || d == '(' ||
+                     d == '@' || d == '?' || d == '\'' || d == '#' || d == '$')) {
+        p->pos++;
+        n = an_node(AN_NEG, start);
+        an_add_kid(n, an_parse_primary(p));
+        n->end = p->pos;
+        return n;
     }
 
-    /* tmx() ---------------------------------------------------------- */
-    if (strcmp(name, "tmx") == 0) {
-        result.data.num = (double)g_tmouse_x;
-        return result;
+    if (c == '!') {
+        p->pos++;
+        n = an_node(AN_NOT, start);
+        an_add_kid(n, an_parse_primary(p));
+        n->end = p->pos;
+        return n;
     }
 
-    /* tmy() ---------------------------------------------------------- */
-    if (strcmp(name, "tmy") == 0) {
-        result.data.num = (double)g_tmouse_y;
-        return result;
+    if (c == '$') {
+        p->pos++;
+        an_skip_ws(p);
+        if (IS_VARNAME(s[p->pos])) {
+            n = an_node(AN_CONV, start);
+            n->var = (signed char)VARIDX(s[p->pos]);
+            p->pos++;
+            n->end = p->pos;
+            return n;
+        }
+        /* Not followed by a variable: the rest is parsed as if '$' were absent */
+        start = p->pos;
+        c = s[p->pos];
     }
 
-    /* tmclick() ------------------------------------------------------ */
-    /* Ritorna il pulsante dell'ultimo click (1/2/3) e lo azzera       */
-    if (strcmp(name, "tmclick") == 0) {
-        result.data.num = (double)g_tmouse_click;
-        g_tmouse_click = 0;
-        return result;
+    if (c == '(')
+        return an_parse_block(p, start);
+
+    if (c == '"') {
+        p->pos++;
+        int lit = p->pos;
+        while (s[p->pos] && s[p->pos] != '"') {
+            if (s[p->pos] == '\\' && s[p->pos + 1]) p->pos += 2;
+            else p->pos++;
+        }
+        n = an_node(AN_STR, start);
+        n->text = an_strndup(s + lit, p->pos - lit);
+        if (s[p->pos] == '"') p->pos++;
+        n->end = p->pos;
+        return n;
     }
 
-    /* tmdrag(b) ------------------------------------------------------ */
-    /* Ritorna 1 se il pulsante b (1/2/3) è tenuto premuto             */
-    /* mentre il mouse si muove, 0 altrimenti                          */
-    if (strcmp(name, "tmdrag") == 0) {
-        int btn = (nargs >= 1) ? (int)value_to_number(args[0]) : 1;
-        int bit = (btn == 1) ? 1 : (btn == 2) ? 2 : 4;
-        result.data.num = (g_tmouse_drag & bit) ? 1.0 : 0.0;
-        return result;
+    if (c == '\'') {
+        p->pos++;
+        an_skip_ws(p);
+        if (isdigit((unsigned char)s[p->pos]) || IS_VARNAME(s[p->pos]) || s[p->pos] == '(') {
+            n = an_node(AN_SEED, start);
+            an_add_kid(n, an_parse_primary(p));
+        } else {
+            n = an_node(AN_RAND, start);
+        }
+        n->end = p->pos;
+        return n;
     }
 
-    /* gopen(w,h) ---------------------------------------------------- */
-    if (strcmp(name, "gopen") == 0) {
-        int w = (nargs >= 1) ? (int)value_to_number(args[0]) : 640;
-        int h = (nargs >= 2) ? (int)value_to_number(args[1]) : 480;
-        gfx_open(w, h);
-        result.data.num = 1.0;
-        return result;
+    if (c == ':' || c == '?' || c == '#') {
+        p->pos++;
+        n = an_node(c == ':' ? AN_KEY : c == '?' ? AN_INPUT : AN_LINENO, start);
+        n->end = p->pos;
+        return n;
     }
 
-    /* gclear() ------------------------------------------------------- */
-    if (strcmp(name, "gclear") == 0) {
-        if (g_hdc_buf) {
-            EnterCriticalSection(&g_gfx_cs);
-            RECT r = {0, 0, g_gfx_w, g_gfx_h};
-            HBRUSH b = CreateSolidBrush(g_brush_color);
-            FillRect(g_hdc_buf, &r, b);
-            DeleteObject(b);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
+    if (c == '@') {
+        p->pos++;
+        n = an_node(AN_AREAD, start);
+        if (s[p->pos] == '[') {   /* @[h]index: kids are the handle, then the index */
+            p->pos++;
+            an_add_kid(n, an_parse_chain(p));
+            an_skip_ws(p);
+            if (s[p->pos] == ']') p->pos++;
         }
-        return result;
+        an_add_kid(n, an_parse_index(p, &n->flags));
+        n->end = p->pos;
+        return n;
     }
 
-    /* gpen(r,g,b) ---------------------------------------------------- */
-    if (strcmp(name, "gpen") == 0) {
-        if (nargs >= 3) {
-            int r = (int)value_to_number(args[0]);
-            int g = (int)value_to_number(args[1]);
-            int b = (int)value_to_number(args[2]);
-            g_pen_color = RGB(r, g, b);
-            EnterCriticalSection(&g_gfx_cs);
-            HPEN new_pen = CreatePen(PS_SOLID, 1, g_pen_color);
-            SelectObject(g_hdc_buf, new_pen);
-            if (g_pen) DeleteObject(g_pen);
-            g_pen = new_pen;
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
+    if (islower((unsigned char)c)) {
+        int fi = 0;
+        int name_start = p->pos;
+        while ((islower((unsigned char)s[p->pos]) || isdigit((unsigned char)s[p->pos])) && fi < 63) {
+            p->pos++;
+            fi++;
         }
-        return result;
+        n = an_node(AN_CALL, start);
+        n->text = an_strndup(s + name_start, fi);
+        an_skip_ws(p);
+        if (s[p->pos] == '(') {
+            n->flags |= AN_F_PARENS;
+            p->pos++;
+            while (s[p->pos] != ')' && s[p->pos] != '\0') {
+                an_skip_ws(p);
+                if (s[p->pos] == ')' || s[p->pos] == '\0') break;
+                int before = p->pos;
+                an_add_kid(n, an_parse_chain(p));
+                an_skip_ws(p);
+                if (s[p->pos] == ',') p->pos++;
+                else if (p->pos == before) break;
+            }
+            if (s[p->pos] == ')') p->pos++;
+        }
+        n->end = p->pos;
+        return n;
     }
 
-    /* gbr(r,g,b) ----------------------------------------------------- */
-    if (strcmp(name, "gbr") == 0) {
-        if (nargs >= 3) {
-            int r = (int)value_to_number(args[0]);
-            int g = (int)value_to_number(args[1]);
-            int b = (int)value_to_number(args[2]);
-            g_brush_color = RGB(r, g, b);
-            EnterCriticalSection(&g_gfx_cs);
-            HBRUSH new_brush = CreateSolidBrush(g_brush_color);
-            SelectObject(g_hdc_buf, new_brush);
-            if (g_brush) DeleteObject(g_brush);
-            g_brush = new_brush;
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
-        }
-        return result;
+    if (IS_VARNAME(c)) {
+        n = an_node(AN_VAR, start);
+        n->var = (signed char)VARIDX(c);
+        p->pos++;
+        n->end = p->pos;
+        return n;
     }
 
-    /* gpixel(x,y) ---------------------------------------------------- */
-    if (strcmp(name, "gpixel") == 0) {
-        if (nargs >= 2 && g_hdc_buf) {
-            int x = (int)value_to_number(args[0]);
-            int y = (int)value_to_number(args[1]);
-            EnterCriticalSection(&g_gfx_cs);
-            SetPixel(g_hdc_buf, x, y, g_pen_color);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
-        }
-        return result;
+    n = an_node(AN_NUM, start);
+    if (isdigit((unsigned char)c) || c == '.') {
+        char *endptr;
+        n->num = strtod(s + p->pos, &endptr);
+        p->pos = (int)(endptr - s);
     }
+    n->end = p->pos;
+    return n;
+}
 
-    /* gline(x1,y1,x2,y2) -------------------------------------------- */
-    if (strcmp(name, "gline") == 0) {
-        if (nargs >= 4 && g_hdc_buf) {
-            int x1 = (int)value_to_number(args[0]);
-            int y1 = (int)value_to_number(args[1]);
-            int x2 = (int)value_to_number(args[2]);
-            int y2 = (int)value_to_number(args[3]);
-            EnterCriticalSection(&g_gfx_cs);
-            MoveToEx(g_hdc_buf, x1, y1, NULL);
-            LineTo(g_hdc_buf, x2, y2);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
-        }
-        return result;
+/* The analysis recurses; deeper nesting is not analysed at all */
+static AnNode *an_parse_primary(AnParser *p) {
+    AnNode *n;
+    if (p->depth >= AN_MAX_DEPTH) {
+        an_too_deep = 1;
+        n = an_node(AN_NUM, p->pos);
+        p->pos += (int)strlen(p->s + p->pos);
+        n->end = p->pos;
+        return n;
     }
+    p->depth++;
+    n = an_parse_primary_at(p);
+    p->depth--;
+    return n;
+}
 
-    /* grect(x1,y1,x2,y2) -------------------------------------------- */
-    /* Disegna solo il bordo (usa penna corrente, pennello trasparente)  */
-    if (strcmp(name, "grect") == 0) {
-        if (nargs >= 4 && g_hdc_buf) {
-            int x1 = (int)value_to_number(args[0]);
-            int y1 = (int)value_to_number(args[1]);
-            int x2 = (int)value_to_number(args[2]);
-            int y2 = (int)value_to_number(args[3]);
-            EnterCriticalSection(&g_gfx_cs);
-            HBRUSH old_brush = (HBRUSH)SelectObject(g_hdc_buf,
-                                   GetStockObject(NULL_BRUSH));
-            Rectangle(g_hdc_buf, x1, y1, x2, y2);
-            SelectObject(g_hdc_buf, old_brush);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
-        }
-        return result;
+/* One source line, following the statement dispatch of execute_line() */
+static AnNode *an_parse_line(const char *line) {
+    AnParser p;
+    AnNode *n;
+    p.s = line;
+    p.pos = 0;
+    p.depth = 0;
+    an_skip_ws(&p);
+    int start = p.pos;
+    char c = line[p.pos];
+
+    if (c == '\0')
+        return an_node(AN_EMPTY, start);
+
+    if (c == ':') {
+        n = an_node(AN_CMD, start);
+        n->text = an_strndup(line + p.pos + 1, (int)strlen(line + p.pos + 1));
+        n->end = (int)strlen(line);
+        return n;
     }
 
-    /* gfillrect(x1,y1,x2,y2) ---------------------------------------- */
-    /* Rettangolo pieno con pennello corrente                            */
-    if (strcmp(name, "gfillrect") == 0) {
-        if (nargs >= 4 && g_hdc_buf) {
-            int x1 = (int)value_to_number(args[0]);
-            int y1 = (int)value_to_number(args[1]);
-            int x2 = (int)value_to_number(args[2]);
-            int y2 = (int)value_to_number(args[3]);
-            EnterCriticalSection(&g_gfx_cs);
-            Rectangle(g_hdc_buf, x1, y1, x2, y2);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
-        }
-        return result;
+    if (c == '?') {
+        p.pos++;
+        an_skip_ws(&p);
+        if (line[p.pos] == '=') p.pos++;
+        n = an_node(AN_PRINT, start);
+        an_add_kid(n, an_parse_chain(&p));
+        n->end = p.pos;
+        return n;
     }
 
-    /* gcircle(x,y,r) ------------------------------------------------- */
-    /* Ellisse (solo bordo) centrata in (x,y) con raggio r              */
-    if (strcmp(name, "gcircle") == 0) {
-        if (nargs >= 3 && g_hdc_buf) {
-            int x = (int)value_to_number(args[0]);
-            int y = (int)value_to_number(args[1]);
-            int r = (int)value_to_number(args[2]);
-            EnterCriticalSection(&g_gfx_cs);
-            HBRUSH old_brush = (HBRUSH)SelectObject(g_hdc_buf,
-                                   GetStockObject(NULL_BRUSH));
-            Ellipse(g_hdc_buf, x - r, y - r, x + r, y + r);
-            SelectObject(g_hdc_buf, old_brush);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
+    if (isdigit((unsigned char)c) || IS_VARNAME(c) || c == '(') {
+        unsigned char flags = 0;
+        AnNode *index = an_parse_index(&p, &flags);
+        an_skip_ws(&p);
+        if (line[p.pos] == '@') {
+            p.pos++;
+            n = an_node(AN_ASTORE, start);
+            n->flags = flags;
+            an_add_kid(n, index);
+            if (line[p.pos] == '[') {   /* index@[h]=value: the handle is the middle kid */
+                p.pos++;
+                an_add_kid(n, an_parse_chain(&p));
+                an_skip_ws(&p);
+                if (line[p.pos] == ']') p.pos++;
+            }
+            an_skip_ws(&p);
+            if (line[p.pos] == '=') p.pos++;
+            an_add_kid(n, an_parse_chain(&p));
+            n->end = p.pos;
+            return n;
         }
-        return result;
+        p.pos = start;
     }
 
-    /* gfillcircle(x,y,r) -------------------------------------------- */
-    /* Ellisse piena con pennello corrente                               */
-    if (strcmp(name, "gfillcircle") == 0) {
-        if (nargs >= 3 && g_hdc_buf) {
-            int x = (int)value_to_number(args[0]);
-            int y = (int)value_to_number(args[1]);
-            int r = (int)value_to_number(args[2]);
-            EnterCriticalSection(&g_gfx_cs);
-            Ellipse(g_hdc_buf, x - r, y - r, x + r, y + r);
-            LeaveCriticalSection(&g_gfx_cs);
-            result.data.num = 1.0;
+    if (IS_VARNAME(c)) {
+        int var = VARIDX(c);
+        p.pos++;
+        an_skip_ws(&p);
+        char nc = line[p.pos];
+
+        if (nc == '\0') {
+            n = an_node(AN_UNSET, start);
+            n->var = (signed char)var;
+            n->flags = AN_F_PROBE;
+            n->end = p.pos;
+            return n;
         }
-        return result;
-    }
 
-    /* gtext(x,y,str) ------------------------------------------------- */
-    /* Scrive testo in posizione pixel (x,y) con colore penna corrente  */
-    if (strcmp(name, "gtext") == 0) {
-        if (nargs >= 3 && g_hdc_buf) {
-            int x = (int)value_to_number(args[0]);
-            int y = (int)value_to_number(args[1]);
-            char *str = (args[2].type == TYPE_STRING)
-                        ? args[2].data.str
-                        : value_to_string(args[2]);
-            EnterCriticalSection(&g_gfx_cs);
-            SetTextColor(g_hdc_buf, g_pen_color);
-            SetBkMode(g_hdc_buf, TRANSPARENT);
-            TextOut(g_hdc_buf, x, y, str, (int)strlen(str));
-            LeaveCriticalSection(&g_gfx_cs);
-            if (args[2].type != TYPE_STRING) free(str);
-            result.data.num = 1.0;
+        n = an_node(AN_SET, start);
+        n->var = (signed char)var;
+        n->flags = AN_F_PROBE;
+        if (nc == '=') {
+            p.pos++;
+            n->op = 'e';
+            an_add_kid(n, an_parse_chain(&p));
+        } else if (nc == '+' || nc == '-' || nc == '*' || nc == '/' || nc == '%' ||
+                   nc == '^' || nc == '&' || nc == '|' || nc == '<' || nc == '>') {
+            AnNode *left = an_node(AN_VAR, start);
+            left->var = (signed char)var;
+            left->end = start + 1;
+            n->op = 's';
+            an_add_kid(n, an_continue_chain(&p, left));
+        } else {
+            n->op = 'i';
+            an_add_kid(n, an_parse_chain(&p));
         }
-        return result;
+        n->end = p.pos;
+        return n;
     }
 
-    /* grefresh() ----------------------------------------------------- */
-    if (strcmp(name, "grefresh") == 0) {
-        gfx_refresh();
-        result.data.num = 1.0;
-        return result;
+    if (c == '#') {
+        p.pos++;
+        an_skip_ws(&p);
+        if (line[p.pos] == '=') p.pos++;
+        n = an_node(AN_JUMP, start);
+        an_add_kid(n, an_parse_chain(&p));
+        n->end = p.pos;
+        return n;
     }
 
-    /* gmx() ---------------------------------------------------------- */
-    if (strcmp(name, "gmx") == 0) {
-        result.data.num = (double)g_mouse_x;
-        return result;
-    }
+    n = an_node(AN_EXPR, start);
+    an_add_kid(n, an_parse_chain(&p));
+    n->end = p.pos;
+    return n;
+}
 
-    /* gmy() ---------------------------------------------------------- */
-    if (strcmp(name, "gmy") == 0) {
-        result.data.num = (double)g_mouse_y;
-        return result;
+static int builtin_effects(const char *name, int nargs);
+
+/* Variables (bit AN_MEM for the array) a tree may read or write */
+static void an_collect_vars(const AnNode *n, unsigned *reads, unsigned *writes) {
+    switch (n->kind) {
+        case AN_VAR: case AN_CONV: case AN_CMPEQ:
+            *reads |= 1u << n->var;
+            break;
+        case AN_SET: case AN_UNSET:
+            if (n->flags & AN_F_PROBE) *reads |= 1u << n->var;
+            *writes |= 1u << n->var;
+            break;
+        case AN_AREAD:
+            *reads |= 1u << AN_MEM;
+            break;
+        case AN_ASTORE:
+            *writes |= 1u << AN_MEM;
+            break;
+        case AN_CALL: {
+            int fx = builtin_effects(n->text, n->nkids);
+            if (fx & FX_ARRAY_READ) *reads |= 1u << AN_MEM;
+            if (fx & FX_ARRAY_WRITE) *writes |= 1u << AN_MEM;
+            break;
+        }
+        case AN_CMD:
+            *reads |= AN_ALL_VARS;
+            *writes |= AN_ALL_VARS;
+            break;
+        default:
+            break;
     }
+    for (int i = 0; i < n->nkids; i++)
+        an_collect_vars(n->kids[i], reads, writes);
+}
 
-    /* gmb() ---------------------------------------------------------- */
-    /* Ritorna la maschera dei pulsanti attualmente premuti            */
-    /* bit 0=sinistro, bit 1=destro, bit 2=centrale                   */
-    if (strcmp(name, "gmb") == 0) {
-        result.data.num = (double)g_mouse_btn;
-        return result;
+/* ------------------------------------------------------------------ */
+/* Builtin classification                                               */
+/* ------------------------------------------------------------------ */
+static int builtin_effects(const char *name, int nargs) {
+    if (is_screen_function(name)) return FX_IO;
+    if (strcmp(name, "split") == 0) return FX_ARRAY_WRITE;
+    /* adim() changes which element @(i,j) reads */
+    if (strcmp(name, "adim") == 0) return nargs >= 2 ? FX_ARRAY_WRITE : FX_IO;
+    if (strcmp(name, "aview") == 0) return nargs == 1 || nargs >= 4 ? FX_ARRAY_WRITE : FX_IO;
+    if (strcmp(name, "join") == 0) return FX_ARRAY_READ;
+    /* Tables count as array memory: reads see hset, writes clobber both */
+    if (strcmp(name, "hset") == 0 || strcmp(name, "hclear") == 0) return FX_ARRAY_WRITE;
+    if (strcmp(name, "hdel") == 0 || strcmp(name, "hkeys") == 0 || strcmp(name, "hvals") == 0)
+        return FX_ARRAY_READ | FX_ARRAY_WRITE;
+    if (is_table_function(name)) return FX_ARRAY_READ;
+    /* Heaps likewise */
+    if (strcmp(name, "pqinit") == 0) return FX_ARRAY_WRITE;
+    if (strcmp(name, "pqpush") == 0 || strcmp(name, "pqpop") == 0 ||
+        strcmp(name, "pqheapify") == 0)
+        return FX_ARRAY_READ | FX_ARRAY_WRITE;
+    if (is_heap_function(name)) return FX_ARRAY_READ;
+    /* Deques likewise */
+    if (strcmp(name, "dqinit") == 0) return FX_ARRAY_WRITE;
+    if (strncmp(name, "dqpush", 6) == 0 || strncmp(name, "dqpop", 5) == 0 ||
+        strcmp(name, "dqset") == 0)
+        return FX_ARRAY_READ | FX_ARRAY_WRITE;
+    if (is_deque_function(name)) return FX_ARRAY_READ;
+    /* Bitsets likewise */
+    if (strcmp(name, "bsfill") == 0 || strcmp(name, "bsinit") == 0) return FX_ARRAY_WRITE;
+    if (strcmp(name, "bstest") == 0 || strcmp(name, "bscount") == 0 || strcmp(name, "bsfirst") == 0)
+        return FX_ARRAY_READ;
+    if (is_bitset_function(name)) return FX_ARRAY_READ | FX_ARRAY_WRITE;
+    if (is_string_function(name)) return FX_PURE;   /* but see an_regex_call_pure() */
+    int arity = math_function_arity(name);
+    if (arity >= 0 && nargs >= arity) return FX_PURE;
+    const ExtFn *x = ext_find(name);
+    if (x && nargs >= x->nargs && (x->flags & ITL_EXT_PURE)) return FX_PURE;
+    return FX_IO;   /* unknown name or missing arguments print a warning */
+}
+
+/* A regex call warns unless its pattern is a literal that compiles */
+static int an_regex_call_pure(const AnNode *n) {
+    if (strncmp(n->text, "re", 2) != 0) return 1;
+    return n->nkids >= 2 && n->kids[1]->kind == AN_STR && !re_get(n->kids[1]->text)->err;
+}
+
+/* Command lines: 0 = read-only listing, 1 = clears variables,
+   2 = stops the program, 3 = unknown effect */
+static int an_command_class(const char *cmd) {
+    static const char *listing[] = {
+        "help", "syntax", "screen", "vars", "array", "lines", NULL
+    };
+    for (int i = 0; listing[i]; i++)
+        if (strcmp(cmd, listing[i]) == 0) return 0;
+    if (strncmp(cmd, "debug ", 6) == 0 || strncmp(cmd, "array ", 6) == 0 ||
+        strncmp(cmd, "disasm ", 7) == 0 || strncmp(cmd, "explain ", 8) == 0 ||
+        strncmp(cmd, "load ", 5) == 0) return 0;
+    if (strcmp(cmd, "clear") == 0) return 1;
+    if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0 ||
+        strcmp(cmd, "reset") == 0) return 2;
+    return 3;
+}
+
+/* Lines of ":time N[-M]" or ":bench RUNS N[-M]", which run outside the
+   control flow the CFG records; 0 for any other command */
+static int an_command_range(const char *cmd, long *first, long *last) {
+    char *end;
+    if (strncmp(cmd, "bench ", 6) == 0) {
+        strtol(cmd + 5, &end, 10);
+        if (end == cmd + 5) return 0;
+        cmd = end;
+    } else if (strncmp(cmd, "time ", 5) == 0) {
+        cmd += 4;
+    } else {
+        return 0;
     }
+    while (*cmd == ' ') cmd++;
+    *first = *last = strtol(cmd, &end, 10);
+    if (end == cmd) return 0;
+    if (*end == '-') *last = strtol(end + 1, &end, 10);
+    while (*end == ' ') end++;
+    return !*end;
+}
 
-    /* gmclick() ------------------------------------------------------ */
-    /* Ritorna il pulsante dell'ultimo click (1/2/3) e lo azzera       */
-    if (strcmp(name, "gmclick") == 0) {
-        result.data.num = (double)g_mouse_click;
-        g_mouse_click = 0;
-        return result;
+/* ------------------------------------------------------------------ */
+/* Value-set abstract domain                                            */
+/* ------------------------------------------------------------------ */
+#define AV_MAXSET 6
+#define AV_UNDEF  1   /* may be undefined                   */
+#define AV_STR    2   /* may be a string                    */
+#define AV_ANY    4   /* may be any number                  */
+
+typedef struct {
+    unsigned char flags, n;
+    double v[AV_MAXSET];   /* known numeric values (unless AV_ANY) */
+} AbsVal;
+
+typedef struct {
+    int live;
+    AbsVal v[NUM_VARS];
+} AnState;
+
+static AbsVal av_flags(int flags) {
+    AbsVal a;
+    a.flags = (unsigned char)flags;
+    a.n = 0;
+    return a;
+}
+
+static void av_add(AbsVal *a, double x) {
+    if (a->flags & AV_ANY) return;
+    for (int i = 0; i < a->n; i++)
+        if (a->v[i] == x) return;
+    if (a->n == AV_MAXSET || x != x) {
+        a->flags |= AV_ANY;
+        a->n = 0;
+        return;
     }
+    a->v[a->n++] = x;
+}
 
-    /* gmdrag(b) ------------------------------------------------------ */
-    /* Ritorna 1 se il pulsante b (1/2/3) è tenuto premuto             */
-    /* mentre il mouse si muove, 0 altrimenti                          */
-    if (strcmp(name, "gmdrag") == 0) {
-        int btn = (nargs >= 1) ? (int)value_to_number(args[0]) : 1;
-        int bit = (btn == 1) ? 1 : (btn == 2) ? 2 : 4;
-        result.data.num = (g_mouse_drag & bit) ? 1.0 : 0.0;
-        return result;
+static AbsVal av_num(double x) {
+    AbsVal a = av_flags(0);
+    av_add(&a, x);
+    return a;
+}
+
+static AbsVal av_bool(void) {
+    AbsVal a = av_num(0.0);
+    av_add(&a, 1.0);
+    return a;
+}
+
+static AbsVal av_join(AbsVal a, AbsVal b) {
+    a.flags |= b.flags;
+    if (a.flags & AV_ANY) {
+        a.n = 0;
+        return a;
     }
+    for (int i = 0; i < b.n; i++) av_add(&a, b.v[i]);
+    return a;
+}
 
-    /* time() -------------------------------------------------------- */
-    /* Restituisce i secondi interi trascorsi dall'epoca Unix (1/1/1970) */
-    if (strcmp(name, "time") == 0) {
-        result.data.num = (double)time(NULL);
-        return result;
+static int av_same(const AbsVal *a, const AbsVal *b) {
+    if (a->flags != b->flags || a->n != b->n) return 0;
+    for (int i = 0; i < b->n; i++) {
+        int found = 0;
+        for (int j = 0; j < a->n && !found; j++) found = (a->v[j] == b->v[i]);
+        if (!found) return 0;
     }
+    return 1;
+}
 
-    /* ticks() ------------------------------------------------------- */
-    /* Restituisce i millisecondi trascorsi dall'avvio dell'interprete   */
-    if (strcmp(name, "ticks") == 0) {
-        LARGE_INTEGER now;
-        QueryPerformanceCounter(&now);
-        result.data.num = (double)(now.QuadPart - g_timer_start.QuadPart)
-                          * 1000.0 / (double)g_timer_freq.QuadPart;
-        return result;
+static int av_single(AbsVal a, double *x) {
+    if (a.flags == 0 && a.n == 1) { *x = a.v[0]; return 1; }
+    return 0;
+}
+
+static int av_has_number(AbsVal a) {
+    return (a.flags & (AV_UNDEF | AV_ANY)) || a.n > 0;
+}
+
+/* Numeric view, as produced by value_to_number() */
+static AbsVal av_numeric(AbsVal a) {
+    AbsVal r = a;
+    r.flags &= AV_ANY;
+    if (a.flags & AV_STR) { r.flags |= AV_ANY; r.n = 0; }
+    if (a.flags & AV_UNDEF) av_add(&r, 0.0);
+    return r;
+}
+
+static double an_apply_binop(char op, double ln, double rn) {
+    switch (op) {
+        case '+': return ln + rn;
+        case '-': return ln - rn;
+        case '*': return ln * rn;
+        case '/': return (rn == 0.0) ? 0.0 : ln / rn;
+        case '%': return (rn == 0.0) ? 0.0 : fmod(ln, rn);
+        case '^': return pow(ln, rn);
+        case '&': return (ln != 0.0 && rn != 0.0) ? 1.0 : 0.0;
+        case '|': return (ln != 0.0 || rn != 0.0) ? 1.0 : 0.0;
+        case '<': return (ln < rn) ? 1.0 : 0.0;
+        case '>': return (ln > rn) ? 1.0 : 0.0;
+        case '=': return (ln == rn) ? 1.0 : 0.0;
     }
+    return 0.0;
+}
 
-    /* elapsed() ----------------------------------------------------- */
-    /* Restituisce i millisecondi trascorsi dall'ultima chiamata         */
-    /* a elapsed() (o dall'avvio se non era mai stata chiamata)         */
-    if (strcmp(name, "elapsed") == 0) {
-        LARGE_INTEGER now;
-        QueryPerformanceCounter(&now);
-        result.data.num = (double)(now.QuadPart - g_timer_elapsed.QuadPart)
-                          * 1000.0 / (double)g_timer_freq.QuadPart;
-        g_timer_elapsed = now;
-        return result;
+static AbsVal av_binop(char op, AbsVal a, AbsVal b) {
+    AbsVal r = av_flags(0);
+    double x;
+
+    if (op == '+' && ((a.flags | b.flags) & AV_STR)) {
+        r.flags |= AV_STR;
+        if (!av_has_number(a) || !av_has_number(b)) return r;
+        a.flags &= ~AV_STR;
+        b.flags &= ~AV_STR;
     }
+    a = av_numeric(a);
+    b = av_numeric(b);
+
+    if ((a.flags | b.flags) & AV_ANY) {
+        if (op == '<' || op == '>' || op == '=' || op == '&' || op == '|')
+            return av_join(r, av_bool());
+        if (op == '*' && ((av_single(a, &x) && x == 0.0) || (av_single(b, &x) && x == 0.0)))
+            return av_join(r, av_num(0.0));
+        r.flags |= AV_ANY;
+        return r;
+    }
+    for (int i = 0; i < a.n; i++)
+        for (int j = 0; j < b.n; j++)
+            av_add(&r, an_apply_binop(op, a.v[i], b.v[j]));
+    return r;
+}
 
-    /* Unknown screen function */
-    result.type = TYPE_UNDEFINED;
-    return result;
+static void an_state_join(AnState *dst, const AnState *src, int *changed) {
+    if (!src->live) return;
+    if (!dst->live) {
+        *dst = *src;
+        *changed = 1;
+        return;
+    }
+    for (int i = 0; i < NUM_VARS; i++) {
+        AbsVal j = av_join(dst->v[i], src->v[i]);
+        if (!av_same(&j, &dst->v[i])) {
+            dst->v[i] = j;
+            *changed = 1;
+        }
+    }
 }
 
 /* ------------------------------------------------------------------ */
-/* Returns 1 if 'name' is a known screen function, 0 otherwise        */
+/* SSA IR                                                               */
 /* ------------------------------------------------------------------ */
-static int is_screen_function(const char *name) {
-    static const char *screen_funcs[] = {
-        "gotoxy", "putch", "getch", "setfore", "setback",
-        "setattr", "getw", "geth", "clear",
-        "tmx", "tmy", "tmclick", "tmdrag",
-        "gopen","gclear","gpen","gbr","gpixel","gline",
-        "grect","gfillrect","gcircle","gfillcircle","gtext","grefresh",
-        "gmx", "gmy", "gmb", "gmclick", "gmdrag",
-        "time", "ticks", "elapsed",
-        NULL
-    };
-    for (int i = 0; screen_funcs[i]; i++)
-        if (strcmp(name, screen_funcs[i]) == 0) return 1;
+typedef enum {
+    IR_UNDEF, IR_ENTRY, IR_CONST, IR_STR, IR_NEG, IR_NOT, IR_CONV, IR_DEFNUM,
+    IR_BIN, IR_CMPEQ, IR_RAND, IR_SEED, IR_KEY, IR_INPUT, IR_ALOAD, IR_ASTORE,
+    IR_CALL, IR_SET, IR_UNSET, IR_PHI, IR_PRINT, IR_JUMP, IR_CMD, IR_CLOBBER,
+    IR_FWD, IR_FWDDEF
+} IrOp;
+
+static const char *ir_op_names[] = {
+    "undef", "entry", "const", "str", "neg", "not", "conv", "defnum",
+    "bin", "cmpeq", "rand", "seed", "key", "input", "aload", "astore",
+    "call", "set", "unset", "phi", "print", "jump", "cmd", "clobber",
+    "fwd", "fwddef"
+};
+
+#define IRF_PRIMARY 1   /* span is a primary expression            */
+#define IRF_CHAIN   2   /* span is a left-to-right chain prefix    */
+#define IRF_IMPURE  4   /* has side effects or a varying result    */
+#define IRF_HOIST   8   /* loop-invariant, cached per loop epoch   */
+#define IRF_MAYFAIL 16  /* may print a division/modulo by zero error
+                           or an @ warning                          */
+
+typedef struct {
+    unsigned char op, flags;
+    char binop;
+    signed char var;     /* variable defined/used, AN_MEM for '@'   */
+    int block, line;
+    int start, end;      /* source span of the computed expression  */
+    int aux;             /* FWD: executed line; JUMP: line; hoisted: loop */
+    int first;           /* first instruction of the subexpression  */
+    double num;
+    const char *text;
+    int nops;
+    int *ops;            /* operand value ids; <0 = entry value of var -(op+1) */
+} IrInst;
+
+typedef struct {
+    int first_line, last_line;   /* 0 for the entry and dispatch blocks */
+    int reachable;
+    int exits;                   /* may leave the program              */
+    IntVec succ, pred;
+    IntVec phis;
+    IntVec df;
+    IntVec domkids;
+    int idom, rpo;
+    int loop;                    /* innermost loop, -1 if none         */
+    int ins_begin, ins_end;      /* body instructions                  */
+    unsigned defmask;
+} AnBlock;
+
+typedef struct {
+    int header;
+    int parent;
+    int depth;
+    int dynamic;                 /* closed only through the dispatch block */
+    IntVec blocks;
+    IntVec latches;
+} AnLoop;
+
+typedef struct {
+    int reached;
+    int is_jump;
+    int dynamic;                 /* target may be any line             */
+    int falls;                   /* may continue with the next line    */
+    int stops;                   /* :exit / :quit / :reset             */
+    IntVec targets;
+} AnLineInfo;
+
+typedef struct {
+    int valid;
+    const char *error;
+    int nlines;
+    int fresh;                   /* analysed from program start        */
+    AnNode **ast;                /* per line, index line-1             */
+    AnLineInfo *info;            /* per line, index line-1             */
+    unsigned *reads, *writes;    /* per line variable masks            */
+    int *line_block;             /* per line, index line-1             */
+    AnBlock *blocks;
+    int nblocks;
+    int entry_block, dispatch_block;
+    AnLoop *loops;
+    int nloops;
+    IrInst *ins;
+    int nins, capins;
+    IntVec fwd_lines[NUM_VARS];  /* lines a forward reference may run  */
+} ProgramAnalysis;
+
+static ProgramAnalysis g_an;
+
+/* Lowering state: block receiving instructions and its local definitions */
+static int an_cur_block = -1;
+static int an_cur_def[AN_NVARS];
+
+static int ir_emit(int op, int line, const AnNode *n) {
+    if (g_an.nins == g_an.capins) {
+        g_an.capins = g_an.capins ? g_an.capins * 2 : 1024;
+        g_an.ins = (IrInst *)realloc(g_an.ins, g_an.capins * sizeof(IrInst));
+    }
+    IrInst *in = &g_an.ins[g_an.nins];
+    memset(in, 0, sizeof(*in));
+    in->op = (unsigned char)op;
+    in->var = -1;
+    in->block = an_cur_block;
+    in->line = line;
+    in->first = g_an.nins;
+    if (n) {
+        in->start = n->start;
+        in->end = n->end;
+    }
+    return g_an.nins++;
+}
+
+static void ir_set_ops(int id, int nops, const int *ops) {
+    IrInst *in = &g_an.ins[id];
+    in->nops = nops;
+    in->ops = nops ? (int *)an_alloc(nops * sizeof(int)) : NULL;
+    if (nops) memcpy(in->ops, ops, nops * sizeof(int));
+}
+
+/* Define a new version of 'var' in the current block */
+static void ir_def(int id, int var) {
+    g_an.ins[id].var = (signed char)var;
+    an_cur_def[var] = id;
+    g_an.blocks[an_cur_block].defmask |= 1u << var;
+}
+
+/* Current value of a variable: a local definition or the block entry value */
+static int ir_use(int var) {
+    return an_cur_def[var] >= 0 ? an_cur_def[var] : -(var + 1);
+}
+
+static int ir_defines(const IrInst *in) {
+    switch (in->op) {
+        case IR_UNDEF: case IR_ENTRY: case IR_SET: case IR_UNSET: case IR_PHI:
+        case IR_CLOBBER: case IR_FWDDEF: case IR_ASTORE:
+            return 1;
+    }
     return 0;
 }
 
 /* ------------------------------------------------------------------ */
-/* Parse primary expression                                            */
+/* Abstract evaluation (optionally lowering to IR at the same time)    */
 /* ------------------------------------------------------------------ */
-Value parse_primary(ParseContext *ctx) {
-    Value result;
-    result.type = TYPE_UNDEFINED;
+typedef struct {
+    AnState *st;
+    int line;        /* line whose text is being evaluated       */
+    int in_fwd;      /* running a forward-referenced line         */
+    int lower;       /* emit IR into an_cur_block                 */
+    AbsVal jump;     /* target of a '#=' statement                */
+    int is_jump;
+} AnEval;
+
+static void an_exec_line(AnEval *ev);
+
+/* First line after 'line' that a forward reference to 'var' executes */
+static int an_fwd_line(int var, int line) {
+    IntVec *iv = &g_an.fwd_lines[var];
+    int lo = 0, hi = iv->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (iv->v[mid] <= line) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < iv->n ? iv->v[lo] : 0;
+}
 
-    skip_whitespace(ctx);
+static AbsVal an_read_var(AnEval *ev, int var, int *val) {
+    AbsVal *cur = &ev->st->v[var];
+
+    if (!ev->in_fwd && (cur->flags & AV_UNDEF)) {
+        int m = an_fwd_line(var, ev->line);
+        if (m > 0) {
+            AnState before = *ev->st;
+            int definitely_undef = (cur->flags == AV_UNDEF && cur->n == 0);
+
+            if (ev->lower) {
+                /* Uses the tested variable too: the reference only runs while it is undefined */
+                int ops[AN_NVARS + 1], nops = 0;
+                ops[nops++] = ir_use(var);
+                for (int v = 0; v < AN_NVARS; v++)
+                    if (g_an.reads[m - 1] & (1u << v)) ops[nops++] = ir_use(v);
+                int id = ir_emit(IR_FWD, ev->line, NULL);
+                g_an.ins[id].aux = m;
+                g_an.ins[id].var = (signed char)var;
+                g_an.ins[id].flags = IRF_IMPURE;
+                ir_set_ops(id, nops, ops);
+                /* The line runs only while 'var' is undefined, so each value
+                   it sets may instead be the one from before */
+                for (int v = 0; v < AN_NVARS; v++) {
+                    if (!(g_an.writes[m - 1] & (1u << v))) continue;
+                    int dops[2] = { id, ir_use(v) };
+                    int d = ir_emit(IR_FWDDEF, ev->line, NULL);
+                    ir_set_ops(d, 2, dops);
+                    ir_def(d, v);
+                }
+            }
 
-    /* Unary minus */
-    if (ctx->expr[ctx->pos] == '-' &&
-        (isdigit((unsigned char)ctx->expr[ctx->pos + 1]) ||
-         IS_VARNAME(ctx->expr[ctx->pos + 1]) ||
-         ctx->expr[ctx->pos + 1] == '(' ||
-         ctx->expr[ctx->pos + 1] == '@' ||
-         ctx->expr[ctx->pos + 1] == '?' ||
-         ctx->expr[ctx->pos + 1] == '\'' ||
-         ctx->expr[ctx->pos + 1] == '#' ||
-         ctx->expr[ctx->pos + 1] == '$')) {
-        ctx->pos++;
-        Value val = parse_primary(ctx);
-        result.type = TYPE_NUMBER;
-        result.data.num = -value_to_number(val);
-        free_value(&val);
-        return result;
+            AnEval sub;
+            memset(&sub, 0, sizeof(sub));
+            sub.st = ev->st;
+            sub.line = m;
+            sub.in_fwd = 1;
+            an_exec_line(&sub);
+
+            if (!definitely_undef) {
+                int changed = 0;
+                an_state_join(ev->st, &before, &changed);
+            }
+        }
     }
+    if (val) *val = ev->lower ? ir_use(var) : 0;
+    return ev->st->v[var];
+}
 
-    /* Unary logical NOT */
-    if (ctx->expr[ctx->pos] == '!') {
-        ctx->pos++;
-        Value val = parse_primary(ctx);
-        result.type = TYPE_NUMBER;
-        result.data.num = (value_to_number(val) == 0.0) ? 1.0 : 0.0;
-        free_value(&val);
-        return result;
+static AbsVal an_eval(AnEval *ev, const AnNode *n, int *val);
+
+static int an_emit1(AnEval *ev, int op, const AnNode *n, int a, int flags) {
+    int id = ir_emit(op, ev->line, n);
+    g_an.ins[id].flags = (unsigned char)flags;
+    ir_set_ops(id, 1, &a);
+    return id;
+}
+
+/* Operand buffer of an '@' node: memory, index, value and handle */
+static int *an_index_ops(const AnNode *n, const AnNode *ix) {
+    int nix = (n->flags & AN_F_COORDS) ? ix->nkids : 1;
+    return (int *)an_alloc((nix + 3) * sizeof(int));
+}
+
+/* Evaluate an '@' index into ops[nops...]. A coordinate block gives one
+   operand per statement, so the access depends on every coordinate. */
+static int an_eval_index(AnEval *ev, const AnNode *n, const AnNode *ix, int *ops, int nops) {
+    if (!(n->flags & AN_F_COORDS)) {
+        an_eval(ev, ix, &ops[nops++]);
+        return nops;
     }
+    for (int k = 0; k < ix->nkids; k++)
+        an_eval(ev, ix->kids[k], &ops[nops++]);
+    return nops;
+}
 
-    /* Type conversion ($VAR) */
-    if (ctx->expr[ctx->pos] == '$') {
-        ctx->pos++;
-        skip_whitespace(ctx);
-
-        if (IS_VARNAME(ctx->expr[ctx->pos])) {
-            int var_idx = VARIDX(ctx->expr[ctx->pos]);
-            ctx->pos++;
-            Value var_val = get_variable(var_idx);
-
-            if (var_val.type == TYPE_NUMBER) {
-                result.type = TYPE_STRING;
-                result.data.str = value_to_string(var_val);
-            } else if (var_val.type == TYPE_STRING) {
-                result.type = TYPE_NUMBER;
-                result.data.num = value_to_number(var_val);
+/* IRF_MAYFAIL for an '@' access that may warn: coordinates, which need
+   a shape from adim(), or a handle that is not a constant array number */
+static int an_array_mayfail(const AnNode *n, int has_handle, AbsVal handle) {
+    double h;
+    if (n->flags & AN_F_COORDS) return IRF_MAYFAIL;
+    if (has_handle && !(av_single(av_numeric(handle), &h) && h >= 0.0 &&
+                        h < ARRAY_MAX && h == (int)h))
+        return IRF_MAYFAIL;
+    return 0;
+}
+
+static AbsVal an_eval(AnEval *ev, const AnNode *n, int *val) {
+    AbsVal r, a, b;
+    int va = 0, vb = 0, id = 0;
+    int first = g_an.nins;
+    double x;
+
+    switch (n->kind) {
+        case AN_NUM:
+        case AN_LINENO:
+            x = (n->kind == AN_NUM) ? n->num : (double)ev->line;
+            if (ev->lower) {
+                id = ir_emit(IR_CONST, ev->line, n);
+                g_an.ins[id].num = x;
+                g_an.ins[id].flags = IRF_PRIMARY;
+            }
+            r = av_num(x);
+            break;
+
+        case AN_STR:
+            if (ev->lower) {
+                id = ir_emit(IR_STR, ev->line, n);
+                g_an.ins[id].text = n->text;
+                g_an.ins[id].flags = IRF_PRIMARY;
+            }
+            r = av_flags(AV_STR);
+            break;
+
+        case AN_VAR:
+            r = an_read_var(ev, n->var, &id);
+            break;
+
+        case AN_NEG:
+        case AN_NOT:
+            a = av_numeric(an_eval(ev, n->kids[0], &va));
+            if (n->kind == AN_NEG) {
+                r = av_flags(a.flags & AV_ANY);
+                for (int i = 0; i < a.n; i++) av_add(&r, -a.v[i]);
+            } else if (a.flags & AV_ANY) {
+                r = av_bool();
             } else {
-                result.type = TYPE_NUMBER;
-                result.data.num = 0.0;
+                r = av_flags(0);
+                for (int i = 0; i < a.n; i++) av_add(&r, a.v[i] == 0.0 ? 1.0 : 0.0);
             }
-            free_value(&var_val);
-            return result;
-        }
-    }
+            if (ev->lower)
+                id = an_emit1(ev, n->kind == AN_NEG ? IR_NEG : IR_NOT, n, va, IRF_PRIMARY);
+            break;
 
-    /* ----------------------------------------------------------------
-     * Parentheses block / function call arguments
-     * When we reach '(' we may have:
-     *   a) A block of ';'-separated statements (returns last assigned var)
-     *   b) A comma-separated list (collected by the function caller)
-     * Here we handle the block case; comma lists are handled in function
-     * call parsing above. Inside a paren block:
-     *   - Statements separated by ';' are executed in sequence
-     *   - The result is the value of the variable assigned on the last
-     *     statement (or the expression value if no assignment).
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '(') {
-        ctx->pos++;  /* skip '(' */
+        case AN_CONV:
+            a = an_read_var(ev, n->var, &va);
+            r = av_flags(0);
+            if (a.flags & AV_STR) r.flags |= AV_ANY;
+            if ((a.flags & AV_ANY) || a.n > 0) r.flags |= AV_STR;
+            if (a.flags & AV_UNDEF) r = av_join(r, av_num(0.0));
+            if (ev->lower) id = an_emit1(ev, IR_CONV, n, va, IRF_PRIMARY);
+            break;
 
-        Value last_result;
-        last_result.type = TYPE_UNDEFINED;
+        case AN_BLOCK:
+            r = av_num(0.0);
+            if (ev->lower && n->nkids == 0) {
+                id = ir_emit(IR_CONST, ev->line, n);
+                g_an.ins[id].flags = IRF_PRIMARY;
+            }
+            for (int i = 0; i < n->nkids; i++)
+                r = an_eval(ev, n->kids[i], &id);
+            if (r.flags & AV_UNDEF) {
+                r.flags &= ~AV_UNDEF;
+                av_add(&r, 0.0);
+                if (ev->lower) id = an_emit1(ev, IR_DEFNUM, n, id, IRF_PRIMARY);
+            }
+            break;
 
-        while (1) {
-            skip_whitespace(ctx);
+        case AN_RAND:
+        case AN_KEY:
+        case AN_INPUT:
+            if (ev->lower) {
+                id = ir_emit(n->kind == AN_RAND ? IR_RAND :
+                             n->kind == AN_KEY ? IR_KEY : IR_INPUT, ev->line, n);
+                g_an.ins[id].flags = IRF_PRIMARY | IRF_IMPURE;
+            }
+            r = av_flags(n->kind == AN_INPUT ? AV_STR : AV_ANY);
+            break;
 
-            /* End of block */
-            if (ctx->expr[ctx->pos] == ')' || ctx->expr[ctx->pos] == '\0')
-                break;
+        case AN_SEED:
+            an_eval(ev, n->kids[0], &va);
+            if (ev->lower) id = an_emit1(ev, IR_SEED, n, va, IRF_PRIMARY | IRF_IMPURE);
+            r = av_num(0.0);
+            break;
 
-            /* Free previous iteration result */
-            free_value(&last_result);
+        case AN_AREAD: {
+            /* All arrays are the one memory AN_MEM; a handle is an extra operand */
+            int *ops = an_index_ops(n, n->kids[n->nkids - 1]);
+            int nops = 1;
+            a = av_num(0.0);
+            if (n->nkids > 1) a = an_eval(ev, n->kids[0], &va);
+            nops = an_eval_index(ev, n, n->kids[n->nkids - 1], ops, nops);
+            if (n->nkids > 1) ops[nops++] = va;
+            if (ev->lower) {
+                ops[0] = ir_use(AN_MEM);
+                id = ir_emit(IR_ALOAD, ev->line, n);
+                g_an.ins[id].flags = IRF_PRIMARY | an_array_mayfail(n, n->nkids > 1, a);
+                ir_set_ops(id, nops, ops);
+            }
+            r = av_flags(AV_ANY);
+            break;
+        }
 
-            /*
-             * Detect statement type inside a paren block:
-             *
-             * 1. VAR = expr   -> explicit assignment (always assigns)
-             * 2. VAR expr     -> implicit assignment (always assigns, e.g. B42)
-             * 3. VAR op expr  -> self-referential ONLY when followed by ';'
-             *                    (B+1; means B=B+1), plain value when last item
-             * 4. anything else -> plain expression, no assignment
-             *
-             * This logic applies to both uppercase A-Z and '_'.
-             */
-            if (IS_VARNAME(ctx->expr[ctx->pos])) {
-                int var_idx = VARIDX(ctx->expr[ctx->pos]);
-                /* Peek at what follows the variable letter (skip spaces) */
-                int peek = ctx->pos + 1;
-                while (ctx->expr[peek] == ' ' || ctx->expr[peek] == '\t') peek++;
-                char nc = ctx->expr[peek];
-
-                /* Case 1: explicit '=' inside parens:
-                 *   (A=expr)   -> comparison: 1 if A==expr, 0 otherwise
-                 *   (A=expr;)  -> assignment: assigns expr to A            */
-                if (nc == '=') {
-                    Value cur = get_variable(var_idx);
-                    ctx->pos++;          /* consume VAR letter */
-                    skip_whitespace(ctx);
-                    ctx->pos++;          /* consume '=' */
-                    Value rhs = evaluate_expression(ctx);
-                    skip_whitespace(ctx);
-                    if (ctx->expr[ctx->pos] == ';') {
-                        /* Semicolon present: treat as assignment */
-                        free_value(&cur);
-                        set_variable(var_idx, rhs);
-                        free_value(&rhs);
-                        last_result = copy_value(variables[var_idx]);
-                    } else {
-                        /* No semicolon: treat as equality comparison */
-                        double eq;
-                        if (cur.type == TYPE_STRING && rhs.type == TYPE_STRING)
-                            eq = strcmp(cur.data.str, rhs.data.str) == 0 ? 1.0 : 0.0;
-                        else
-                            eq = value_to_number(cur) == value_to_number(rhs) ? 1.0 : 0.0;
-                        free_value(&cur);
-                        free_value(&rhs);
-                        last_result.type = TYPE_NUMBER;
-                        last_result.data.num = eq;
-                    }
+        case AN_CALL: {
+            int fx = builtin_effects(n->text, n->nkids);
+            if (fx == FX_PURE && is_string_function(n->text) && !an_regex_call_pure(n)) fx = FX_IO;
+            int ops[MAX_FUNC_ARGS + 1], nops = 0;
+            double args[MAX_FUNC_ARGS];
+            int all_const = 1;
+            for (int i = 0; i < n->nkids; i++) {
+                a = an_eval(ev, n->kids[i], &va);
+                if (i < MAX_FUNC_ARGS) {
+                    ops[nops++] = va;
+                    if (!av_single(av_numeric(a), &args[i])) all_const = 0;
                 }
-                /* Case 2: value-starter -> implicit assignment (e.g. A42) */
-                else if (nc != '\0' && nc != ')' && nc != ';' && nc != ',' &&
-                     nc != '+' && nc != '*' && nc != '/' && nc != '%' &&
-                     nc != '^' && nc != '&' && nc != '|' && nc != '<' &&
-                     nc != '>' && nc != '!' &&
-                     (nc != '-' || isdigit((unsigned char)ctx->expr[peek+1]) ||
-                      ctx->expr[peek+1] == '(')) {
-                    ctx->pos++;          /* consume VAR letter */
-                    skip_whitespace(ctx);
-                    Value val = evaluate_expression(ctx);
-                    set_variable(var_idx, val);
-                    free_value(&val);
-                    last_result = copy_value(variables[var_idx]);
+            }
+            if (fx & (FX_ARRAY_READ | FX_ARRAY_WRITE)) ops[nops++] = ir_use(AN_MEM);
+            r = av_flags(AV_ANY);
+            if (fx == FX_PURE && all_const && !is_string_function(n->text)) {
+                Value res = call_math_function(n->text, args, nops);
+                if (res.type == TYPE_NUMBER) r = av_num(res.data.num);
+            } else if (fx == FX_IO && builtin_family(n->text) == FN_MATH &&
+                       !(ext_find(n->text) && n->nkids >= ext_find(n->text)->nargs)) {
+                r = av_flags(AV_UNDEF);   /* unknown function yields undefined */
+            }
+            if (ev->lower) {
+                id = ir_emit(IR_CALL, ev->line, n);
+                g_an.ins[id].text = n->text;
+                g_an.ins[id].flags = IRF_PRIMARY | (fx ? IRF_IMPURE : 0);
+                ir_set_ops(id, nops, ops);
+                if (fx & FX_ARRAY_WRITE) {
+                    int d = ir_emit(IR_CLOBBER, ev->line, NULL);
+                    ir_set_ops(d, 1, &id);
+                    ir_def(d, AN_MEM);
                 }
-                /* Case 3: binary operator follows -> self-referential */
-                else if (nc == '+' || nc == '-' || nc == '*' || nc == '/' ||
-                     nc == '%' || nc == '^' || nc == '&' || nc == '|' ||
-                     nc == '<' || nc == '>') {
-                    /* Build synthetic "VAR op expr" and evaluate it */
-                    char synth[MAX_LINE_LENGTH + 2];
-                    synth[0] = (char)VARCHAR(var_idx);
-                    strncpy(synth + 1, ctx->expr + ctx->pos + 1, MAX_LINE_LENGTH - 1);
-                    synth[MAX_LINE_LENGTH] = '\0';
-                    /* Advance ctx past the whole expression */
-                    ctx->pos++;  /* skip VAR letter */
-                    Value rhs_dummy = evaluate_expression(ctx);
-                    /* Compute the full self-ref value */
-                    ParseContext ctx2;
-                    ctx2.expr = synth;
-                    ctx2.pos = 0;
-                    ctx2.line_num = ctx->line_num;
-                    Value full_val = evaluate_expression(&ctx2);
-                    free_value(&rhs_dummy);
+            }
+            break;
+        }
 
-                    skip_whitespace(ctx);
-                    /* Only assign if ';' follows (not last item) */
-                    if (ctx->expr[ctx->pos] == ';') {
-                        set_variable(var_idx, full_val);
-                        last_result = copy_value(variables[var_idx]);
-                    } else {
-                        last_result = full_val;
-                        full_val.type = TYPE_UNDEFINED; /* prevent double free */
-                    }
-                    free_value(&full_val);
-                } else {
-                    /* Case 4: plain expression starting with a variable */
-                    last_result = evaluate_expression(ctx);
+        case AN_BINOP:
+            a = an_eval(ev, n->kids[0], &va);
+            b = an_eval(ev, n->kids[1], &vb);
+            r = av_binop(n->op, a, b);
+            if (ev->lower) {
+                int ops[2];
+                ops[0] = va;
+                ops[1] = vb;
+                id = ir_emit(IR_BIN, ev->line, n);
+                g_an.ins[id].binop = n->op;
+                g_an.ins[id].flags = IRF_CHAIN;
+                if (n->op == '/' || n->op == '%') {
+                    AbsVal d = av_numeric(b);
+                    int may_be_zero = (d.flags & AV_ANY) != 0;
+                    for (int i = 0; i < d.n; i++) may_be_zero |= (d.v[i] == 0.0);
+                    if (may_be_zero) g_an.ins[id].flags |= IRF_MAYFAIL;
                 }
-            } else {
-                /* Not a variable name: plain expression */
-                last_result = evaluate_expression(ctx);
+                ir_set_ops(id, 2, ops);
             }
+            break;
 
-            skip_whitespace(ctx);
+        case AN_CMPEQ:
+            an_read_var(ev, n->var, &va);
+            an_eval(ev, n->kids[0], &vb);
+            if (ev->lower) {
+                int ops[2];
+                ops[0] = va;
+                ops[1] = vb;
+                id = ir_emit(IR_CMPEQ, ev->line, n);
+                ir_set_ops(id, 2, ops);
+            }
+            r = av_bool();
+            break;
 
-            /* Consume statement separator: ';' or ',' both continue the block */
-            if (ctx->expr[ctx->pos] == ';' || ctx->expr[ctx->pos] == ',') {
-                ctx->pos++;
-                continue;
+        case AN_SET:
+            if (n->flags & AN_F_PROBE) an_read_var(ev, n->var, NULL);
+            r = an_eval(ev, n->kids[0], &va);
+            ev->st->v[n->var] = r;
+            if (ev->lower) {
+                id = an_emit1(ev, IR_SET, n, va, 0);
+                ir_def(id, n->var);
+                id = va;
             }
-            /* Any other character (including ')') ends the block */
             break;
-        }
 
-        skip_whitespace(ctx);
-        if (ctx->expr[ctx->pos] == ')')
-            ctx->pos++;
+        case AN_UNSET:
+            if (n->flags & AN_F_PROBE) an_read_var(ev, n->var, NULL);
+            ev->st->v[n->var] = av_flags(AV_UNDEF);
+            if (ev->lower) {
+                id = ir_emit(IR_UNSET, ev->line, n);
+                ir_def(id, n->var);
+            }
+            r = av_flags(AV_UNDEF);
+            break;
 
-        if (last_result.type == TYPE_UNDEFINED) {
-            last_result.type = TYPE_NUMBER;
-            last_result.data.num = 0.0;
+        case AN_ASTORE: {
+            /* Operands: memory, index (one per coordinate), value, handle */
+            int *ops = an_index_ops(n, n->kids[0]);
+            int nops = an_eval_index(ev, n, n->kids[0], ops, 1);
+            a = av_num(0.0);
+            if (n->nkids > 2) a = an_eval(ev, n->kids[1], &va);
+            an_eval(ev, n->kids[n->nkids - 1], &ops[nops++]);
+            if (n->nkids > 2) ops[nops++] = va;
+            if (ev->lower) {
+                ops[0] = ir_use(AN_MEM);
+                id = ir_emit(IR_ASTORE, ev->line, n);
+                g_an.ins[id].flags = (unsigned char)an_array_mayfail(n, n->nkids > 2, a);
+                ir_set_ops(id, nops, ops);
+                ir_def(id, AN_MEM);
+            }
+            r = av_flags(0);
+            break;
         }
 
-        return last_result;
-    }
+        case AN_PRINT:
+        case AN_EXPR:
+            r = an_eval(ev, n->kids[0], &va);
+            if (ev->lower && n->kind == AN_PRINT)
+                an_emit1(ev, IR_PRINT, n, va, IRF_IMPURE);
+            break;
 
-    /* ----------------------------------------------------------------
-     * String literal
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '"') {
-        ctx->pos++;
-        int start = ctx->pos;
-        while (ctx->expr[ctx->pos] && ctx->expr[ctx->pos] != '"') {
-            if (ctx->expr[ctx->pos] == '\\' && ctx->expr[ctx->pos + 1])
-                ctx->pos += 2;
-            else
-                ctx->pos++;
+        case AN_JUMP:
+            r = an_eval(ev, n->kids[0], &va);
+            ev->jump = r;
+            ev->is_jump = 1;
+            if (ev->lower && !ev->in_fwd) {
+                id = an_emit1(ev, IR_JUMP, n, va, 0);
+                g_an.ins[id].aux = ev->line;
+            }
+            break;
+
+        case AN_CMD: {
+            int cls = an_command_class(n->text);
+            if (ev->lower) {
+                int ops[AN_NVARS];
+                for (int v = 0; v < AN_NVARS; v++) ops[v] = ir_use(v);
+                id = ir_emit(IR_CMD, ev->line, n);
+                g_an.ins[id].text = n->text;
+                g_an.ins[id].flags = IRF_IMPURE;
+                ir_set_ops(id, AN_NVARS, ops);
+                if (cls == 1 || cls == 3) {
+                    for (int v = 0; v < AN_NVARS; v++) {
+                        int d = ir_emit(cls == 1 ? IR_UNSET : IR_CLOBBER, ev->line, NULL);
+                        ir_set_ops(d, 1, &id);
+                        ir_def(d, v);
+                    }
+                }
+            }
+            for (int v = 0; v < NUM_VARS; v++) {
+                if (cls == 1) ev->st->v[v] = av_flags(AV_UNDEF);
+                if (cls == 3) ev->st->v[v] = av_flags(AV_UNDEF | AV_STR | AV_ANY);
+            }
+            r = av_flags(0);
+            break;
         }
-        int len = ctx->pos - start;
-        result.type = TYPE_STRING;
-        result.data.str = (char *)malloc(len + 1);
-        strncpy(result.data.str, ctx->expr + start, len);
-        result.data.str[len] = '\0';
-        if (ctx->expr[ctx->pos] == '"') ctx->pos++;
-        return result;
+
+        default:
+            r = av_flags(0);
+            break;
     }
 
-    /* ----------------------------------------------------------------
-     * Random number (apostrophe)
-     * '          -> random double in [0, 0.999999]
-     * 'expr      -> set RNG seed to (int)expr, then return 0
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '\'') {
-        ctx->pos++;
+    /* Expression nodes own the instructions emitted while evaluating them */
+    if (ev->lower && id >= first &&
+        (n->kind == AN_NEG || n->kind == AN_NOT || n->kind == AN_CONV ||
+         n->kind == AN_AREAD || n->kind == AN_CALL || n->kind == AN_BINOP ||
+         n->kind == AN_SEED || (n->kind == AN_BLOCK && g_an.ins[id].op == IR_DEFNUM)))
+        g_an.ins[id].first = first;
 
-        skip_whitespace(ctx);
-        if (isdigit((unsigned char)ctx->expr[ctx->pos]) ||
-            IS_VARNAME(ctx->expr[ctx->pos]) ||
-            ctx->expr[ctx->pos] == '(') {
-            /* Parse seed value */
-            Value seed_val = parse_primary(ctx);
-            int seed = (int)value_to_number(seed_val);
-            free_value(&seed_val);
-            srand((unsigned int)seed);
-            result.type = TYPE_NUMBER;
-            result.data.num = 0.0;
-        } else {
-            /* Generate random in [0, 0.999999] */
-            result.type = TYPE_NUMBER;
-            result.data.num = (double)rand() / ((double)RAND_MAX + 1.0);
-        }
-        return result;
-    }
+    if (val) *val = id;
+    return r;
+}
 
-    /* ----------------------------------------------------------------
-     * Keyboard buffer read (colon in expression context)
-     * Returns ASCII code of key in buffer, or 0 if buffer is empty.
-     * Non-blocking (uses PDCurses nodelay).
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == ':') {
-        ctx->pos++;
-        result.type = TYPE_NUMBER;
-        nodelay(stdscr, TRUE);
-        int key = wgetch(stdscr);
-        nodelay(stdscr, FALSE);
-        if (key == KEY_MOUSE) {
-            mmask_t bstate = getmouse();
-            request_mouse_pos();
-            g_tmouse_x = Mouse_status.x;
-            g_tmouse_y = Mouse_status.y;
-            if (bstate & BUTTON1_PRESSED) { g_tmouse_click = 1; g_tmouse_drag |= 1; }
-            if (bstate & BUTTON2_PRESSED) { g_tmouse_click = 2; g_tmouse_drag |= 2; }
-            if (bstate & BUTTON3_PRESSED) { g_tmouse_click = 3; g_tmouse_drag |= 4; }
-            if (bstate & BUTTON1_RELEASED) g_tmouse_drag &= ~1;
-            if (bstate & BUTTON2_RELEASED) g_tmouse_drag &= ~2;
-            if (bstate & BUTTON3_RELEASED) g_tmouse_drag &= ~4;
-            result.data.num = 0.0;
+static void an_exec_line(AnEval *ev) {
+    ev->is_jump = 0;
+    an_eval(ev, g_an.ast[ev->line - 1], NULL);
+}
+
+/* Integer line targets of a jump value; returns 1 if it may fall through */
+static int an_jump_targets(AbsVal t, IntVec *targets, int *dynamic) {
+    int falls = 0;
+    AbsVal num = av_numeric(t);
+    *dynamic = (num.flags & AV_ANY) != 0;
+    if (*dynamic) return 1;
+    for (int i = 0; i < num.n; i++) {
+        double d = num.v[i];
+        int line = (d > -2147483648.0 && d < 2147483648.0) ? (int)d : 0;
+        if (line > 0 && line <= g_an.nlines) {
+            if (!iv_has(targets, line)) iv_push(targets, line);
         } else {
-            result.data.num = (key == ERR) ? 0.0 : (double)key;
+            falls = 1;
         }
-        return result;
     }
+    return falls;
+}
 
-    /* ----------------------------------------------------------------
-     * Input variable (question mark inside expression)
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '?') {
-        ctx->pos++;
-        char input[MAX_LINE_LENGTH];
-        memset(input, 0, sizeof(input));
-        if (repl_mode) {
-            printw("> ");
-            refresh();
+/* ------------------------------------------------------------------ */
+/* Analysis driver                                                      */
+/* ------------------------------------------------------------------ */
+void analysis_free(void) {
+    if (g_an.blocks) {
+        for (int b = 0; b < g_an.nblocks; b++) {
+            AnBlock *bl = &g_an.blocks[b];
+            iv_free(&bl->succ); iv_free(&bl->pred); iv_free(&bl->phis);
+            iv_free(&bl->df); iv_free(&bl->domkids);
         }
-        echo();
-        wgetnstr(stdscr, input, sizeof(input) - 1);
-        noecho();
-        result.type = TYPE_STRING;
-        result.data.str = _strdup(input);
-        return result;
-    }
-
-    /* ----------------------------------------------------------------
-     * Line number variable (#)
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '#') {
-        ctx->pos++;
-        result.type = TYPE_NUMBER;
-        result.data.num = (double)ctx->line_num;
-        return result;
+        free(g_an.blocks);
     }
-
-    /* ----------------------------------------------------------------
-     * Array access (@index)
-     * ---------------------------------------------------------------- */
-    if (ctx->expr[ctx->pos] == '@') {
-        ctx->pos++;
-        Value index_val = parse_primary(ctx);
-        int index = (int)value_to_number(index_val);
-        free_value(&index_val);
-        if (index < 0) index = 0;
-        result.type = TYPE_NUMBER;
-        result.data.num = (index < array_size) ? array_data[index] : 0.0;
-        return result;
+    for (int l = 0; l < g_an.nloops; l++) {
+        iv_free(&g_an.loops[l].blocks);
+        iv_free(&g_an.loops[l].latches);
     }
+    free(g_an.loops);
+    if (g_an.info)
+        for (int i = 0; i < g_an.nlines; i++) iv_free(&g_an.info[i].targets);
+    free(g_an.info);
+    free(g_an.reads);
+    free(g_an.writes);
+    free(g_an.line_block);
+    free(g_an.ast);
+    free(g_an.ins);
+    for (int v = 0; v < NUM_VARS; v++) iv_free(&g_an.fwd_lines[v]);
+    an_arena_free();
+    memset(&g_an, 0, sizeof(g_an));
+}
 
-    /* ----------------------------------------------------------------
-     * Lowercase letter sequence -> screen function or math function call
-     * Screen functions (gotoxy, putch, getch, setfore, setback, setattr,
-     *   getw, geth, clear) receive Value arguments to allow strings.
-     * All other lowercase sequences are dispatched to call_math_function.
-     * e.g.  sin(A)  sqrt(B)  atan2(Y,X)  gotoxy(10,5)
-     * ---------------------------------------------------------------- */
-    if (islower((unsigned char)ctx->expr[ctx->pos])) {
-        char func_name[64];
-        int fi = 0;
-        /* Consume lowercase letters AND digits so log10, log2, atan2 all work */
-        while ((islower((unsigned char)ctx->expr[ctx->pos]) ||
-                isdigit((unsigned char)ctx->expr[ctx->pos])) && fi < 63) {
-            func_name[fi++] = ctx->expr[ctx->pos++];
-        }
-        func_name[fi] = '\0';
-
-        skip_whitespace(ctx);
+static void an_add_edge(int from, int to) {
+    if (iv_has(&g_an.blocks[from].succ, to)) return;
+    iv_push(&g_an.blocks[from].succ, to);
+    iv_push(&g_an.blocks[to].pred, from);
+}
 
-        /* Followed by '(' -> function call with arguments */
-        if (ctx->expr[ctx->pos] == '(') {
-            ctx->pos++;  /* skip '(' */
+/* Fixpoint over line-level states; only leader lines keep a state */
+static int an_resolve_jumps(AnState **state_at, char *leader, AnState *initial) {
+    int n = g_an.nlines;
+    int *queue = (int *)malloc((n + 1) * sizeof(int));
+    char *queued = (char *)calloc(n + 2, 1);
+    int qhead = 0, qcount = 0;
+    AnState dyn;
+    int dyn_active = 0;
+    IntVec targets = {0};
+
+    memset(&dyn, 0, sizeof(dyn));
+
+#define AN_ENQUEUE(l) do { if (!queued[l]) { queued[l] = 1; \
+        queue[(qhead + qcount) % (n + 1)] = (l); qcount++; } } while (0)
+
+    leader[1] = 1;
+    state_at[1] = (AnState *)malloc(sizeof(AnState));
+    *state_at[1] = *initial;
+    AN_ENQUEUE(1);
+
+    while (qcount > 0) {
+        int start = queue[qhead];
+        qhead = (qhead + 1) % (n + 1);
+        qcount--;
+        queued[start] = 0;
+
+        AnState st = *state_at[start];
+        if (!st.live) continue;
+
+        for (int i = start; i <= n; i++) {
+            int changed = 0;
+            if (i != start && leader[i]) {
+                an_state_join(state_at[i], &st, &changed);
+                if (changed) AN_ENQUEUE(i);
+                break;
+            }
 
-            if (is_screen_function(func_name)) {
-                /* Screen functions: collect arguments as Value (allow strings) */
-                Value vargs[MAX_FUNC_ARGS];
-                int vnargs = 0;
+            AnEval ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.st = &st;
+            ev.line = i;
+            an_exec_line(&ev);
+
+            AnNode *ast = g_an.ast[i - 1];
+            if (ast->kind == AN_CMD && an_command_class(ast->text) == 2) break;
+            if (!ev.is_jump) continue;
+
+            int dynamic;
+            targets.n = 0;
+            int falls = an_jump_targets(ev.jump, &targets, &dynamic);
+
+            for (int t = 0; t < targets.n; t++) {
+                int line = targets.v[t];
+                if (!leader[line]) {
+                    leader[line] = 1;
+                    state_at[line] = (AnState *)calloc(1, sizeof(AnState));
+                    for (int k = line - 1; k >= 1; k--)
+                        if (leader[k]) { AN_ENQUEUE(k); break; }
+                }
+                changed = 0;
+                an_state_join(state_at[line], &st, &changed);
+                if (changed) AN_ENQUEUE(line);
+            }
 
-                while (ctx->expr[ctx->pos] != ')' && ctx->expr[ctx->pos] != '\0') {
-                    skip_whitespace(ctx);
-                    if (ctx->expr[ctx->pos] == ')' || ctx->expr[ctx->pos] == '\0') break;
-                    if (vnargs < MAX_FUNC_ARGS)
-                        vargs[vnargs++] = evaluate_expression(ctx);
-                    else {
-                        Value dummy = evaluate_expression(ctx);
-                        free_value(&dummy);
+            if (dynamic) {
+                changed = 0;
+                an_state_join(&dyn, &st, &changed);
+                if (changed) {
+                    if (!dyn_active && n > AN_DYN_MAX) {
+                        free(queue); free(queued); iv_free(&targets);
+                        return 0;
+                    }
+                    dyn_active = 1;
+                    for (int l = 1; l <= n; l++) {
+                        if (!leader[l]) {
+                            leader[l] = 1;
+                            state_at[l] = (AnState *)calloc(1, sizeof(AnState));
+                        }
+                        int c2 = 0;
+                        an_state_join(state_at[l], &dyn, &c2);
+                        if (c2) AN_ENQUEUE(l);
                     }
-                    skip_whitespace(ctx);
-                    if (ctx->expr[ctx->pos] == ',') ctx->pos++;
                 }
-                if (ctx->expr[ctx->pos] == ')') ctx->pos++;
+            }
+            if (!falls) break;
+        }
+    }
+#undef AN_ENQUEUE
 
-                Value sresult = call_screen_function(func_name, vargs, vnargs);
-                for (int i = 0; i < vnargs; i++) free_value(&vargs[i]);
-                return sresult;
+    free(queue);
+    free(queued);
+    iv_free(&targets);
+    return 1;
+}
 
-            } else {
-                /* Math functions: collect arguments as doubles */
-                double args[MAX_FUNC_ARGS];
-                int nargs = 0;
+/* Walk every reached leader range once, recording jump information
+   (pass 0) or lowering lines into their blocks (pass 1). */
+static void an_final_sweep(AnState **state_at, char *leader, int lower) {
+    int n = g_an.nlines;
+    for (int start = 1; start <= n; start++) {
+        if (!leader[start] || !state_at[start] || !state_at[start]->live) continue;
+        AnState st = *state_at[start];
+
+        for (int i = start; i <= n; i++) {
+            if (i != start && leader[i]) break;
+            AnLineInfo *li = &g_an.info[i - 1];
+
+            if (lower) {
+                int b = g_an.line_block[i - 1];
+                if (b != an_cur_block) {
+                    if (an_cur_block >= 0) g_an.blocks[an_cur_block].ins_end = g_an.nins;
+                    an_cur_block = b;
+                    g_an.blocks[b].ins_begin = g_an.nins;
+                    for (int v = 0; v < AN_NVARS; v++) an_cur_def[v] = -1;
+                }
+            }
 
-                while (ctx->expr[ctx->pos] != ')' && ctx->expr[ctx->pos] != '\0') {
-                    skip_whitespace(ctx);
-                    if (ctx->expr[ctx->pos] == ')' || ctx->expr[ctx->pos] == '\0') break;
-                    Value arg_val = evaluate_expression(ctx);
-                    if (nargs < MAX_FUNC_ARGS)
-                        args[nargs++] = value_to_number(arg_val);
-                    free_value(&arg_val);
-                    skip_whitespace(ctx);
-                    if (ctx->expr[ctx->pos] == ',') ctx->pos++;
+            AnEval ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.st = &st;
+            ev.line = i;
+            ev.lower = lower;
+            an_exec_line(&ev);
+            if (g_an.nins > AN_MAX_INS) return;
+
+            AnNode *ast = g_an.ast[i - 1];
+            if (!lower) {
+                li->reached = 1;
+                if (ast->kind == AN_CMD && an_command_class(ast->text) == 2) li->stops = 1;
+                if (ev.is_jump) {
+                    li->is_jump = 1;
+                    li->falls = an_jump_targets(ev.jump, &li->targets, &li->dynamic);
+                } else {
+                    li->falls = !li->stops;
                 }
-                if (ctx->expr[ctx->pos] == ')') ctx->pos++;
+            }
+            if (li->stops || (li->is_jump && !li->falls)) break;
+        }
+    }
+    if (lower && an_cur_block >= 0) g_an.blocks[an_cur_block].ins_end = g_an.nins;
+}
 
-                return call_math_function(func_name, args, nargs);
+/* Cooper-Harvey-Kennedy dominators over the reachable blocks */
+static void an_dominators(void) {
+    int nb = g_an.nblocks;
+    int *order = (int *)malloc(nb * sizeof(int));
+    int *stack = (int *)malloc(nb * 2 * sizeof(int));
+    char *seen = (char *)calloc(nb, 1);
+    int norder = 0, sp = 0;
+
+    /* Iterative DFS post-order from the entry block */
+    stack[sp++] = g_an.entry_block;
+    stack[sp++] = 0;
+    seen[g_an.entry_block] = 1;
+    while (sp > 0) {
+        int next = stack[sp - 1];
+        int b = stack[sp - 2];
+        if (next < g_an.blocks[b].succ.n) {
+            stack[sp - 1]++;
+            int s = g_an.blocks[b].succ.v[next];
+            if (!seen[s]) {
+                seen[s] = 1;
+                stack[sp++] = s;
+                stack[sp++] = 0;
             }
         } else {
-            /* Zero-arg call (e.g. pi, e, getw, geth, getch, clear) */
-            if (is_screen_function(func_name)) {
-                return call_screen_function(func_name, NULL, 0);
-            } else {
-                double dummy_args[1];
-                return call_math_function(func_name, dummy_args, 0);
-            }
+            order[norder++] = b;
+            sp -= 2;
         }
     }
-
-    /* ----------------------------------------------------------------
-     * Single-letter variable: A-Z or '_'
-     * ---------------------------------------------------------------- */
-    if (IS_VARNAME(ctx->expr[ctx->pos])) {
-        int var_idx = VARIDX(ctx->expr[ctx->pos]);
-        ctx->pos++;
-        return get_variable(var_idx);
+    for (int b = 0; b < nb; b++) {
+        g_an.blocks[b].reachable = seen[b];
+        g_an.blocks[b].rpo = -1;
+        g_an.blocks[b].idom = -1;
+    }
+    /* order[] is post-order; rpo number = norder-1-index */
+    for (int i = 0; i < norder; i++) g_an.blocks[order[i]].rpo = norder - 1 - i;
+
+    g_an.blocks[g_an.entry_block].idom = g_an.entry_block;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = norder - 1; i >= 0; i--) {
+            int b = order[i];
+            if (b == g_an.entry_block) continue;
+            int new_idom = -1;
+            IntVec *preds = &g_an.blocks[b].pred;
+            for (int k = 0; k < preds->n; k++) {
+                int p = preds->v[k];
+                if (g_an.blocks[p].idom < 0) continue;
+                if (new_idom < 0) { new_idom = p; continue; }
+                int f1 = p, f2 = new_idom;
+                while (f1 != f2) {
+                    while (g_an.blocks[f1].rpo > g_an.blocks[f2].rpo) f1 = g_an.blocks[f1].idom;
+                    while (g_an.blocks[f2].rpo > g_an.blocks[f1].rpo) f2 = g_an.blocks[f2].idom;
+                }
+                new_idom = f1;
+            }
+            if (new_idom >= 0 && g_an.blocks[b].idom != new_idom) {
+                g_an.blocks[b].idom = new_idom;
+                changed = 1;
+            }
+        }
     }
 
-    /* ----------------------------------------------------------------
-     * Numeric literal
-     * ---------------------------------------------------------------- */
-    if (isdigit((unsigned char)ctx->expr[ctx->pos]) || ctx->expr[ctx->pos] == '.') {
-        char *endptr;
-        result.type = TYPE_NUMBER;
-        result.data.num = strtod(ctx->expr + ctx->pos, &endptr);
-        ctx->pos = (int)(endptr - ctx->expr);
-        return result;
+    for (int b = 0; b < nb; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (!bl->reachable || b == g_an.entry_block) continue;
+        iv_push(&g_an.blocks[bl->idom].domkids, b);
+        if (bl->pred.n < 2) continue;
+        for (int k = 0; k < bl->pred.n; k++) {
+            int runner = bl->pred.v[k];
+            while (runner != bl->idom) {
+                if (!iv_has(&g_an.blocks[runner].df, b)) iv_push(&g_an.blocks[runner].df, b);
+                runner = g_an.blocks[runner].idom;
+            }
+        }
     }
 
-    /* Unknown -> return 0 */
-    result.type = TYPE_NUMBER;
-    result.data.num = 0.0;
-    return result;
+    free(order);
+    free(stack);
+    free(seen);
 }
 
-/* ------------------------------------------------------------------ */
-/* Evaluate expression (left-to-right with binary operators)          */
-/* ------------------------------------------------------------------ */
-Value evaluate_expression(ParseContext *ctx) {
-    Value left = parse_primary(ctx);
-
+static int an_dominates(int a, int b) {
     while (1) {
-        skip_whitespace(ctx);
-
-        char op = ctx->expr[ctx->pos];
+        if (a == b) return 1;
+        if (b == g_an.entry_block) return 0;
+        b = g_an.blocks[b].idom;
+    }
+}
 
-        /* End of expression */
-        if (op == '\0' || op == ')' || op == ';' || op == ',')
-            break;
+/* Natural loops from back edges; loops sharing a header are merged */
+static void an_find_loops(void) {
+    int nb = g_an.nblocks;
+    int *loop_of_header = (int *)malloc(nb * sizeof(int));
+    int *work = (int *)malloc(nb * sizeof(int));
+    for (int b = 0; b < nb; b++) {
+        loop_of_header[b] = -1;
+        g_an.blocks[b].loop = -1;
+    }
 
-        if (op == '+' || op == '-' || op == '*' || op == '/' || op == '%' ||
-            op == '^' || op == '&' || op == '|' || op == '<' || op == '>' || op == '=') {
-            ctx->pos++;
-            Value right = parse_primary(ctx);
-            Value new_left;
-
-            /* String concatenation with '+' */
-            if (op == '+' && (left.type == TYPE_STRING || right.type == TYPE_STRING)) {
-                char *ls = value_to_string(left);
-                char *rs = value_to_string(right);
-                new_left.type = TYPE_STRING;
-                new_left.data.str = (char *)malloc(strlen(ls) + strlen(rs) + 1);
-                strcpy(new_left.data.str, ls);
-                strcat(new_left.data.str, rs);
-                free(ls); free(rs);
-            } else {
-                double ln = value_to_number(left);
-                double rn = value_to_number(right);
-                new_left.type = TYPE_NUMBER;
-
-                switch (op) {
-                    case '+': new_left.data.num = ln + rn; break;
-                    case '-': new_left.data.num = ln - rn; break;
-                    case '*': new_left.data.num = ln * rn; break;
-                    case '/':
-                        new_left.data.num = (rn == 0.0) ? 0.0 : ln / rn;
-                        if (rn == 0.0) { printw("Error: Division by zero\n"); refresh(); }
-                        break;
-                    case '%':
-                        new_left.data.num = (rn == 0.0) ? 0.0 : fmod(ln, rn);
-                        if (rn == 0.0) { printw("Error: Modulo by zero\n"); refresh(); }
-                        break;
-                    case '^': new_left.data.num = pow(ln, rn); break;
-                    case '&': new_left.data.num = (ln != 0.0 && rn != 0.0) ? 1.0 : 0.0; break;
-                    case '|': new_left.data.num = (ln != 0.0 || rn != 0.0) ? 1.0 : 0.0; break;
-                    case '<': new_left.data.num = (ln < rn) ? 1.0 : 0.0; break;
-                    case '>': new_left.data.num = (ln > rn) ? 1.0 : 0.0; break;
-                    case '=': new_left.data.num = (ln == rn) ? 1.0 : 0.0; break;
-                    default:  new_left.data.num = 0.0; break;
+    for (int h = 0; h < nb; h++) {
+        AnBlock *hb = &g_an.blocks[h];
+        if (!hb->reachable) continue;
+        for (int k = 0; k < hb->pred.n; k++) {
+            int u = hb->pred.v[k];
+            if (!g_an.blocks[u].reachable || !an_dominates(h, u)) continue;
+            if (loop_of_header[h] < 0) {
+                g_an.loops = (AnLoop *)realloc(g_an.loops, (g_an.nloops + 1) * sizeof(AnLoop));
+                AnLoop *lp = &g_an.loops[g_an.nloops];
+                memset(lp, 0, sizeof(*lp));
+                lp->header = h;
+                lp->parent = -1;
+                iv_push(&lp->blocks, h);
+                loop_of_header[h] = g_an.nloops++;
+            }
+            AnLoop *lp = &g_an.loops[loop_of_header[h]];
+            iv_push(&lp->latches, u);
+            int nw = 0;
+            if (!iv_has(&lp->blocks, u)) {
+                iv_push(&lp->blocks, u);
+                work[nw++] = u;
+            }
+            while (nw > 0) {
+                int x = work[--nw];
+                for (int j = 0; j < g_an.blocks[x].pred.n; j++) {
+                    int p = g_an.blocks[x].pred.v[j];
+                    if (g_an.blocks[p].reachable && !iv_has(&lp->blocks, p)) {
+                        iv_push(&lp->blocks, p);
+                        work[nw++] = p;
+                    }
                 }
             }
-
-            free_value(&left);
-            free_value(&right);
-            left = new_left;
-        } else {
-            break;
         }
     }
 
-    return left;
-}
-
-/* ------------------------------------------------------------------ */
-/* Execute a REPL command (the part after ':')                        */
-/* Returns 1 if the command was handled, 0 if unknown.                */
-/* ------------------------------------------------------------------ */
-int execute_repl_command(const char *cmd) {
-    if (strcmp(cmd, "help") == 0) {
-        print_repl_help();
-        return 1;
-    }
-    if (strcmp(cmd, "syntax") == 0) {
-        print_repl_syntax_help();
-        return 1;
+    for (int l = 0; l < g_an.nloops; l++) {
+        AnLoop *lp = &g_an.loops[l];
+        lp->dynamic = 1;
+        for (int k = 0; k < lp->latches.n; k++)
+            if (lp->latches.v[k] != g_an.dispatch_block) lp->dynamic = 0;
     }
-    if (strcmp(cmd, "screen") == 0) {
-        print_repl_screen_help();
-        return 1;
+
+    /* Nesting: the parent is the smallest other loop containing the header */
+    for (int l = 0; l < g_an.nloops; l++) {
+        AnLoop *lp = &g_an.loops[l];
+        for (int o = 0; o < g_an.nloops; o++) {
+            if (o == l || !iv_has(&g_an.loops[o].blocks, lp->header)) continue;
+            if (g_an.loops[o].blocks.n < lp->blocks.n ||
+                (g_an.loops[o].blocks.n == lp->blocks.n && o > l)) continue;
+            if (lp->parent < 0 || g_an.loops[o].blocks.n < g_an.loops[lp->parent].blocks.n)
+                lp->parent = o;
+        }
     }
-    if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
-        printw("Arrivederci!\n");
-        refresh();
-        endwin();
-        cleanup_interpreter();
-        exit(0);
+    for (int l = 0; l < g_an.nloops; l++) {
+        int d = 0;
+        for (int p = l; p >= 0; p = g_an.loops[p].parent) d++;
+        g_an.loops[l].depth = d;
+        /* innermost loop of each block: the deepest loop containing it */
+        for (int k = 0; k < g_an.loops[l].blocks.n; k++) {
+            int b = g_an.loops[l].blocks.v[k];
+            int cur = g_an.blocks[b].loop;
+            if (cur < 0 || g_an.loops[cur].depth < d) g_an.blocks[b].loop = l;
+        }
     }
-    if (strcmp(cmd, "vars") == 0) {
-        int found = 0;
-        for (int i = 0; i < NUM_VARS; i++) {
-            if (variables[i].type != TYPE_UNDEFINED) {
-                printw("%c = ", (char)VARCHAR(i));
-                if (variables[i].type == TYPE_NUMBER)
-                    printw("%.15g\n", variables[i].data.num);
-                else
-                    printw("\"%s\"\n", variables[i].data.str);
-                found = 1;
+
+    free(loop_of_header);
+    free(work);
+}
+
+/* Phi placement on iterated dominance frontiers, then renaming */
+static void an_build_ssa(void) {
+    int nb = g_an.nblocks;
+    int *has_phi = (int *)calloc(nb, sizeof(int));
+    int *on_work = (int *)calloc(nb, sizeof(int));
+    int *work = (int *)malloc(nb * sizeof(int));
+
+    for (int v = 0; v < AN_NVARS; v++) {
+        int nw = 0;
+        for (int b = 0; b < nb; b++) {
+            if (g_an.blocks[b].reachable && (g_an.blocks[b].defmask & (1u << v))) {
+                work[nw++] = b;
+                on_work[b] = v + 1;
             }
         }
-        if (!found) printw("No variables defined.\n");
-        refresh();
-        return 1;
-    }
-    if (strcmp(cmd, "array") == 0) {
-        if (array_size == 0) {
-            printw("Array is empty.\n");
-        } else {
-            printw("Array (size: %d):\n", array_size);
-            for (int i = 0; i < array_size && i < 20; i++)
-                printw("  @%d = %.15g\n", i, array_data[i]);
-            if (array_size > 20)
-                printw("  ... (%d elements total)\n", array_size);
+        while (nw > 0) {
+            int b = work[--nw];
+            IntVec *df = &g_an.blocks[b].df;
+            for (int k = 0; k < df->n; k++) {
+                int d = df->v[k];
+                if (has_phi[d] == v + 1) continue;
+                has_phi[d] = v + 1;
+                an_cur_block = d;
+                int id = ir_emit(IR_PHI, g_an.blocks[d].first_line, NULL);
+                g_an.ins[id].var = (signed char)v;
+                g_an.ins[id].nops = g_an.blocks[d].pred.n;
+                g_an.ins[id].ops = (int *)an_alloc(g_an.blocks[d].pred.n * sizeof(int));
+                iv_push(&g_an.blocks[d].phis, id);
+                if (on_work[d] != v + 1) {
+                    on_work[d] = v + 1;
+                    work[nw++] = d;
+                }
+            }
         }
-        refresh();
-        return 1;
     }
-    if (strcmp(cmd, "lines") == 0) {
-        if (line_count == 0) {
-            printw("No lines in program.\n");
-        } else {
-            printw("Program (%d lines):\n", line_count);
-            for (int i = 0; i < line_count && i < 50; i++)
-                printw("  %3d: %s\n", i + 1, source_lines[i]);
-            if (line_count > 50)
-                printw("  ... (%d lines total)\n", line_count);
+    free(has_phi);
+    free(on_work);
+    free(work);
+
+    /* Renaming over the dominator tree with explicit stacks */
+    IntVec vstack[AN_NVARS];
+    memset(vstack, 0, sizeof(vstack));
+    int *pushes = (int *)calloc(nb * AN_NVARS, sizeof(int));
+    IntVec dfs = {0};
+    iv_push(&dfs, g_an.entry_block * 2);
+
+    while (dfs.n > 0) {
+        int item = dfs.v[--dfs.n];
+        int b = item / 2;
+        AnBlock *bl = &g_an.blocks[b];
+
+        if (item & 1) {
+            for (int v = 0; v < AN_NVARS; v++) vstack[v].n -= pushes[b * AN_NVARS + v];
+            continue;
         }
-        refresh();
-        return 1;
-    }
-    if (strcmp(cmd, "clear") == 0) {
-        for (int i = 0; i < NUM_VARS; i++) {
-            if (variables[i].type == TYPE_STRING && variables[i].data.str)
-                free(variables[i].data.str);
-            variables[i].type = TYPE_UNDEFINED;
+
+        for (int k = 0; k < bl->phis.n; k++) {
+            int id = bl->phis.v[k];
+            int v = g_an.ins[id].var;
+            iv_push(&vstack[v], id);
+            pushes[b * AN_NVARS + v]++;
         }
-        if (array_data) { free(array_data); array_data = NULL; }
-        array_size = 0;
-        printw("All variables and array cleared.\n");
-        refresh();
-        return 1;
-    }
-    if (strcmp(cmd, "reset") == 0) {
-        for (int i = 0; i < NUM_VARS; i++) {
-            if (variables[i].type == TYPE_STRING && variables[i].data.str)
-                free(variables[i].data.str);
-            variables[i].type = TYPE_UNDEFINED;
+        /* A placeholder is the value on entry to the block, even when the
+           instruction reading it comes after a store to the variable,
+           as the left operand of B=C+(C=0;0) does */
+        int entry[AN_NVARS];
+        for (int v = 0; v < AN_NVARS; v++)
+            entry[v] = vstack[v].n ? vstack[v].v[vstack[v].n - 1] : -1;
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            IrInst *in = &g_an.ins[id];
+            for (int k = 0; k < in->nops; k++)
+                if (in->ops[k] < 0) in->ops[k] = entry[-in->ops[k] - 1];
+            if (ir_defines(in) && in->var >= 0) {
+                iv_push(&vstack[in->var], id);
+                pushes[b * AN_NVARS + in->var]++;
+            }
         }
-        if (array_data) { free(array_data); array_data = NULL; }
-        array_size = 0;
-        if (source_lines) {
-            for (int i = 0; i < line_count; i++)
-                free(source_lines[i]);
-            free(source_lines);
-            source_lines = NULL;
+        for (int k = 0; k < bl->succ.n; k++) {
+            AnBlock *sb = &g_an.blocks[bl->succ.v[k]];
+            int j = 0;
+            while (j < sb->pred.n && sb->pred.v[j] != b) j++;
+            for (int p = 0; p < sb->phis.n; p++) {
+                IrInst *phi = &g_an.ins[sb->phis.v[p]];
+                IntVec *vs = &vstack[phi->var];
+                phi->ops[j] = vs->n ? vs->v[vs->n - 1] : -1;
+            }
         }
-        line_count = 0;
-        printw("REPL completely reset.\n");
-        refresh();
-        return 1;
+        iv_push(&dfs, b * 2 + 1);
+        for (int k = bl->domkids.n - 1; k >= 0; k--)
+            iv_push(&dfs, bl->domkids.v[k] * 2);
     }
-    if (strncmp(cmd, "debug ", 6) == 0) {
-        char var_name = cmd[6];
-        if ((var_name >= 'A' && var_name <= 'Z') || var_name == '_') {
-            int idx = (var_name == '_') ? 26 : (var_name - 'A');
-            if (variables[idx].type == TYPE_STRING) {
-                printw("Variable %c (string):\n", var_name);
-                printw("  Content: \"");
-                for (int i = 0; variables[idx].data.str[i]; i++)
-                    printw("%c", variables[idx].data.str[i]);
-                printw("\"\n  Bytes (hex): ");
-                for (int i = 0; variables[idx].data.str[i]; i++)
-                    printw("%02X ", (unsigned char)variables[idx].data.str[i]);
-                printw("\n  Bytes (dec): ");
-                for (int i = 0; variables[idx].data.str[i]; i++)
-                    printw("%d ", (unsigned char)variables[idx].data.str[i]);
-                printw("\n");
-            } else if (variables[idx].type == TYPE_NUMBER) {
-                printw("Variable %c = %.15g (number)\n", var_name, variables[idx].data.num);
-            } else {
-                printw("Variable %c is undefined\n", var_name);
+
+    for (int v = 0; v < AN_NVARS; v++) iv_free(&vstack[v]);
+    iv_free(&dfs);
+    free(pushes);
+}
+
+/*
+ * analyze_program() -- build the CFG and SSA IR of source_lines.
+ * 'fresh' means execution starts at line 1 with every variable undefined
+ * (file mode); otherwise variables start with unknown values (REPL).
+ * Returns 1 on success; on failure g_an.error holds the reason.
+ */
+int analyze_program(int fresh) {
+    int n = line_count;
+
+    analysis_free();
+    g_an.nlines = n;
+    g_an.fresh = fresh;
+    g_an.ast = (AnNode **)calloc(n + 1, sizeof(AnNode *));
+    g_an.info = (AnLineInfo *)calloc(n + 1, sizeof(AnLineInfo));
+    g_an.reads = (unsigned *)calloc(n + 1, sizeof(unsigned));
+    g_an.writes = (unsigned *)calloc(n + 1, sizeof(unsigned));
+    g_an.line_block = (int *)calloc(n + 1, sizeof(int));
+
+    an_too_deep = 0;
+    for (int i = 0; i < n; i++) {
+        const char *line = source_lines[i];
+        g_an.ast[i] = an_parse_line(line);
+        an_collect_vars(g_an.ast[i], &g_an.reads[i], &g_an.writes[i]);
+        int pos = 0;
+        while (line[pos] == ' ' || line[pos] == '\t') pos++;
+        if (IS_VARNAME(line[pos]) && line[pos + 1] != '\0')
+            iv_push(&g_an.fwd_lines[VARIDX(line[pos])], i + 1);
+    }
+
+    /* Resolve jump targets */
+    AnState **state_at = (AnState **)calloc(n + 2, sizeof(AnState *));
+    char *leader = (char *)calloc(n + 2, 1);
+    AnState initial;
+    initial.live = 1;
+    for (int v = 0; v < NUM_VARS; v++)
+        initial.v[v] = av_flags(fresh ? AV_UNDEF : (AV_UNDEF | AV_STR | AV_ANY));
+
+    int ok = !an_too_deep && ((n == 0) || an_resolve_jumps(state_at, leader, &initial));
+    if (an_too_deep) g_an.error = "expressions nested too deeply";
+    else if (!ok) g_an.error = "dynamic jumps in a program this large";
+
+    if (ok && n > 0) an_final_sweep(state_at, leader, 0);
+
+    /* Sweeps start at the leaders of the fixpoint; keep them apart from
+       the block boundaries added below */
+    char *sweep_leader = (char *)malloc(n + 2);
+    memcpy(sweep_leader, leader, n + 2);
+
+    /* Basic blocks: entry, one block per leader run, optional dispatch */
+    int has_dispatch = 0;
+    for (int i = 1; ok && i <= n; i++) {
+        AnLineInfo *li = &g_an.info[i - 1];
+        if (li->dynamic) has_dispatch = 1;
+        if (i < n && (li->is_jump || li->stops || !li->reached)) leader[i + 1] = 1;
+        if (li->reached != (i > 1 ? g_an.info[i - 2].reached : 1)) leader[i] = 1;
+    }
+    if (n > 0) leader[1] = 1;
+
+    int nb = 1;
+    for (int i = 1; i <= n; i++) if (leader[i]) nb++;
+    if (has_dispatch) nb++;
+    g_an.blocks = (AnBlock *)calloc(nb, sizeof(AnBlock));
+    g_an.nblocks = nb;
+    g_an.entry_block = 0;
+    g_an.dispatch_block = has_dispatch ? nb - 1 : -1;
+    int b = 0;
+    for (int i = 1; i <= n; i++) {
+        if (leader[i]) {
+            b++;
+            g_an.blocks[b].first_line = i;
+        }
+        g_an.blocks[b].last_line = i;
+        g_an.line_block[i - 1] = b;
+    }
+
+    if (ok) {
+        if (n > 0) an_add_edge(g_an.entry_block, 1);
+        else g_an.blocks[0].exits = 1;
+        for (b = 1; b <= nb - 1 - has_dispatch; b++) {
+            AnBlock *bl = &g_an.blocks[b];
+            AnLineInfo *li = &g_an.info[bl->last_line - 1];
+            if (!li->reached) continue;
+            if (li->is_jump) {
+                for (int t = 0; t < li->targets.n; t++)
+                    an_add_edge(b, g_an.line_block[li->targets.v[t] - 1]);
+                if (li->dynamic) an_add_edge(b, g_an.dispatch_block);
+            }
+            if (li->stops) bl->exits = 1;
+            else if (li->falls) {
+                if (bl->last_line == n) bl->exits = 1;
+                else an_add_edge(b, g_an.line_block[bl->last_line]);
             }
-            refresh();
-        } else {
-            printw("Usage: :debug VARIABLE (e.g. :debug A or :debug _)\n");
-            refresh();
         }
-        return 1;
+        if (has_dispatch)
+            for (b = 1; b < nb - 1; b++) an_add_edge(g_an.dispatch_block, b);
+
+        an_dominators();
+        an_find_loops();
+
+        /* Lower: entry definitions, then every reached line */
+        an_cur_block = g_an.entry_block;
+        g_an.blocks[an_cur_block].ins_begin = 0;
+        for (int v = 0; v < AN_NVARS; v++) {
+            int id = ir_emit(fresh ? IR_UNDEF : IR_ENTRY, 0, NULL);
+            ir_def(id, v);
+        }
+        g_an.blocks[an_cur_block].ins_end = g_an.nins;
+        if (n > 0) an_final_sweep(state_at, sweep_leader, 1);
+        an_cur_block = -1;
+        if (g_an.nins > AN_MAX_INS) {
+            ok = 0;
+            g_an.error = "program too large for the IR budget";
+        }
     }
+    if (ok) an_build_ssa();
 
-    return 0;  /* unknown command */
+    for (int i = 0; i <= n + 1; i++) free(state_at[i]);
+    free(state_at);
+    free(leader);
+    free(sweep_leader);
+
+    g_an.valid = ok;
+    return ok;
 }
 
 /* ------------------------------------------------------------------ */
-/* Execute a single program line                                       */
+/* Loop-invariant code motion                                           */
 /* ------------------------------------------------------------------ */
-void execute_line(int line_num) {
-    if (line_num < 1 || line_num > line_count) return;
-
-    current_line = line_num;
-    const char *line = source_lines[line_num - 1];
+static int an_block_in_loop(int b, int loop) {
+    for (int l = g_an.blocks[b].loop; l >= 0; l = g_an.loops[l].parent)
+        if (l == loop) return 1;
+    return 0;
+}
 
-    ParseContext ctx;
-    ctx.expr = line;
-    ctx.pos = 0;
-    ctx.line_num = line_num;
+/* Outermost loop in which the value of instruction 'id' is invariant, -1 if none.
+   The subexpression must be free of side effects, including forward
+   references, and read only values defined outside that loop. */
+static int licm_invariant_loop(int id) {
+    IrInst *x = &g_an.ins[id];
+    int best = -1;
 
-    skip_whitespace(&ctx);
+    for (int k = x->first; k <= id; k++) {
+        IrInst *in = &g_an.ins[k];
+        if ((in->flags & IRF_IMPURE) || ir_defines(in)) return -1;
+    }
+    for (int l = g_an.blocks[x->block].loop; l >= 0; l = g_an.loops[l].parent) {
+        for (int k = x->first; k <= id; k++) {
+            IrInst *in = &g_an.ins[k];
+            for (int j = 0; j < in->nops; j++) {
+                int o = in->ops[j];
+                if (o >= x->first && o <= id) continue;
+                if (o < 0 || an_block_in_loop(g_an.ins[o].block, l)) return best;
+            }
+        }
+        best = l;
+    }
+    return best;
+}
 
-    /* Empty line */
-    if (ctx.expr[ctx.pos] == '\0') return;
+static int licm_kind(const IrInst *in) {
+    if (in->end <= in->start) return 0;
+    switch (in->op) {
+        case IR_BIN:
+            return HOIST_CHAIN;
+        case IR_CALL: case IR_ALOAD: case IR_DEFNUM:
+            return HOIST_PRIMARY;
+        case IR_NEG: case IR_NOT:
+            return in->first < (int)(in - g_an.ins) ? HOIST_PRIMARY : 0;
+    }
+    return 0;
+}
 
-    /* -----------------------------------------------------------
-     * REPL command (:command) - works both in REPL and in programs
-     * ----------------------------------------------------------- */
-    if (ctx.expr[ctx.pos] == ':') {
-        ctx.pos++;
-        char cmd_buf[256];
-        int ci = 0;
-        while (ctx.expr[ctx.pos] != '\0' && ci < 255)
-            cmd_buf[ci++] = ctx.expr[ctx.pos++];
-        cmd_buf[ci] = '\0';
+/* Build the per-line cache tables used by parse_primary() and
+   evaluate_expression() from the analysed program. */
+void licm_build(void) {
+    hoist_free();
+    if (!g_an.valid || g_an.nloops == 0) return;
+
+    int n = g_an.nlines;
+    int total = 0;
+    hoist_nlines = n;
+    hoist_lines = (HoistLine *)calloc(n + 1, sizeof(HoistLine));
+    hoist_line_loop = (int *)malloc((n + 1) * sizeof(int));
+    hoist_loop_parent = (int *)malloc(g_an.nloops * sizeof(int));
+    hoist_loop_epoch = (unsigned *)malloc(g_an.nloops * sizeof(unsigned));
+    for (int l = 0; l < g_an.nloops; l++) {
+        hoist_loop_parent[l] = g_an.loops[l].parent;
+        hoist_loop_epoch[l] = 1;
+    }
+    hoist_line_loop[0] = -1;
+    for (int i = 1; i <= n; i++) {
+        AnBlock *bl = &g_an.blocks[g_an.line_block[i - 1]];
+        hoist_line_loop[i] = bl->reachable ? bl->loop : -1;
+    }
 
-        if (!execute_repl_command(cmd_buf))
-            printw("Unknown command: :%s\n", cmd_buf);
-        refresh();
-        return;
+    for (int b = 0; b < g_an.nblocks; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (!bl->reachable || bl->loop < 0) continue;
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            IrInst *in = &g_an.ins[id];
+            int kind = licm_kind(in);
+            if (!kind) continue;
+            int loop = licm_invariant_loop(id);
+            if (loop < 0) continue;
+
+            in->flags |= IRF_HOIST;
+            in->aux = loop;
+            HoistLine *hl = &hoist_lines[in->line];
+            hl->e = (HoistEntry *)realloc(hl->e, (hl->n + 1) * sizeof(HoistEntry));
+            HoistEntry *h = &hl->e[hl->n++];
+            h->start = in->start;
+            h->end = in->end;
+            h->kind = kind;
+            h->loop = loop;
+            h->epoch = 0;
+            h->value = 0.0;
+            total++;
+        }
     }
+    if (total == 0) hoist_free();
+}
 
-    /* -----------------------------------------------------------
-     * Print statement: starts with '?'
-     * ----------------------------------------------------------- */
-    if (ctx.expr[ctx.pos] == '?') {
-        ctx.pos++;
-        while (ctx.expr[ctx.pos] == ' ' || ctx.expr[ctx.pos] == '\t') ctx.pos++;
-        if (ctx.expr[ctx.pos] == '=') ctx.pos++;
-        Value result = evaluate_expression(&ctx);
-        apply_attrs();
-        if (result.type == TYPE_NUMBER) {
-            printw("%.15g", result.data.num);
-            refresh();
-            need_newline = 1;
-        } else if (result.type == TYPE_STRING) {
-            print_escaped_string(result.data.str);
-            const char *s = result.data.str;
-            int slen = strlen(s);
-            if (slen == 0)
-                ; /* no output, keep flag as-is */
-            else if (s[slen - 1] == '\n')
-                need_newline = 0;
-            else if (slen >= 2 && s[slen - 2] == '\\' && s[slen - 1] == 'n')
-                need_newline = 0;
-            else
-                need_newline = 1;
+/* A reachable :time or :bench command runs line l */
+static int an_line_timed(int l) {
+    for (int b = 0; b < g_an.nblocks; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (!bl->reachable) continue;
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            long first, last;
+            if (g_an.ins[id].op == IR_CMD && an_command_range(g_an.ins[id].text, &first, &last) &&
+                l >= first && l <= last)
+                return 1;
         }
+    }
+    return 0;
+}
 
-        free_value(&result);
-        return;
+/* ------------------------------------------------------------------ */
+/* Dead line and dead store elimination                                 */
+/* ------------------------------------------------------------------ */
+int dce_enabled = 1;
+static char *dce_removed = NULL;   /* per line (1-based): blanked by dce_run() */
+static int   dce_removed_lines = 0;
+
+/*
+ * Blank lines that cannot run and lines whose only effect is a store no
+ * later read can observe. Lines keep their numbers so computed jumps stay
+ * valid. A line that a forward reference may execute is always kept,
+ * and so is a line that :time or :bench may run. Returns the number of
+ * lines blanked.
+ */
+int dce_run(void) {
+    if (!g_an.valid) return 0;
+
+    int n = g_an.nlines;
+    char *live = (char *)calloc(g_an.nins + 1, 1);
+    char *keep = (char *)calloc(n + 2, 1);      /* line has a live effect */
+    char *fwd_target = (char *)calloc(n + 2, 1);
+    char *timed = (char *)calloc(n + 2, 1);     /* :time or :bench may run it */
+    int *work = (int *)malloc((g_an.nins + 1) * sizeof(int));
+    int nw = 0, removed = 0;
+
+    /* Roots: anything observable; forward reference targets */
+    for (int b = 0; b < g_an.nblocks; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (!bl->reachable) continue;
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            IrInst *in = &g_an.ins[id];
+            if (in->op == IR_FWD) fwd_target[in->aux] = 1;
+            long first, last;
+            if (in->op == IR_CMD && an_command_range(in->text, &first, &last))
+                for (long l = first < 1 ? 1 : first; l <= last && l <= n; l++)
+                    timed[l] = 1;
+            if (!live[id] &&
+                ((in->flags & (IRF_IMPURE | IRF_MAYFAIL)) || in->op == IR_JUMP ||
+                 in->op == IR_PRINT || in->op == IR_CMD || in->op == IR_FWD)) {
+                live[id] = 1;
+                work[nw++] = id;
+            }
+            /* A division proven safe stays safe only if its divisor keeps its inputs */
+            if (in->op == IR_BIN && (in->binop == '/' || in->binop == '%') &&
+                in->ops[1] >= 0 && !live[in->ops[1]]) {
+                live[in->ops[1]] = 1;
+                work[nw++] = in->ops[1];
+            }
+        }
+    }
+    /* A timed line may read an undefined variable, which runs the line
+       that a forward reference from it would */
+    int *trun = (int *)malloc((n + 1) * sizeof(int)), nt = 0;
+    for (int i = 1; i <= n; i++)
+        if (timed[i]) trun[nt++] = i;
+    while (nt > 0) {
+        int l = trun[--nt];
+        for (int v = 0; v < NUM_VARS; v++) {
+            int m = (g_an.reads[l - 1] >> v) & 1 ? an_fwd_line(v, l) : 0;
+            if (m > 0 && !timed[m]) {
+                timed[m] = 1;
+                trun[nt++] = m;
+            }
+        }
+    }
+    free(trun);
+
+    /* Everything a live instruction reads is live, through phis and stores */
+    while (nw > 0) {
+        IrInst *in = &g_an.ins[work[--nw]];
+        for (int k = 0; k < in->nops; k++) {
+            int o = in->ops[k];
+            if (o >= 0 && !live[o]) {
+                live[o] = 1;
+                work[nw++] = o;
+            }
+        }
+    }
+    for (int id = 0; id < g_an.nins; id++) {
+        IrInst *in = &g_an.ins[id];
+        if (in->line > 0 && in->op != IR_PHI && live[id])
+            keep[in->line] = 1;
     }
 
-    /* -----------------------------------------------------------
-     * Array assignment: expr@index = value
-     * ----------------------------------------------------------- */
-    if (isdigit((unsigned char)ctx.expr[ctx.pos]) || IS_VARNAME(ctx.expr[ctx.pos])) {
-        int start_pos = ctx.pos;
-        Value index_val = parse_primary(&ctx);
+    free(dce_removed);
+    dce_removed = (char *)calloc(n + 2, 1);
+    for (int i = 1; i <= n; i++) {
+        const char *line = source_lines[i - 1];
+        if (keep[i] || fwd_target[i] || timed[i] || line[strspn(line, " \t")] == '\0') continue;
+        free(source_lines[i - 1]);
+        source_lines[i - 1] = _strdup("");
+        dce_removed[i] = 1;
+        removed++;
+    }
+    dce_removed_lines += removed;
+
+    free(live);
+    free(keep);
+    free(fwd_target);
+    free(timed);
+    free(work);
+    return removed;
+}
 
-        skip_whitespace(&ctx);
+void optimizer_free(void) {
+    analysis_free();
+    hoist_free();
+    free(dce_removed);
+    dce_removed = NULL;
+    dce_removed_lines = 0;
+}
 
-        if (ctx.expr[ctx.pos] == '@') {
-            ctx.pos++;
-            int index = (int)value_to_number(index_val);
-            free_value(&index_val);
-            if (index < 0) index = 0;
+/* File-mode optimizations; the program must not change afterwards */
+void optimize_program(void) {
+    if (!dce_enabled && !licm_enabled) return;
+    if (!analyze_program(1)) return;
+    if (dce_enabled && dce_run() > 0 && !analyze_program(1)) return;
+    if (licm_enabled) licm_build();
+}
 
-            /* Expand array if needed */
-            if (index >= array_size) {
-                int new_size = index + 1;
-                array_data = (double *)realloc(array_data, new_size * sizeof(double));
-                for (int i = array_size; i < new_size; i++) array_data[i] = 0.0;
-                array_size = new_size;
-            }
+/* ------------------------------------------------------------------ */
+/* Dumps (--dump-cfg / --dump-ir)                                       */
+/* ------------------------------------------------------------------ */
+typedef void (*AnPrintf)(const char *fmt, ...);
 
-            skip_whitespace(&ctx);
-            if (ctx.expr[ctx.pos] == '=') ctx.pos++;
+static void an_print_stdout(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
 
-            Value val = evaluate_expression(&ctx);
-            array_data[index] = value_to_number(val);
+static const char *an_block_name(int b, char *buf) {
+    if (b == g_an.entry_block) return "entry";
+    if (b == g_an.dispatch_block) return "dispatch";
+    sprintf(buf, "B%d", b);
+    return buf;
+}
 
-            if (repl_mode && show_assignments)
-                printw("< @%d = %.15g\n", index, array_data[index]);
+static void an_print_block_list(AnPrintf pr, const IntVec *iv) {
+    char buf[16];
+    if (iv->n == 0) pr(" -");
+    for (int k = 0; k < iv->n; k++) pr(" %s", an_block_name(iv->v[k], buf));
+}
 
-            free_value(&val);
-            return;
+void analysis_dump_cfg(AnPrintf pr) {
+    char buf[16];
+    if (!g_an.valid) {
+        pr("; analysis failed: %s\n", g_an.error ? g_an.error : "unknown reason");
+        return;
+    }
+    pr("; control-flow graph: %d lines, %d blocks, %d loop%s\n",
+       g_an.nlines, g_an.nblocks, g_an.nloops, g_an.nloops == 1 ? "" : "s");
+    if (dce_removed && dce_removed_lines > 0) {
+        pr("; dead lines blanked:");
+        for (int i = 1; i <= g_an.nlines; i++) {
+            if (!dce_removed[i]) continue;
+            int j = i;
+            while (j < g_an.nlines && dce_removed[j + 1]) j++;
+            if (j > i) pr(" %d-%d", i, j);
+            else pr(" %d", i);
+            i = j;
+        }
+        pr("\n");
+    }
+    for (int b = 0; b < g_an.nblocks; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (bl->first_line == 0) {
+            pr("%-9s", an_block_name(b, buf));
+        } else if (bl->first_line == bl->last_line) {
+            pr("%-9s line %d", an_block_name(b, buf), bl->first_line);
+        } else {
+            pr("%-9s lines %d-%d", an_block_name(b, buf), bl->first_line, bl->last_line);
         }
+        if (!bl->reachable) {
+            pr("  unreachable\n");
+            continue;
+        }
+        if (b == g_an.dispatch_block) {
+            pr("  preds");
+            an_print_block_list(pr, &bl->pred);
+            pr("  succs: every line\n");
+            continue;
+        }
+        pr("  preds");
+        an_print_block_list(pr, &bl->pred);
+        pr("  succs");
+        an_print_block_list(pr, &bl->succ);
+        if (bl->exits) pr(" exit");
+        if (bl->loop >= 0) pr("  loop %d", bl->loop);
+        pr("\n");
+        if (bl->last_line > 0) {
+            AnLineInfo *li = &g_an.info[bl->last_line - 1];
+            if (li->is_jump) {
+                pr("          #= at line %d ->", bl->last_line);
+                for (int t = 0; t < li->targets.n; t++) pr(" %d", li->targets.v[t]);
+                if (li->dynamic) pr(" any");
+                if (li->falls) pr(" fallthrough");
+                pr("\n");
+            }
+        }
+    }
+    for (int l = 0; l < g_an.nloops; l++) {
+        AnLoop *lp = &g_an.loops[l];
+        pr("loop %d: header %s (line %d), depth %d, parent ", l,
+           an_block_name(lp->header, buf), g_an.blocks[lp->header].first_line, lp->depth);
+        if (lp->parent < 0) pr("-");
+        else pr("%d", lp->parent);
+        pr(", blocks");
+        an_print_block_list(pr, &lp->blocks);
+        pr(", latches");
+        an_print_block_list(pr, &lp->latches);
+        pr(lp->dynamic ? " (dynamic)\n" : "\n");
+    }
+}
 
-        /* Not an array assignment - reset and fall through */
-        ctx.pos = start_pos;
-        free_value(&index_val);
+static const char *ir_binop_name(char op) {
+    switch (op) {
+        case '+': return "add"; case '-': return "sub"; case '*': return "mul";
+        case '/': return "div"; case '%': return "mod"; case '^': return "pow";
+        case '&': return "and"; case '|': return "or";  case '<': return "lt";
+        case '>': return "gt";  case '=': return "eq";
     }
+    return "bin";
+}
 
-    /* -----------------------------------------------------------
-     * Variable assignment: VAR = expr  (VAR is A-Z or '_')
-     * ----------------------------------------------------------- */
-    if (IS_VARNAME(ctx.expr[ctx.pos])) {
-        int var_idx = VARIDX(ctx.expr[ctx.pos]);
-        ctx.pos++;
+void analysis_print_ins(AnPrintf pr, int id) {
+    IrInst *in = &g_an.ins[id];
+    char buf[16];
+    int col = 0;
+    char text[96];
 
-        skip_whitespace(&ctx);
+    if (in->op == IR_PRINT || in->op == IR_JUMP)
+        snprintf(text, sizeof(text), "  ");
+    else
+        snprintf(text, sizeof(text), "  %%%d = ", id);
+    col = (int)strlen(text);
+    pr("%s", text);
+
+    if (in->op == IR_BIN) snprintf(text, sizeof(text), "%s", ir_binop_name(in->binop));
+    else snprintf(text, sizeof(text), "%s", ir_op_names[in->op]);
+    pr("%s", text);
+    col += (int)strlen(text);
+
+    switch (in->op) {
+        case IR_UNDEF: case IR_ENTRY: case IR_UNSET: case IR_CLOBBER: case IR_FWDDEF:
+            pr(" %c", an_var_char(in->var));
+            col += 2;
+            break;
+        case IR_SET:
+            pr(" %c,", an_var_char(in->var));
+            col += 3;
+            break;
+        case IR_CONST:
+            snprintf(text, sizeof(text), " %.15g", in->num);
+            pr("%s", text);
+            col += (int)strlen(text);
+            break;
+        case IR_STR:
+            snprintf(text, sizeof(text), " \"%.40s\"", in->text);
+            pr("%s", text);
+            col += (int)strlen(text);
+            break;
+        case IR_CALL:
+            snprintf(text, sizeof(text), " %s", in->text);
+            pr("%s", text);
+            col += (int)strlen(text);
+            break;
+        case IR_PHI:
+            pr(" %c", an_var_char(in->var));
+            col += 2;
+            break;
+        case IR_FWD:
+            snprintf(text, sizeof(text), " %c (line %d)", an_var_char(in->var), in->aux);
+            pr("%s", text);
+            col += (int)strlen(text);
+            break;
+        case IR_CMD:
+            snprintf(text, sizeof(text), " :%.30s", in->text);
+            pr("%s", text);
+            col += (int)strlen(text);
+            break;
+    }
 
-        /* Bare variable name -> make it undefined */
-        if (ctx.expr[ctx.pos] == '\0') {
-            if (variables[var_idx].type == TYPE_STRING && variables[var_idx].data.str)
-                free(variables[var_idx].data.str);
-            variables[var_idx].type = TYPE_UNDEFINED;
-            if (repl_mode && show_assignments)
-                printw("< %c = undefined\n", (char)VARCHAR(var_idx));
-            refresh();
-            return;
+    if (in->op == IR_PHI) {
+        AnBlock *bl = &g_an.blocks[in->block];
+        for (int k = 0; k < in->nops; k++) {
+            snprintf(text, sizeof(text), " [%s %%%d]", an_block_name(bl->pred.v[k], buf), in->ops[k]);
+            pr("%s", text);
+            col += (int)strlen(text);
         }
-
-        /* Explicit '=' -> normal assignment */
-        if (ctx.expr[ctx.pos] == '=') {
-            ctx.pos++;
-            Value val = evaluate_expression(&ctx);
-            set_variable(var_idx, val);
-            free_value(&val);
-            return;
+    } else if (in->op != IR_CMD) {
+        for (int k = 0; k < in->nops; k++) {
+            snprintf(text, sizeof(text), "%s %%%d", k ? "," : "", in->ops[k]);
+            pr("%s", text);
+            col += (int)strlen(text);
         }
+    }
 
-        /* Self-referential shorthand: VAR op expr  means  VAR = VAR op expr
-         * Detected when the next character is a binary operator but NOT '='.
-         * Build a synthetic expression "VARop..." and evaluate it.
-         * Examples: A+1  ->  A=A+1
-         *           A*(2+B)  ->  A=A*(2+B)                               */
-        if (ctx.expr[ctx.pos] == '+' || ctx.expr[ctx.pos] == '-' ||
-            ctx.expr[ctx.pos] == '*' || ctx.expr[ctx.pos] == '/' ||
-            ctx.expr[ctx.pos] == '%' || ctx.expr[ctx.pos] == '^' ||
-            ctx.expr[ctx.pos] == '&' || ctx.expr[ctx.pos] == '|' ||
-            ctx.expr[ctx.pos] == '<' || ctx.expr[ctx.pos] == '>') {
-            char synth[MAX_LINE_LENGTH + 2];
-            synth[0] = (char)VARCHAR(var_idx);
-            strncpy(synth + 1, ctx.expr + ctx.pos, MAX_LINE_LENGTH - 1);
-            synth[MAX_LINE_LENGTH] = '\0';
-            ParseContext ctx2;
-            ctx2.expr = synth;
-            ctx2.pos = 0;
-            ctx2.line_num = ctx.line_num;
-            Value val = evaluate_expression(&ctx2);
-            set_variable(var_idx, val);
-            free_value(&val);
-            return;
+    if (in->op == IR_JUMP) {
+        AnLineInfo *li = &g_an.info[in->aux - 1];
+        pr(" ->");
+        col += 3;
+        for (int t = 0; t < li->targets.n; t++) {
+            snprintf(text, sizeof(text), " %d", li->targets.v[t]);
+            pr("%s", text);
+            col += (int)strlen(text);
         }
+        if (li->dynamic) { pr(" any"); col += 4; }
+        if (li->falls) { pr(" fallthrough"); col += 12; }
+    }
 
-        /* Implicit assignment: VAR expr  means  VAR = expr  (e.g. A42) */
-        Value val = evaluate_expression(&ctx);
-        set_variable(var_idx, val);
-        free_value(&val);
-        return;
+    if (in->end > in->start && in->line > 0) {
+        const char *src = source_lines[in->line - 1];
+        int len = in->end - in->start;
+        while (col < 36) { pr(" "); col++; }
+        pr(" ; %.*s%s", len > 40 ? 40 : len, src + in->start, len > 40 ? "..." : "");
+        if (in->flags & IRF_HOIST) pr("  [invariant in loop %d]", in->aux);
     }
+    pr("\n");
+}
 
-    /* -----------------------------------------------------------
-     * Line jump: #=expr
-     * ----------------------------------------------------------- */
-    if (ctx.expr[ctx.pos] == '#') {
-        ctx.pos++;
-        skip_whitespace(&ctx);
-        if (ctx.expr[ctx.pos] == '=') ctx.pos++;
+void analysis_dump_ir(AnPrintf pr) {
+    char buf[16];
+    if (!g_an.valid) {
+        pr("; analysis failed: %s\n", g_an.error ? g_an.error : "unknown reason");
+        return;
+    }
+    pr("; SSA IR: %d instructions\n", g_an.nins);
+    for (int b = 0; b < g_an.nblocks; b++) {
+        AnBlock *bl = &g_an.blocks[b];
+        if (!bl->reachable) continue;
+        pr("%s:", an_block_name(b, buf));
+        if (bl->first_line > 0) {
+            if (bl->first_line == bl->last_line) pr("  ; line %d", bl->first_line);
+            else pr("  ; lines %d-%d", bl->first_line, bl->last_line);
+        }
+        pr("  preds");
+        an_print_block_list(pr, &bl->pred);
+        pr("\n");
+        for (int k = 0; k < bl->phis.n; k++) analysis_print_ins(pr, bl->phis.v[k]);
+        int last_line = -1;
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            IrInst *in = &g_an.ins[id];
+            if (in->line > 0 && in->line != last_line) {
+                pr("  ; %d: %s\n", in->line, source_lines[in->line - 1]);
+                last_line = in->line;
+            }
+            analysis_print_ins(pr, id);
+        }
+    }
+}
 
-        Value val = evaluate_expression(&ctx);
-        int new_line = (int)value_to_number(val);
-        free_value(&val);
+/* ------------------------------------------------------------------ */
+/* :disasm N and :explain N                                             */
+/*                                                                      */
+/* :disasm shows the IR of one line with its block, loop and resolved  */
+/* jump targets. :explain says what the optimizer did with the line    */
+/* and, where it could not help, why. File mode reuses the analysis    */
+/* the optimizations ran on; the REPL analyses the lines typed so far, */
+/* with variables that may hold anything at the start.                 */
+/* ------------------------------------------------------------------ */
+static void an_print_screen(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vw_printw(stdscr, fmt, ap);
+    va_end(ap);
+}
 
-        if (new_line > 0 && new_line <= line_count) {
-            current_line = new_line - 1; /* will be incremented by caller */
+/* Why instruction id is not invariant in its innermost loop */
+static const char *licm_blocker(int id, char *buf, size_t size) {
+    IrInst *x = &g_an.ins[id];
+    int loop = g_an.blocks[x->block].loop;
+    for (int k = x->first; k <= id; k++) {
+        IrInst *in = &g_an.ins[k];
+        if (in->op == IR_FWD)
+            snprintf(buf, size, "may run line %d to set %c (forward reference)",
+                     in->aux, an_var_char(in->var));
+        else if (in->op == IR_CALL && (in->flags & IRF_IMPURE))
+            snprintf(buf, size, "calls %s(), which has effects or a varying result", in->text);
+        else if (in->op == IR_RAND || in->op == IR_SEED || in->op == IR_KEY || in->op == IR_INPUT)
+            snprintf(buf, size, "reads %s", in->op == IR_KEY ? "a key" :
+                     in->op == IR_INPUT ? "input" : "the random generator");
+        else if ((in->flags & IRF_IMPURE) || ir_defines(in))
+            snprintf(buf, size, "has a side effect");
+        else
+            continue;
+        return buf;
+    }
+    for (int k = x->first; k <= id; k++) {
+        IrInst *in = &g_an.ins[k];
+        for (int j = 0; j < in->nops; j++) {
+            int o = in->ops[j];
+            if (o >= x->first && o <= id) continue;
+            if (o < 0)
+                snprintf(buf, size, "reads %c as it was before the program", an_var_char(-(o + 1)));
+            else if (!an_block_in_loop(g_an.ins[o].block, loop))
+                continue;
+            else if (ir_defines(&g_an.ins[o]))
+                snprintf(buf, size, "reads %c, which changes in loop %d", an_var_char(g_an.ins[o].var), loop);
+            else
+                snprintf(buf, size, "uses a value computed in loop %d", loop);
+            return buf;
         }
-        return;
     }
+    snprintf(buf, size, "not invariant");
+    return buf;
+}
 
-    /* -----------------------------------------------------------
-     * Bare expression (for side effects)
-     * ----------------------------------------------------------- */
-    Value val = evaluate_expression(&ctx);
-    free_value(&val);
+static void explain_expr(const IrInst *in, const char *what, const char *why) {
+    const char *src = source_lines[in->line - 1];
+    int len = in->end - in->start;
+    printw("  %s: %.*s%s", what, len > 40 ? 40 : len, src + in->start, len > 40 ? "..." : "");
+    printw(why ? " - %s\n" : "\n", why);
 }
 
-/* ------------------------------------------------------------------ */
-/* Execute program from a given line                                   */
-/* ------------------------------------------------------------------ */
-void execute_from_line(int start_line) {
-    for (current_line = start_line; current_line <= line_count; current_line++) {
-        if (g_interrupted) {
-            g_interrupted = 0;
-            printw("\n[Interrupted]\n");
-            refresh();
-            break;
+/* Loop-invariant caching of the expressions of line l */
+static void explain_licm(int l) {
+    char buf[96];
+    int b = g_an.line_block[l - 1];
+    if (g_an.blocks[b].loop < 0) {
+        printw("  Loop-invariant caching: not in a loop\n");
+        return;
+    }
+    const char *off = !licm_enabled ? "--no-licm" : repl_mode ? "REPL" : NULL;
+    if (off) printw("  Loop-invariant caching is off (%s); it would find:\n", off);
+    /* Going backwards, an expression comes before its subexpressions.
+       Report each outermost one, and the invariant parts of those that
+       are evaluated every time. */
+    int shown = 0, inv_lo = 0, inv_hi = 0, var_lo = 0, var_hi = 0;
+    for (int id = g_an.blocks[b].ins_end - 1; id >= g_an.blocks[b].ins_begin; id--) {
+        IrInst *in = &g_an.ins[id];
+        if (in->line != l || !licm_kind(in) || (id >= inv_lo && id < inv_hi)) continue;
+        int loop = (in->flags & IRF_HOIST) ? in->aux : licm_invariant_loop(id);
+        if (loop >= 0) {
+            snprintf(buf, sizeof(buf), "once per entry to loop %d", loop);
+            explain_expr(in, off ? "Invariant" : "Cached", buf);
+            inv_lo = in->first;
+            inv_hi = id;
+        } else if (id >= var_lo && id < var_hi) {
+            continue;
+        } else {
+            explain_expr(in, "Evaluated every time", licm_blocker(id, buf, sizeof(buf)));
+            var_lo = in->first;
+            var_hi = id;
         }
-        execute_line(current_line);
+        shown++;
     }
+    if (!shown) printw("  Loop-invariant caching: nothing to cache\n");
 }
 
-/* Execute the entire program */
-void execute_program(void) {
-    execute_from_line(1);
+void repl_disasm(const char *arg, int explain) {
+    int l = atoi(arg);
+    if (l < 1 || l > line_count) {
+        printw("Usage: :%s N (program has %d lines)\n", explain ? "explain" : "disasm", line_count);
+        refresh();
+        return;
+    }
+    if (repl_mode || !g_an.valid || g_an.nlines != line_count)
+        analyze_program(!repl_mode);
+    if (!g_an.valid) {
+        printw("Line %d: analysis failed: %s\n", l, g_an.error ? g_an.error : "unknown reason");
+        refresh();
+        return;
+    }
+
+    AnLineInfo *li = &g_an.info[l - 1];
+    int b = g_an.line_block[l - 1];
+    AnBlock *bl = &g_an.blocks[b];
+    char buf[16];
+    printw("Line %d: %s\n", l, source_lines[l - 1]);
+
+    if (!explain) {
+        if (bl->first_line == bl->last_line)
+            printw("  ; block %s, line %d", an_block_name(b, buf), l);
+        else
+            printw("  ; block %s, lines %d-%d", an_block_name(b, buf), bl->first_line, bl->last_line);
+        if (bl->loop >= 0) printw(", loop %d depth %d", bl->loop, g_an.loops[bl->loop].depth);
+        printw(bl->reachable ? "\n" : ", unreachable\n");
+        if (bl->first_line == l)
+            for (int k = 0; k < bl->phis.n; k++) analysis_print_ins(an_print_screen, bl->phis.v[k]);
+        for (int id = bl->ins_begin; id < bl->ins_end; id++)
+            if (g_an.ins[id].line == l) analysis_print_ins(an_print_screen, id);
+        refresh();
+        return;
+    }
+
+    if (dce_removed && dce_removed[l]) {
+        printw("  Blanked by dead line elimination: %s\n",
+               li->reached ? "its only effect is a store nothing reads" : "no path reaches it");
+        refresh();
+        return;
+    }
+    if (!li->reached) {
+        printw("  No path reaches this line%s\n",
+               !dce_enabled || repl_mode ? "" :
+               an_line_timed(l) ? "; kept because :time or :bench runs it" :
+               "; kept because a forward reference may run it");
+    } else if (!repl_mode && dce_enabled) {
+        const char *why = "its result is read later";
+        for (int id = 0; id < g_an.nins; id++)
+            if (g_an.ins[id].op == IR_FWD && g_an.ins[id].aux == l) why = "a forward reference may run it";
+        if (an_line_timed(l)) why = ":time or :bench runs it";
+        int rank = 0;   /* the most visible effect explains it best */
+        for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+            IrInst *in = &g_an.ins[id];
+            if (in->line != l) continue;
+            if (in->op == IR_PRINT && rank < 4) { why = "it prints"; rank = 4; }
+            else if (in->op == IR_JUMP && rank < 3) { why = "it jumps"; rank = 3; }
+            else if ((in->flags & IRF_MAYFAIL) && rank < 2) {
+                why = in->op == IR_BIN ? "it may report a division by zero" : "it may print an @ warning";
+                rank = 2;
+            }
+            else if ((in->flags & IRF_IMPURE) && in->op != IR_FWD && rank < 1) { why = "it has side effects"; rank = 1; }
+        }
+        printw("  Kept by dead line elimination: %s\n", why);
+    }
+    if (li->is_jump) {
+        printw("  Jump targets:");
+        for (int t = 0; t < li->targets.n; t++) printw(" %d", li->targets.v[t]);
+        if (li->falls) printw(" fallthrough");
+        if (li->dynamic)
+            printw(" any\n  The target cannot be bounded: every line is a possible successor,"
+                   " and loops closed by this jump are dynamic. Targets like #+k or (C)*N"
+                   " are bounded.\n");
+        else
+            printw("\n");
+    }
+    for (int id = bl->ins_begin; id < bl->ins_end; id++) {
+        IrInst *in = &g_an.ins[id];
+        if (in->line == l && in->op == IR_FWD)
+            printw("  Reading %c may run line %d (forward reference), so no expression"
+                   " using it is cached\n", an_var_char(in->var), in->aux);
+    }
+    if (li->reached) explain_licm(l);
+    refresh();
 }
 
 /* ------------------------------------------------------------------ */
@@ -1958,11 +7846,16 @@ void print_repl_help(void) {
     printw("  :help         - Show this help\n");
     printw("  :vars         - Show all defined variables\n");
     printw("  :clear        - Clear all variables\n");
-    printw("  :array        - Show array contents\n");
+    printw("  :array [h]    - Show array contents (array h, default 0)\n");
     printw("  :lines        - Show program lines\n");
     printw("  :syntax       - Show syntax help\n");
     printw("  :screen       - Show screen functions help\n");
     printw("  :debug VAR    - Show raw bytes of a variable (e.g. :debug A or :debug _)\n");
+    printw("  :time T       - Run T once and show its time; T is N, N-M or a statement\n");
+    printw("  :bench R T    - Run T R times and show median, min and p95 times\n");
+    printw("  :disasm N     - Show the IR and jump targets of line N\n");
+    printw("  :explain N    - Show which optimizations apply to line N, and why not\n");
+    printw("  :load FILE    - Load an extension DLL with native functions\n");
     printw("  :reset        - Reset the REPL completely (clears everything)\n");
     printw("  :exit/:quit   - Exit the REPL\n");
     printw("\n");
@@ -1988,8 +7881,12 @@ void print_repl_syntax_help(void) {
     printw("  ?              - Input from keyboard (inside expression)\n");
     printw("  $VAR           - Type conversion\n");
     printw("  @index         - Array access\n");
+    printw("  @[h]index      - Access array h (0-255); @ alone is array 0\n");
+    printw("  @(i,j[,k])     - Element at coordinates of the adim() shape\n");
+    printw("  aview(v,a,o,n) - Make @[v] a view of n elements of @[a] from o\n");
     printw("  ;              - Statement separator\n");
     printw("  func(args)     - Math function call (sin, cos, sqrt, etc.)\n");
+    printw("  str(args)      - String function (len, mid, find, upper, etc.)\n");
     printw("  (stmt;stmt)    - Block: execute stmts, return last var value\n");
     printw("  _              - Underscore variable (27th single-letter var)\n");
     printw("\n");
@@ -2273,10 +8170,125 @@ void run_repl(void) {
     }
 }
 
+/* ------------------------------------------------------------------ */
+/* Processor pinning (--cpu N)                                          */
+/*                                                                      */
+/* The interpreter thread allocates, fills and scans every array, so   */
+/* Windows places their pages on the NUMA node of the processor that   */
+/* first touches them. Pinning the thread keeps it, and therefore the  */
+/* arrays, on one node instead of migrating across sockets between     */
+/* timeslices. The graphics thread keeps the process affinity.         */
+/* ------------------------------------------------------------------ */
+static int pin_thread(int cpu) {
+    if (cpu >= (int)(sizeof(DWORD_PTR) * CHAR_BIT) ||
+        !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) {
+        fprintf(stderr, "Error: cannot run on processor %d\n", cpu);
+        return 0;
+    }
+    return 1;
+}
+
 /* ------------------------------------------------------------------ */
 /* Main entry point                                                    */
 /* ------------------------------------------------------------------ */
 int main(int argc, char *argv[]) {
+    const char *source_file = NULL;
+    const char *record_file = NULL, *replay_file = NULL;
+    const char *ext_args[EXT_LIBS_MAX];
+    int dump_cfg = 0, dump_ir = 0, ext_argc = 0;
+
+    /* Command-line options ----------------------------------------- */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dump-cfg") == 0) {
+            dump_cfg = 1;
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            dump_ir = 1;
+        } else if (strcmp(argv[i], "--no-licm") == 0) {
+            licm_enabled = 0;
+        } else if (strcmp(argv[i], "--no-dce") == 0) {
+            dce_enabled = 0;
+        } else if (strcmp(argv[i], "--fast-math") == 0) {
+            fast_math = 1;
+        } else if (strcmp(argv[i], "--check-bounds") == 0) {
+            check_bounds = 1;
+        } else if (strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--replay") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s needs a file name\n", argv[i]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--record") == 0) record_file = argv[i + 1];
+            else replay_file = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--ext") == 0) {
+            if (i + 1 >= argc || ext_argc == EXT_LIBS_MAX) {
+                fprintf(stderr, i + 1 >= argc ? "Error: --ext needs a file name\n"
+                                              : "Error: too many --ext files\n");
+                return 1;
+            }
+            ext_args[ext_argc++] = argv[++i];
+        } else if (strcmp(argv[i], "--virtual-clock") == 0) {
+            char *end = NULL;
+            if (i + 1 < argc) {
+                g_vclock_line = strtod(argv[++i], &end);
+                if (*end == ',') g_vclock_frame = strtod(end + 1, &end);
+            }
+            if (!end || *end || !(g_vclock_line >= 0.0 && g_vclock_frame >= 0.0) ||
+                !(g_vclock_line + g_vclock_frame > 0.0 && g_vclock_line + g_vclock_frame < 1e300)) {
+                fprintf(stderr, "Error: --virtual-clock needs LINE[,FRAME] milliseconds\n");
+                return 1;
+            }
+            g_vclock = 1;
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            char *end = NULL;
+            long n = i + 1 < argc ? strtol(argv[++i], &end, 10) : -1;
+            if (!end || *end || end == argv[i] || n < 0 || n > INT_MAX) {
+                fprintf(stderr, "Error: --cpu needs a processor number\n");
+                return 1;
+            }
+            pin_cpu = (int)n;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            return 1;
+        } else if (!source_file) {
+            source_file = argv[i];
+        }
+    }
+
+    if (pin_cpu >= 0 && !pin_thread(pin_cpu)) return 1;
+
+    /* Analysis dumps go to stdout and never open the screen ---------- */
+    if (dump_cfg || dump_ir) {
+        if (!source_file) {
+            fprintf(stderr, "Error: --dump-cfg/--dump-ir need a source file\n");
+            return 1;
+        }
+        init_interpreter();
+        if (!load_source(source_file)) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", source_file);
+            return 1;
+        }
+        for (int i = 0; i < ext_argc; i++) ext_load(ext_args[i], 0);
+        ext_preload();
+        optimize_program();
+        if (!g_an.valid) analyze_program(1);
+        if (dump_cfg) analysis_dump_cfg(an_print_stdout);
+        if (dump_ir)  analysis_dump_ir(an_print_stdout);
+        int ok = g_an.valid;
+        cleanup_interpreter();
+        return ok ? 0 : 1;
+    }
+
+    if (record_file || replay_file) {
+        if (!source_file) {
+            fprintf(stderr, "Error: --record/--replay need a source file\n");
+            return 1;
+        }
+        if (!rec_open(record_file, replay_file)) {
+            rec_close();
+            return 1;
+        }
+    }
+
     /* Initialise PDCurses ------------------------------------------ */
     initscr();
     start_color();
@@ -2316,11 +8328,12 @@ int main(int argc, char *argv[]) {
     DWORD conMode;
     GetConsoleMode(hIn, &conMode);
     SetConsoleMode(hIn, conMode | ENABLE_PROCESSED_INPUT);
+    for (int i = 0; i < ext_argc; i++) ext_load(ext_args[i], 0);
 
-    if (argc > 1) {
+    if (source_file) {
         /* File mode */
         char filename[MAX_PATH];
-        strncpy(filename, argv[1], MAX_PATH - 1);
+        strncpy(filename, source_file, MAX_PATH - 1);
         filename[MAX_PATH - 1] = '\0';
 
         repl_mode = 0;
@@ -2333,6 +8346,8 @@ int main(int argc, char *argv[]) {
             return 1;
         }
 
+        ext_preload();
+        optimize_program();
         execute_program();
 
         /* In file mode the PDCurses window would disappear the instant
@@ -2342,13 +8357,16 @@ int main(int argc, char *argv[]) {
             addch('\n');
             need_newline = 0;
         }
-        attron(A_REVERSE);
-        printw(" Press any key to exit... ");
-        attroff(A_REVERSE);
-        refresh();
-        keypad(stdscr, TRUE);   /* accept function/arrow keys too */
-        wgetch(stdscr);
-        keypad(stdscr, FALSE);
+        /* A replayed run is unattended: it ends without the pause */
+        if (!replay_file) {
+            attron(A_REVERSE);
+            printw(" Press any key to exit... ");
+            attroff(A_REVERSE);
+            refresh();
+            keypad(stdscr, TRUE);   /* accept function/arrow keys too */
+            wgetch(stdscr);
+            keypad(stdscr, FALSE);
+        }
     } else {
         /* REPL mode */
         run_repl();
@@ -2356,5 +8374,6 @@ int main(int argc, char *argv[]) {
 
     endwin();
     cleanup_interpreter();
+    rec_close();
     return 0;
 }